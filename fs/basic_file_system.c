@@ -1,4 +1,44 @@
 #include "basic_file_system.h"
+#include "journal.h"
+#include <pthread.h>
+#include <string.h>
+
+// in-memory copy of the superblock (the allocation bitmap); every change is
+// made here first and then journaled
+static char superblock[BLOCK_SIZE];
+static pthread_mutex_t superblock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// in-memory copy of the reference count table, also under superblock_lock
+static unsigned char refcounts[REFCOUNT_BLOCKS * BLOCK_SIZE];
+
+// journals the part of the reference count table that holds block's count
+static int write_refcount(block_num_t block) {
+  block_num_t table_block = block / BLOCK_SIZE;
+  return journal_write_shared(REFCOUNT_START + table_block, &refcounts[table_block * BLOCK_SIZE]);
+}
+
+// in-memory copy of the fingerprint table, also under superblock_lock
+static uint16_t fingerprints[NUM_BLOCKS];
+
+// journals the part of the fingerprint table that holds block's fingerprint
+static int write_fingerprint(block_num_t block) {
+  block_num_t table_block = block / (BLOCK_SIZE / sizeof(uint16_t));
+  return journal_write_shared(FINGERPRINT_START + table_block, (char*) fingerprints + table_block * BLOCK_SIZE);
+}
+
+
+// marks the superblock, root directory, tables and journal allocated in the
+// in-memory superblock; returns 1 if any bit changed
+static int mark_reserved() {
+  int changed = 0;
+  for (block_num_t block = 0; block < NUM_BLOCKS; block++) {
+    if ((block < 2 || block >= RESERVED_START) && !(superblock[block / 8] & (1 << (block % 8)))) {
+      superblock[block / 8] |= 1 << (block % 8);
+      changed = 1;
+    }
+  }
+  return changed;
+}
 
 
 int bfs_mount(const char* filename) {
@@ -7,29 +47,77 @@ int bfs_mount(const char* filename) {
     return -1;
   }
 
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
+  // bring the disk up to date with the journal before reading anything
+  if (journal_open() < 0) {
+    raw_unmount();
     return -1;
   }
 
-  // make sure the superblock and root directory are marked "allocated"
-  if (!(superblock[0] & 3)) {
-    superblock[0] |= 3;
-    if (write_block(0, superblock) < 0) {
+  // read the superblock, the reference counts and the fingerprints
+  if (journal_read_block(0, superblock) < 0) {
+    raw_unmount();
+    return -1;
+  }
+  for (int i = 0; i < REFCOUNT_BLOCKS; i++) {
+    if (journal_read_block(REFCOUNT_START + i, &refcounts[i * BLOCK_SIZE]) < 0) {
+      raw_unmount();
+      return -1;
+    }
+  }
+  for (int i = 0; i < FINGERPRINT_BLOCKS; i++) {
+    if (journal_read_block(FINGERPRINT_START + i, (char*) fingerprints + i * BLOCK_SIZE) < 0) {
+      raw_unmount();
       return -1;
     }
   }
+
+  // make sure the superblock, root directory, tables and journal are marked
+  // "allocated"
+  if (mark_reserved() && journal_write_shared(0, superblock) < 0) {
+    raw_unmount();
+    return -1;
+  }
   return 0;
 }
 
 
-block_num_t allocate_block() {
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
-    return 0;
+int bfs_format() {
+  pthread_mutex_lock(&superblock_lock);
+  memset(superblock, 0, sizeof(superblock));
+  memset(refcounts, 0, sizeof(refcounts));
+  memset(fingerprints, 0, sizeof(fingerprints));
+  mark_reserved();
+  int ret = journal_write_shared(0, superblock);
+  for (int i = 0; i < REFCOUNT_BLOCKS; i++) {
+    if (journal_write_shared(REFCOUNT_START + i, &refcounts[i * BLOCK_SIZE]) < 0) {
+      ret = -1;
+    }
+  }
+  for (int i = 0; i < FINGERPRINT_BLOCKS; i++) {
+    if (journal_write_shared(FINGERPRINT_START + i, (char*) fingerprints + i * BLOCK_SIZE) < 0) {
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return ret;
+}
+
+
+unsigned int count_allocated_blocks() {
+  pthread_mutex_lock(&superblock_lock);
+  unsigned int count = 0;
+  for (int i = 0; i < BLOCK_SIZE; i += sizeof(unsigned long long)) {
+    unsigned long long word;
+    memcpy(&word, &superblock[i], sizeof(word));
+    count += __builtin_popcountll(word);
   }
+  pthread_mutex_unlock(&superblock_lock);
+  return count;
+}
+
+
+block_num_t allocate_block() {
+  pthread_mutex_lock(&superblock_lock);
 
   // find the first byte that is all allocated
   int byte;
@@ -38,6 +126,7 @@ block_num_t allocate_block() {
        byte++) {}
   // if all bytes are all allocated, then there are no free blocks
   if (byte == BLOCK_SIZE) {
+    pthread_mutex_unlock(&superblock_lock);
     return 0; // no free blocks
   }
 
@@ -47,6 +136,7 @@ block_num_t allocate_block() {
   for (bit = 0; field & 1 && bit < 8; field >>= 1, bit++) {}
   if (bit == 8) {
     // this should be impossible because we checked that the byte is not all 1's
+    pthread_mutex_unlock(&superblock_lock);
     return 0;
   }
 
@@ -54,7 +144,9 @@ block_num_t allocate_block() {
   superblock[byte] |= 1 << bit;
 
   // write the updated superblock back to disk
-  if (write_block(0, superblock) < 0) {
+  int ret = journal_write_shared(0, superblock);
+  pthread_mutex_unlock(&superblock_lock);
+  if (ret < 0) {
     return 0;
   }
   return byte * 8 + bit;
@@ -62,24 +154,286 @@ block_num_t allocate_block() {
 
 
 int release_block(block_num_t block) {
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
-    return -1;
+  return release_blocks(&block, 1) < 0 ? -1 : 0;
+}
+
+
+int allocate_blocks(block_num_t* blocks, int count) {
+  pthread_mutex_lock(&superblock_lock);
+
+  // take free blocks in order, skipping bytes that are all allocated
+  int found = 0;
+  for (int byte = 0; byte < BLOCK_SIZE && found < count; byte++) {
+    if (superblock[byte] == (char)-1) {
+      continue;
+    }
+    for (int bit = 0; bit < 8 && found < count; bit++) {
+      if (!(superblock[byte] & (1 << bit))) {
+        superblock[byte] |= 1 << bit;
+        blocks[found++] = byte * 8 + bit;
+      }
+    }
   }
 
-  // change bit corresponding to block num to 0
-  char mask = 1 << (block % 8);
-  superblock[block / 8] &= ~mask;
+  // write the updated superblock back to disk
+  if (found > 0 && journal_write_shared(0, superblock) < 0) {
+    found = 0;
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return found;
+}
+
+
+int allocate_run(block_num_t* blocks, int count) {
+  if (count == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&superblock_lock);
+
+  // find the first run of count free blocks
+  int start = 0, length = 0;
+  for (int block = 0; block < NUM_BLOCKS && length < count; block++) {
+    if (superblock[block / 8] & (1 << (block % 8))) {
+      length = 0;
+      start = block + 1;
+    } else {
+      length++;
+    }
+  }
+  if (length < count) {
+    pthread_mutex_unlock(&superblock_lock);
+    return allocate_blocks(blocks, count); // too fragmented; take any blocks
+  }
+
+  for (int i = 0; i < count; i++) {
+    block_num_t block = start + i;
+    superblock[block / 8] |= 1 << (block % 8);
+    blocks[i] = block;
+  }
 
   // write the updated superblock back to disk
-  if (write_block(0, superblock) < 0) {
-    return -1;
+  int found = count;
+  if (journal_write_shared(0, superblock) < 0) {
+    for (int i = 0; i < count; i++) { // the blocks stay free
+      superblock[blocks[i] / 8] &= ~(1 << (blocks[i] % 8));
+    }
+    found = 0;
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return found;
+}
+
+
+int allocate_run_in(block_num_t* blocks, int count, block_num_t from, block_num_t limit) {
+  if (count == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&superblock_lock);
+
+  // find the first run of count free blocks in [from, limit)
+  int start = from, length = 0;
+  for (int block = from; block < limit && length < count; block++) {
+    if (superblock[block / 8] & (1 << (block % 8))) {
+      length = 0;
+      start = block + 1;
+    } else {
+      length++;
+    }
+  }
+  if (length < count) {
+    pthread_mutex_unlock(&superblock_lock);
+    return 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    block_num_t block = start + i;
+    superblock[block / 8] |= 1 << (block % 8);
+    blocks[i] = block;
+  }
+  int found = count;
+  if (journal_write_shared(0, superblock) < 0) {
+    for (int i = 0; i < count; i++) { // the blocks stay free
+      superblock[blocks[i] / 8] &= ~(1 << (blocks[i] % 8));
+    }
+    found = 0;
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return found;
+}
+
+
+int release_blocks(const block_num_t* blocks, int count) {
+  if (count == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&superblock_lock);
+
+  // change the bits corresponding to the blocks to 0, unless a block is
+  // shared, in which case it just loses a reference
+  int ret = 0;
+  int freed = 0;
+  for (int i = 0; i < count; i++) {
+    if (refcounts[blocks[i]] > 0) {
+      refcounts[blocks[i]]--;
+      if (write_refcount(blocks[i]) < 0) {
+        ret = -1;
+      }
+      continue;
+    }
+    // a freed block's fingerprint goes first, so that it can never be
+    // found while the block is reused
+    if (fingerprints[blocks[i]]) {
+      fingerprints[blocks[i]] = 0;
+      if (write_fingerprint(blocks[i]) < 0) {
+        ret = -1;
+      }
+    }
+    char mask = 1 << (blocks[i] % 8);
+    superblock[blocks[i] / 8] &= ~mask;
+    freed++;
+  }
+
+  // write the updated superblock back to disk; until the release is in the
+  // log, the freed blocks must not be overwritten in place
+  if (freed && journal_write_shared(0, superblock) < 0) {
+    ret = -1;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!(superblock[blocks[i] / 8] & (1 << (blocks[i] % 8)))) {
+      journal_release_block(blocks[i]);
+    }
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return ret < 0 ? -1 : freed;
+}
+
+
+int share_blocks(const block_num_t* blocks, int count) {
+  pthread_mutex_lock(&superblock_lock);
+
+  // all or nothing: first make sure every block can take another reference
+  for (int i = 0; i < count; i++) {
+    int refs = refcounts[blocks[i]];
+    for (int j = 0; j < i; j++) {
+      refs += blocks[j] == blocks[i];
+    }
+    if (refs >= MAX_SHARED_REFS) {
+      pthread_mutex_unlock(&superblock_lock);
+      return -1;
+    }
+  }
+
+  int ret = 0;
+  for (int i = 0; i < count; i++) {
+    refcounts[blocks[i]]++;
+    if (write_refcount(blocks[i]) < 0) {
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return ret;
+}
+
+
+int prepare_overwrite(block_num_t block) {
+  pthread_mutex_lock(&superblock_lock);
+  int shared = refcounts[block] > 0;
+  if (!shared && fingerprints[block]) {
+    fingerprints[block] = 0;
+    write_fingerprint(block);
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return shared;
+}
+
+
+int move_block(block_num_t from, block_num_t to) {
+  pthread_mutex_lock(&superblock_lock);
+  int ret = refcounts[from] > 0;
+  if (!ret && fingerprints[from]) {
+    fingerprints[to] = fingerprints[from];
+    fingerprints[from] = 0;
+    if (write_fingerprint(to) < 0 || write_fingerprint(from) < 0) {
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return ret;
+}
+
+
+int block_allocated(block_num_t block) {
+  pthread_mutex_lock(&superblock_lock);
+  int allocated = (superblock[block / 8] & (1 << (block % 8))) != 0;
+  pthread_mutex_unlock(&superblock_lock);
+  return allocated;
+}
+
+
+int block_shared(block_num_t block) {
+  pthread_mutex_lock(&superblock_lock);
+  int shared = refcounts[block] > 0;
+  pthread_mutex_unlock(&superblock_lock);
+  return shared;
+}
+
+
+uint16_t block_fingerprint(const void* data) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    hash = (hash ^ ((const unsigned char*) data)[i]) * 16777619u;
+  }
+  uint16_t fingerprint = hash ^ (hash >> 16);
+  return fingerprint ? fingerprint : 1;
+}
+
+
+int set_fingerprint(block_num_t block, uint16_t fingerprint) {
+  pthread_mutex_lock(&superblock_lock);
+  int ret = 0;
+  if (fingerprints[block] != fingerprint) {
+    fingerprints[block] = fingerprint;
+    ret = write_fingerprint(block);
+  }
+  pthread_mutex_unlock(&superblock_lock);
+  return ret;
+}
+
+
+block_num_t share_duplicate(const void* data, uint16_t fingerprint) {
+  // candidates are compared without holding the lock, so each one is
+  // checked again before it is shared: a block that was overwritten
+  // (see prepare_overwrite) or freed in the meantime has lost its fingerprint
+  for (block_num_t block = 2; block < RESERVED_START; block++) {
+    pthread_mutex_lock(&superblock_lock);
+    int candidate = fingerprints[block] == fingerprint;
+    pthread_mutex_unlock(&superblock_lock);
+    char contents[BLOCK_SIZE];
+    if (!candidate || read_block(block, contents) < 0 || memcmp(contents, data, BLOCK_SIZE)) {
+      continue;
+    }
+
+    pthread_mutex_lock(&superblock_lock);
+    int shared = fingerprints[block] == fingerprint && refcounts[block] < MAX_SHARED_REFS
+      && (superblock[block / 8] & (1 << (block % 8)));
+    if (shared) {
+      refcounts[block]++;
+      write_refcount(block);
+    }
+    pthread_mutex_unlock(&superblock_lock);
+    if (shared) {
+      return block;
+    }
   }
   return 0;
 }
 
 
 int bfs_unmount() {
+  // write everything still in the journal back home first
+  if (journal_close() < 0) {
+    raw_unmount();
+    return -1;
+  }
   return raw_unmount();
 }
@@ -2,9 +2,44 @@
 #define _BASIC_FILE_SYSTEM_H_
 
 #include "raw_disk.h"
+#include "journal.h"
+
+// one byte per block counting the references to it beyond the first (0 for
+// blocks that are not shared), stored in the REFCOUNT_BLOCKS blocks right
+// before the journal
+#define REFCOUNT_BLOCKS (NUM_BLOCKS / BLOCK_SIZE)
+#define REFCOUNT_START (JOURNAL_START - REFCOUNT_BLOCKS)
+
+// a 16-bit fingerprint of the contents of each data block that a
+// deduplicating write may share (0 for none), stored in the
+// FINGERPRINT_BLOCKS blocks right before the reference count table
+#define FINGERPRINT_BLOCKS (NUM_BLOCKS * 2 / BLOCK_SIZE)
+#define FINGERPRINT_START (REFCOUNT_START - FINGERPRINT_BLOCKS)
+
+// the tables and the journal fill the end of the disk from here on
+#define RESERVED_START FINGERPRINT_START
+
+// the most references a block can have beyond the first
+#define MAX_SHARED_REFS 255
 
 int bfs_mount(const char* filename);
 
+/* bfs_format
+ *   marks every block free except the superblock, root directory, tables and
+ *   journal, and clears all reference counts and fingerprints
+ * returns 0 on success and -1 on failure
+ */
+int bfs_format();
+
+/* count_allocated_blocks
+ *   counts the blocks marked allocated in the superblock (a popcount of the
+ *   bitmap, so it takes time proportional to the bitmap's size)
+ */
+unsigned int count_allocated_blocks();
+
+// (allocate_block, release_block and their multi-block versions may be
+//  called from any number of threads at once)
+
 /* allocate_block
  *   allocates a new block - finds a block that not yet allocated, marks it as
  *   allocated, and returns its block number - blocks marked as allocated will
@@ -24,9 +59,108 @@ block_num_t allocate_block();
  * (Failure of release_block() should only happen if there is an error
  *  accessing the underlying _real_ file system.  Releasing a block that is
  *  not allocated is _not_ an error; it's just a no-op.)
+ * Releasing a shared block (see share_blocks) only drops one reference to
+ * it; the block is freed once its last reference is released.
+ * The bitmap change is journaled ahead of the caller's transaction, so a
+ * block must only be released after the transaction that stopped using it
+ * has ended.
  */
 int release_block(block_num_t block);
 
+/* allocate_blocks
+ *   allocates up to count blocks at once, with a single pass over the
+ *   superblock, and stores their numbers (in increasing order) in blocks
+ * returns the number of blocks allocated, which is less than count only if
+ * the disk ran out of free blocks
+ */
+int allocate_blocks(block_num_t* blocks, int count);
+
+/* allocate_run
+ *   like allocate_blocks, but takes the first run of count consecutive free
+ *   blocks so the caller can write them with one write_blocks() call; if no
+ *   run is long enough, falls back to whatever free blocks there are
+ * returns the number of blocks allocated, which is less than count only if
+ * the disk ran out of free blocks
+ */
+int allocate_run(block_num_t* blocks, int count);
+
+/* allocate_run_in
+ *   like allocate_run, but only takes a run of count consecutive free blocks
+ *   that starts at or after from and ends before limit, with no fallback
+ * returns count on success, or 0 if there is no such run
+ */
+int allocate_run_in(block_num_t* blocks, int count, block_num_t from, block_num_t limit);
+
+/* release_blocks
+ *   releases count blocks at once, with a single update of the superblock
+ * returns the number of blocks actually freed (shared blocks only lose a
+ * reference) on success and -1 on failure
+ */
+int release_blocks(const block_num_t* blocks, int count);
+
+/* share_blocks
+ *   adds one reference to each of count allocated blocks, so that each takes
+ *   one more release_block() to be freed; either all of the blocks get the
+ *   new reference or none do.  The change is journaled ahead of the caller's
+ *   transaction, which is safe (a crash can only leave a count too high).
+ * returns 0 on success and -1 on failure (including when a block already
+ * has MAX_SHARED_REFS extra references)
+ */
+int share_blocks(const block_num_t* blocks, int count);
+
+/* prepare_overwrite
+ *   decides whether the caller may write over an allocated block in place:
+ *   it may not if the block is shared (the caller must copy it to a new
+ *   block instead).  Otherwise the block's fingerprint is dropped first, so
+ *   that share_duplicate() cannot start sharing it during the write.
+ * returns 1 if the block has more than one reference, 0 otherwise
+ */
+int prepare_overwrite(block_num_t block);
+
+/* move_block
+ *   prepares to move the contents of an allocated block, which the caller
+ *   has already copied to the allocated block to, by handing its fingerprint
+ *   on to the new block (so share_duplicate() stops finding the old one).
+ *   A shared block cannot be moved, since only one of the files holding it
+ *   would follow.  The caller releases from once it is no longer used.
+ * returns 0 on success, 1 if from is shared (nothing is changed), or -1 on
+ * failure
+ */
+int move_block(block_num_t from, block_num_t to);
+
+/* block_allocated
+ *   returns 1 if the block is marked allocated in the superblock, 0 if not
+ */
+int block_allocated(block_num_t block);
+
+/* block_shared
+ *   returns 1 if the block has more than one reference, 0 if not
+ */
+int block_shared(block_num_t block);
+
+/* block_fingerprint
+ *   hashes BLOCK_SIZE bytes of data down to a nonzero 16-bit fingerprint
+ *   (FNV-1a folded in half; fast, but not collision resistant)
+ */
+uint16_t block_fingerprint(const void* data);
+
+/* set_fingerprint
+ *   records the fingerprint of an allocated block whose contents the caller
+ *   has just written and will not change in place again (other than after
+ *   prepare_overwrite()).  Fingerprints are only hints, so the change is
+ *   journaled ahead of the caller's transaction.
+ * returns 0 on success and -1 on failure
+ */
+int set_fingerprint(block_num_t block, uint16_t fingerprint);
+
+/* share_duplicate
+ *   looks for an allocated block with the given fingerprint whose contents
+ *   are the same BLOCK_SIZE bytes as data (every candidate is compared byte
+ *   by byte) and adds one reference to it, like share_blocks()
+ * returns the block found, or 0 if there is none (or it is shared too often)
+ */
+block_num_t share_duplicate(const void* data, uint16_t fingerprint);
+
 int bfs_unmount();
 
 #endif // _BASIC_FILE_SYSTEM_H_
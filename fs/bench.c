@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "jumbo_file_system.h"
+
+#define DISK_FILENAME "BENCH_DISK"
+#define DEFAULT_ITERATIONS 2000
+#define SMALL_APPEND 16                 // stays in the inode
+#define LARGE_APPEND (4 * BLOCK_SIZE)   // spills into several blocks
+
+// the operations timed; each iteration runs them all once, in this order
+enum {
+  OP_CREAT, OP_APPEND_SMALL, OP_APPEND_LARGE, OP_STAT, OP_READ, OP_LS, OP_LISTDIR, OP_REMOVE, OP_MKDIR, OP_RMDIR,
+  OP_SYNC, // where the journal and buffered appends are written out
+  NUM_OPS
+};
+static const char* op_names[NUM_OPS] = {
+  "creat", "append_small", "append_large", "stat", "read", "ls", "listdir", "remove", "mkdir", "rmdir", "sync"
+};
+
+// Measurements of one operation at one fill level
+struct op_result {
+  double* latencies; // seconds, one per iteration
+  double total;
+  unsigned long blocks_read, blocks_written;
+};
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+/* run_op
+ *   runs one operation in the benchmark directory, timing it and counting
+ *   the blocks it reads and writes
+ * returns the operation's return code
+ */
+static int run_op(int op, struct jfs_session* session, struct op_result* result, int iteration) {
+  static char data[LARGE_APPEND], buf[MAX_FILE_SIZE];
+  char* directories[MAX_DIR_ENTRIES+1];
+  char* files[MAX_DIR_ENTRIES+1];
+  struct stats stats;
+  struct jfs_listing* listing = NULL;
+  unsigned short count = MAX_FILE_SIZE;
+
+  struct jfs_cache_stats before, after;
+  jfs_cache_stats(&before);
+  double start = now();
+  int ret = E_UNKNOWN;
+  switch (op) {
+  case OP_CREAT:        ret = jfs_creat(session, "f"); break;
+  case OP_APPEND_SMALL: ret = jfs_write(session, "f", data, SMALL_APPEND); break;
+  case OP_APPEND_LARGE: ret = jfs_write(session, "f", data, LARGE_APPEND); break;
+  case OP_STAT:         ret = jfs_stat(session, "f", &stats); break;
+  case OP_READ:         ret = jfs_read(session, "f", buf, &count); break;
+  case OP_LS:           ret = jfs_ls(session, directories, files); break;
+  case OP_LISTDIR:      ret = jfs_listdir(session, NULL, &listing); break;
+  case OP_REMOVE:       ret = jfs_remove(session, "f"); break;
+  case OP_MKDIR:        ret = jfs_mkdir(session, "d"); break;
+  case OP_RMDIR:        ret = jfs_rmdir(session, "d"); break;
+  case OP_SYNC:         ret = jfs_sync(); break;
+  }
+  double elapsed = now() - start;
+  jfs_cache_stats(&after);
+
+  if (OP_LS == op && E_SUCCESS == ret) {
+    for (int i = 0; directories[i]; i++) {
+      free(directories[i]);
+    }
+    for (int i = 0; files[i]; i++) {
+      free(files[i]);
+    }
+  }
+  if (OP_LISTDIR == op && E_SUCCESS == ret) {
+    jfs_free_listing(listing);
+  }
+  result->latencies[iteration] = elapsed;
+  result->total += elapsed;
+  result->blocks_read += after.cache.blocks_read - before.cache.blocks_read;
+  result->blocks_written += after.cache.blocks_written - before.cache.blocks_written;
+  return ret;
+}
+
+
+/* run_level
+ *   runs the benchmark in a directory that already holds fill other files,
+ *   and prints the results for each operation as JSON objects
+ * returns 0 on success or -1 if an operation failed
+ */
+static int run_level(int fill, int iterations, int first) {
+  struct jfs_session session;
+  jfs_session_init(&session);
+  char dir[16];
+  snprintf(dir, sizeof(dir), "fill%d", fill);
+  if (jfs_mkdir(&session, dir) != E_SUCCESS || jfs_chdir(&session, dir) != E_SUCCESS) {
+    return -1;
+  }
+  for (int i = 0; i < fill; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "x%d", i);
+    jfs_creat(&session, name);
+  }
+
+  struct op_result results[NUM_OPS];
+  memset(results, 0, sizeof(results));
+  for (int op = 0; op < NUM_OPS; op++) {
+    results[op].latencies = malloc(iterations * sizeof(double));
+  }
+  for (int i = 0; i < iterations; i++) {
+    for (int op = 0; op < NUM_OPS; op++) {
+      if (run_op(op, &session, &results[op], i) != E_SUCCESS) {
+        fprintf(stderr, "%s failed at fill level %d\n", op_names[op], fill);
+        return -1;
+      }
+    }
+  }
+
+  for (int op = 0; op < NUM_OPS; op++) {
+    struct op_result* result = &results[op];
+    qsort(result->latencies, iterations, sizeof(double), compare_doubles);
+    printf("%s    {\"op\": \"%s\", \"fill\": %d, \"iterations\": %d, \"ops_per_sec\": %.0f, "
+           "\"p50_us\": %.3f, \"p99_us\": %.3f, \"block_reads_per_op\": %.3f, \"block_writes_per_op\": %.3f}",
+           first && op == 0 ? "" : ",\n", op_names[op], fill, iterations, iterations / result->total,
+           result->latencies[iterations / 2] * 1e6, result->latencies[iterations * 99 / 100] * 1e6,
+           (double) result->blocks_read / iterations, (double) result->blocks_written / iterations);
+    free(result->latencies);
+  }
+  return 0;
+}
+
+
+int main(int argc, char** argv) {
+  const char* disk = DISK_FILENAME;
+  int iterations = DEFAULT_ITERATIONS;
+  if (argc > 1) disk = argv[1];
+  if (argc > 2) iterations = atoi(argv[2]);
+  if (argc > 3 || iterations <= 0) {
+    fprintf(stderr, "usage: %s [disk_file] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  // a fresh disk each run, so that runs can be compared
+  remove(disk);
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    return 1;
+  }
+
+  // an empty directory, a half full one and one with room for just the
+  // benchmark's file and directory
+  int fills[] = { 0, (MAX_DIR_ENTRIES - 2) / 2, MAX_DIR_ENTRIES - 2 };
+  printf("{\n  \"version\": %d,\n  \"block_size\": %d,\n  \"num_blocks\": %d,\n  \"results\": [\n",
+         JFS_VERSION, BLOCK_SIZE, NUM_BLOCKS);
+  int ret = 0;
+  for (unsigned int i = 0; i < sizeof(fills) / sizeof(fills[0]) && ret == 0; i++) {
+    ret = run_level(fills[i], iterations, i == 0);
+  }
+  printf("\n  ]\n}\n");
+
+  jfs_unmount();
+  return ret < 0;
+}
@@ -2,15 +2,40 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include "jumbo_file_system.h"
 
 #define DISK_FILENAME "DISK"
-#define MAX_CMD_LENGTH 2048
-#define MAX_ARGS 2
+#define MAX_ARGS 3
 #define WHITESPACE_DELIM " \t\r\n"
+#define CAT_CHUNK_SIZE (4 * BLOCK_SIZE)
+#define BATCH_BUFFER_SIZE (64 * 1024) // stdout buffer in batch mode
+
+// Status of a command, printed after it in batch mode: E_SUCCESS, one of
+// the E_* error codes, or one of these
+#define STATUS_USAGE 1 // bad arguments or unknown command
+#define STATUS_BLANK 2 // blank or comment line; no status is printed
+
+static struct jfs_session session;
+static int status; // of the command being run
+static int exiting; // set by the exit command
+
+
+// prints a usage message and fails the command
+static void usage(const char* message) {
+  fputs(message, stderr);
+  status = STATUS_USAGE;
+}
 
 
 void print_error(int err, const char* name) {
+    status = err;
     switch (err) {
     case E_SUCCESS:
       break; // do nothing
@@ -39,7 +64,10 @@ void print_error(int err, const char* name) {
       printf("file is full (max file size reached)\n");
       break;
     case E_DISK_FULL:
-      printf("disk is full");
+      printf("disk is full\n");
+      break;
+    case E_NO_DATA:
+      printf("no data past the given offset in %s\n", name);
       break;
     case E_UNKNOWN:
       printf("an unknown error occurred\n");
@@ -50,103 +78,439 @@ void print_error(int err, const char* name) {
 }
 
 
+// prints what jfs_frag_stats() measured on one line
+static void print_frag_stats(const char* label, const struct jfs_frag_stats* stats) {
+  printf("%s%u/%u files fragmented, %u extents for %u blocks (%.2f per file), "
+         "%u free blocks in %u extents (largest %u, %u at the end)\n",
+         label, stats->fragmented_files, stats->files, stats->extents, stats->data_blocks,
+         stats->files ? (double) stats->extents / stats->files : 0.0, stats->free_blocks,
+         stats->free_extents, stats->largest_free_extent, stats->tail_free_blocks);
+}
+
+
+// Running totals for du: blocks used under each directory on the way down
+struct du_state {
+  unsigned int blocks[NUM_BLOCKS + 1]; // index depth + 1 sums the entries at depth
+};
+
+
+// jfs_walk() callback for du, which walks in postorder: prints each
+// directory's total once everything under it has been counted
+static int du_visit(const struct jfs_walk_entry* entry, void* arg) {
+  struct du_state* state = arg;
+  unsigned int blocks = 1; // the dir block or the inode
+  if (!entry->is_dir) {
+    blocks += state->blocks[entry->depth + 1];
+    state->blocks[entry->depth + 1] = 0;
+    printf("%u\t%s\n", blocks * BLOCK_SIZE, entry->path);
+  } else {
+    blocks += entry->num_data_blocks;
+  }
+  state->blocks[entry->depth] += blocks;
+  return 0;
+}
+
+
+// jfs_walk() callback for find: prints the paths of entries whose name
+// matches the pattern in arg
+static int find_visit(const struct jfs_walk_entry* entry, void* arg) {
+  if (0 == fnmatch(arg, entry->name, 0)) {
+    printf("%s%s\n", entry->path, entry->is_dir ? "" : "/");
+  }
+  return 0;
+}
+
+
+// What import and export copied
+struct transfer_stats {
+  unsigned int files, dirs;
+  unsigned long bytes;
+};
+
+
+// reads a whole host file of the given size into buf (one read() call for
+// the files that fit in the file system); returns 0 on success or -1
+static int read_host_file(const char* path, char* buf, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t got = read(fd, buf + done, size - done);
+    if (got <= 0) {
+      close(fd);
+      return -1;
+    }
+    done += got;
+  }
+  close(fd);
+  return 0;
+}
+
+
+/* import_dir
+ *   copies the contents of a host directory into the current directory of
+ *   dir_session, recursively.  All the entries of a directory are created
+ *   with one jfs_batch() call, and then each file's blocks are preallocated
+ *   and its data read from the host in one go and written with one append.
+ *   Directories that already exist are merged into; anything else that
+ *   cannot be created is reported and skipped.
+ */
+static void import_dir(const char* host_path, struct jfs_session* dir_session, struct transfer_stats* stats) {
+  DIR* dir = opendir(host_path);
+  if (NULL == dir) {
+    perror(host_path);
+    return;
+  }
+
+  // collect the directories and regular files first, to create them together
+  struct jfs_op* ops = NULL;
+  char (*names)[NAME_MAX + 1] = NULL;
+  off_t* sizes = NULL;
+  int num_ops = 0;
+  char path[PATH_MAX];
+  struct dirent* dirent;
+  while (NULL != (dirent = readdir(dir))) {
+    if (0 == strcmp(dirent->d_name, ".") || 0 == strcmp(dirent->d_name, "..")) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", host_path, dirent->d_name);
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+      perror(path);
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+      printf("%s is not a regular file or directory; skipped\n", path);
+      continue;
+    }
+    if (S_ISREG(st.st_mode) && (size_t) st.st_size > MAX_FILE_SIZE) {
+      printf("%s is larger than the maximum file size; skipped\n", path);
+      continue;
+    }
+
+    ops = realloc(ops, (num_ops + 1) * sizeof(*ops));
+    names = realloc(names, (num_ops + 1) * sizeof(*names));
+    sizes = realloc(sizes, (num_ops + 1) * sizeof(*sizes));
+    strcpy(names[num_ops], dirent->d_name);
+    sizes[num_ops] = S_ISDIR(st.st_mode) ? -1 : st.st_size;
+    ops[num_ops].op = S_ISDIR(st.st_mode) ? JFS_OP_MKDIR : JFS_OP_CREAT;
+    num_ops++;
+  }
+  closedir(dir);
+  for (int i = 0; i < num_ops; i++) {
+    ops[i].name = names[i];
+  }
+  jfs_batch(dir_session, ops, num_ops);
+
+  char* data = malloc(MAX_FILE_SIZE);
+  for (int i = 0; i < num_ops; i++) {
+    snprintf(path, sizeof(path), "%s/%s", host_path, names[i]);
+    if (JFS_OP_MKDIR == ops[i].op) {
+      struct jfs_session sub = *dir_session;
+      int ret = E_SUCCESS == ops[i].result || E_EXISTS == ops[i].result ? jfs_chdir(&sub, names[i]) : ops[i].result;
+      if (E_SUCCESS != ret) {
+        print_error(ret, names[i]);
+        continue;
+      }
+      stats->dirs += E_SUCCESS == ops[i].result;
+      import_dir(path, &sub, stats);
+      continue;
+    }
+
+    if (E_SUCCESS != ops[i].result) {
+      print_error(ops[i].result, names[i]);
+      continue;
+    }
+    if (read_host_file(path, data, sizes[i]) < 0) {
+      perror(path);
+      continue;
+    }
+    int ret = jfs_fallocate(dir_session, names[i], sizes[i]);
+    if (E_SUCCESS == ret && sizes[i] > 0) {
+      ret = jfs_write(dir_session, names[i], data, sizes[i]);
+    }
+    if (E_SUCCESS != ret) {
+      print_error(ret, names[i]);
+      continue;
+    }
+    stats->files++;
+    stats->bytes += sizes[i];
+  }
+
+  free(data);
+  free(ops);
+  free(names);
+  free(sizes);
+}
+
+
+// State of an export: where it writes, and a session for each directory on
+// the way down the walk (sessions[d] is in the directory of the entries at
+// depth d)
+struct export_state {
+  char path[PATH_MAX];
+  size_t root_length; // of the host directory, with its '/'
+  struct jfs_session sessions[NUM_BLOCKS + 1];
+  struct transfer_stats stats;
+};
+
+
+// jfs_walk() callback for export, which walks in preorder so that a host
+// directory is made before its contents; stops at the first host error
+static int export_visit(const struct jfs_walk_entry* entry, void* arg) {
+  struct export_state* state = arg;
+  struct jfs_session* parent = &state->sessions[entry->depth];
+  snprintf(state->path + state->root_length, sizeof(state->path) - state->root_length, "%s", entry->path);
+
+  if (!entry->is_dir) {
+    if (mkdir(state->path, 0777) < 0 && EEXIST != errno) {
+      perror(state->path);
+      return 1;
+    }
+    state->sessions[entry->depth + 1] = *parent;
+    int ret = jfs_chdir(&state->sessions[entry->depth + 1], entry->name);
+    if (E_SUCCESS != ret) {
+      print_error(ret, entry->name);
+      return 1;
+    }
+    state->stats.dirs++;
+    return 0;
+  }
+
+  char data[MAX_FILE_SIZE];
+  unsigned short count = MAX_FILE_SIZE;
+  int ret = jfs_pread(parent, entry->name, data, &count, 0);
+  if (E_SUCCESS != ret) {
+    print_error(ret, entry->name);
+    return 1;
+  }
+  int fd = open(state->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || write(fd, data, count) != count) {
+    perror(state->path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  close(fd);
+  state->stats.files++;
+  state->stats.bytes += count;
+  return 0;
+}
+
+
+/* next_token
+ *   splits the next argument off a command line, in place.  Arguments are
+ *   separated by whitespace, which can be kept in one by quoting it:
+ *   '...' is taken literally, and in "..." and outside quotes a backslash
+ *   escapes the next character (\n, \t, \r and \xHH stand for those
+ *   bytes).
+ * cursor - where to start; moved past the argument
+ * length - set to the argument's length (it may contain \0 bytes)
+ * returns the argument, NULL at the end of the line, or NULL with *length
+ *   set to 1 if a quote is not closed
+ */
+static char* next_token(char** cursor, size_t* length) {
+  char* in = *cursor + strspn(*cursor, WHITESPACE_DELIM);
+  *length = 0;
+  if ('\0' == *in) {
+    *cursor = in;
+    return NULL;
+  }
+
+  char* start = in;
+  char* out = in;
+  char quote = '\0';
+  for (;;) {
+    char c = *in;
+    if ('\0' == c) {
+      if (quote) {
+        *length = 1;
+        return NULL;
+      }
+      break;
+    }
+    in++;
+    if (!quote && strchr(WHITESPACE_DELIM, c)) {
+      break;
+    }
+    if ((!quote && ('\'' == c || '"' == c)) || c == quote) {
+      quote = quote ? '\0' : c;
+      continue;
+    }
+    if ('\\' == c && '\'' != quote && '\0' != *in) {
+      c = *in++;
+      if ('n' == c) {
+        c = '\n';
+      } else if ('t' == c) {
+        c = '\t';
+      } else if ('r' == c) {
+        c = '\r';
+      } else if ('x' == c && isxdigit((unsigned char) in[0]) && isxdigit((unsigned char) in[1])) {
+        char hex[3] = { in[0], in[1], '\0' };
+        c = strtol(hex, NULL, 16);
+        in += 2;
+      }
+    }
+    *out++ = c;
+  }
+  *cursor = in;
+  *length = out - start;
+  *out = '\0';
+  return start;
+}
+
+
 /* run_command
- *   Runs one entire command line, which may include multiple pipeline stages
+ *   Runs one entire command line
+ * returns the command's status (see STATUS_USAGE)
  */
-void run_command(char* command_line) {
+int run_command(char* command_line) {
   /* Parse the arguments */
-  char* saveptr = NULL; /* used internally by strtok_r */
+  char* cursor = command_line;
   char* tokens[MAX_ARGS + 2]; // +1 for the command itself, +1 for a NULL
+  size_t lengths[MAX_ARGS + 2];
   memset(tokens, 0, sizeof(tokens));
-  tokens[0] = strtok_r(command_line, WHITESPACE_DELIM, &saveptr);
-  for (int i = 1; tokens[i-1] != NULL && i < (MAX_ARGS+2); ++i) {
-    tokens[i] = strtok_r(NULL, WHITESPACE_DELIM, &saveptr);
+  int count = 0;
+  while (count < MAX_ARGS + 2 && NULL != (tokens[count] = next_token(&cursor, &lengths[count]))) {
+    count++;
+  }
+  if (count < MAX_ARGS + 2 && lengths[count]) {
+    fprintf(stderr, "ERROR: unterminated quote on the command line\n");
+    return STATUS_USAGE;
   }
   if (NULL != tokens[MAX_ARGS+1]) {
     /* overwrote NULL => too many args error */
     fprintf(stderr, "ERROR: too many arguments on the command line\n");
-    return;
+    return STATUS_USAGE;
   }
 
-  if (NULL == tokens[0]) {
-    // blank line; do nothing
+  status = E_SUCCESS;
+  if (NULL == tokens[0] || '#' == tokens[0][0]) {
+    // blank line or comment; do nothing
+    return STATUS_BLANK;
+
+  } else if (0 == strcmp(tokens[0], "exit")) {
+    if (NULL != tokens[1]) {
+      usage("usage: exit\n");
+      return status;
+    }
+    exiting = 1;
 
   } else if (0 == strcmp(tokens[0], "cd")) {
     if (NULL != tokens[2]) {
-      fprintf(stderr, "usage: cd [dir_name]\n(dir_name is optional; leaving it out will return to the root directory)\n");
-      return;
+      usage("usage: cd [dir_name]\n(dir_name is optional; leaving it out will return to the root directory)\n");
+      return status;
     }
 
     // Note: tokens[1] == NULL is valid; this should return to the root directory
-    int ret = jfs_chdir(tokens[1]);
+    int ret = jfs_chdir(&session, tokens[1]);
     print_error(ret, tokens[1]);
 
   } else if (0 == strcmp(tokens[0], "mkdir")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: mkdir <dir_name>\n");
-      return;
+      usage("usage: mkdir <dir_name>\n");
+      return status;
     }
-    int ret = jfs_mkdir(tokens[1]);
+    int ret = jfs_mkdir(&session, tokens[1]);
     print_error(ret, tokens[1]);
 
   } else if (0 == strcmp(tokens[0], "rmdir")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: rmdir <dir_name>\n");
-      return;
+      usage("usage: rmdir <dir_name>\n");
+      return status;
     }
-    int ret = jfs_rmdir(tokens[1]);
+    int ret = jfs_rmdir(&session, tokens[1]);
     print_error(ret, tokens[1]);
 
   } else if (0 == strcmp(tokens[0], "ls")) {
-    if (NULL != tokens[1]) {
-      fprintf(stderr, "usage: ls\n");
-      return;
+    int long_format = NULL != tokens[1] && 0 == strcmp(tokens[1], "-l");
+    char* directory_name = tokens[1 + long_format];
+    if (NULL != directory_name && NULL != tokens[2 + long_format]) {
+      usage("usage: ls [-l] [directory_name]\n");
+      return status;
     }
 
-    char* directories[MAX_DIR_ENTRIES+1];
-    char* files[MAX_DIR_ENTRIES+1];
-    memset(directories, -1, MAX_DIR_ENTRIES * sizeof(const char*));
-    memset(files,       -1, MAX_DIR_ENTRIES * sizeof(const char*));
-    int ret = jfs_ls(directories, files);
-
-    if (E_SUCCESS == ret) {
-      for (int i = 0; NULL != directories[i]; i++) {
-        printf("%s/\n", directories[i]);
-        free(directories[i]);
-      }
-      for (int i = 0; NULL != files[i]; i++) {
-        printf("%s\n", files[i]);
-        free(files[i]);
+    struct jfs_listing* listing;
+    int ret = jfs_listdir(&session, directory_name, &listing);
+    print_error(ret, directory_name);
+    if (E_SUCCESS != ret) {
+      return status;
+    }
+    // directories first, then files
+    for (int files = 0; files <= 1; files++) {
+      for (unsigned int i = 0; i < listing->num_entries; i++) {
+        struct stats* entry = &listing->entries[i];
+        if ((int) entry->is_dir != files) {
+          continue;
+        }
+        if (long_format && entry->is_dir) {
+          printf("- %5u %5u %s\n", entry->file_size, entry->physical_size, entry->name);
+        } else if (long_format) {
+          printf("d %5s %5s %s/\n", "-", "-", entry->name);
+        } else {
+          printf(entry->is_dir ? "%s\n" : "%s/\n", entry->name);
+        }
       }
-    } else {
-      printf("ls failed - but ls should never fail!\n");
     }
+    jfs_free_listing(listing);
 
   } else if (0 == strcmp(tokens[0], "touch")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: touch <file_name>\n");
-      return;
+      usage("usage: touch <file_name>\n");
+      return status;
     }
-    int ret = jfs_creat(tokens[1]);
+    int ret = jfs_creat(&session, tokens[1]);
     print_error(ret, tokens[1]);
 
   } else if (0 == strcmp(tokens[0], "rm")) {
-    if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: rm <file_name>\n");
-      return;
+    int recursive = NULL != tokens[1] && 0 == strcmp(tokens[1], "-r");
+    char* name = tokens[1 + recursive];
+    if (NULL == name || NULL != tokens[2 + recursive]) {
+      usage("usage: rm [-r] <file_name>\n");
+      return status;
     }
-    int ret = jfs_remove(tokens[1]);
-    print_error(ret, tokens[1]);
+    int ret = recursive ? jfs_remove_tree(&session, name) : jfs_remove(&session, name);
+    print_error(ret, name);
+
+  } else if (0 == strcmp(tokens[0], "du")) {
+    if (NULL != tokens[2]) {
+      usage("usage: du [dir_name]\n");
+      return status;
+    }
+    struct du_state* state = calloc(1, sizeof(struct du_state));
+    int ret = jfs_walk(&session, tokens[1], JFS_WALK_POSTORDER, du_visit, state);
+    if (E_SUCCESS == ret) {
+      // the walked directory itself: its block and everything under it
+      printf("%u\t%s\n", (1 + state->blocks[0]) * BLOCK_SIZE, tokens[1] ? tokens[1] : ".");
+    } else {
+      print_error(ret, tokens[1]);
+    }
+    free(state);
+
+  } else if (0 == strcmp(tokens[0], "find")) {
+    // find [dir_name] -name <pattern>
+    int has_dir = NULL != tokens[1] && 0 != strcmp(tokens[1], "-name");
+    char* dir_name = has_dir ? tokens[1] : NULL;
+    if (NULL == tokens[1 + has_dir] || 0 != strcmp(tokens[1 + has_dir], "-name")
+        || NULL == tokens[2 + has_dir] || (!has_dir && NULL != tokens[3])) {
+      usage("usage: find [dir_name] -name <pattern>\n");
+      return status;
+    }
+    int ret = jfs_walk(&session, dir_name, 0, find_visit, tokens[2 + has_dir]);
+    print_error(ret, dir_name);
 
   } else if (0 == strcmp(tokens[0], "stat")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: stat <file_name>\n");
-      return;
+      usage("usage: stat <file_name>\n");
+      return status;
     }
 
     struct stats file_stats;
     memset(&file_stats, -1, sizeof(file_stats));
-    int ret = jfs_stat(tokens[1], &file_stats);
+    int ret = jfs_stat(&session, tokens[1], &file_stats);
 
     if (E_SUCCESS == ret) {
       if (!file_stats.is_dir) {
@@ -158,6 +522,7 @@ void run_command(char* command_line) {
         printf("Inode block number: %u\n", file_stats.block_num);
         printf("Number of data blocks: %u\n", file_stats.num_data_blocks);
         printf("File size: %u\n", file_stats.file_size);
+        printf("Physical size: %u\n", file_stats.physical_size);
       }
     } else {
       print_error(ret, tokens[1]);
@@ -165,22 +530,30 @@ void run_command(char* command_line) {
 
   } else if (0 == strcmp(tokens[0], "cat")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: cat <file_name>\n");
-      return;
+      usage("usage: cat <file_name>\n");
+      return status;
     }
 
-    unsigned short bytes_read = MAX_FILE_SIZE;
     char* file_name = strdup(tokens[1]);
-    char* file_data = malloc(MAX_FILE_SIZE * sizeof(char));
-    memset(file_data, -1, MAX_FILE_SIZE);
-
-    int ret = jfs_read(file_name, file_data, &bytes_read);
-    if (E_SUCCESS == ret) {
-      ret = write(STDOUT_FILENO, file_data, bytes_read);
-      printf("\n");
-      if (ret != bytes_read) {
+    char* file_data = malloc(CAT_CHUNK_SIZE * sizeof(char));
+
+    // read the file a chunk at a time, so that the reads are sequential
+    unsigned int offset = 0;
+    int ret;
+    for (;;) {
+      unsigned short bytes_read = CAT_CHUNK_SIZE;
+      ret = jfs_pread(&session, file_name, file_data, &bytes_read, offset);
+      if (E_SUCCESS != ret || 0 == bytes_read) {
+        break;
+      }
+      if (fwrite(file_data, 1, bytes_read, stdout) != bytes_read) {
         perror("Failed to write file data to stdout");
+        break;
       }
+      offset += bytes_read;
+    }
+    if (E_SUCCESS == ret) {
+      printf("\n");
     } else {
       print_error(ret, file_name);
     }
@@ -189,16 +562,16 @@ void run_command(char* command_line) {
     free(file_name);
 
   } else if (0 == strcmp(tokens[0], "head")) {
-    if (NULL == tokens[1] || NULL == tokens[2]) {
-      fprintf(stderr, "usage: head <file_name> <num_bytes>\n");
-      return;
+    if (NULL == tokens[1] || NULL == tokens[2] || NULL != tokens[3]) {
+      usage("usage: head <file_name> <num_bytes>\n");
+      return status;
     }
 
     char* endptr = NULL;
     unsigned long bytes_read = strtoul(tokens[2], &endptr, 10);
     if (*endptr != '\0') {
-      fprintf(stderr, "usage: head <file_name> <num_bytes>\n<num_bytes> must be an integer.\n");
-      return;
+      usage("usage: head <file_name> <num_bytes>\n<num_bytes> must be an integer.\n");
+      return status;
     }
     if (bytes_read > MAX_FILE_SIZE)
       bytes_read = MAX_FILE_SIZE;
@@ -207,9 +580,9 @@ void run_command(char* command_line) {
     char* file_data = malloc(bytes_read * sizeof(char));
     memset(file_data, -1, bytes_read);
 
-    int ret = jfs_read(file_name, file_data, &bytes_read);
+    int ret = jfs_read(&session, file_name, file_data, &bytes_read);
     if (E_SUCCESS == ret) {
-      ret = write(STDOUT_FILENO, file_data, bytes_read);
+      ret = fwrite(file_data, 1, bytes_read, stdout);
       printf("\n");
       if (ret != bytes_read) {
         perror("Failed to write file data to stdout");
@@ -222,57 +595,206 @@ void run_command(char* command_line) {
     free(file_name);
 
   } else if (0 == strcmp(tokens[0], "append")) {
-    if (NULL == tokens[1] || NULL == tokens[2]) {
-      fprintf(stderr, "usage: append <file_name> <data>\n");
-      return;
+    if (NULL == tokens[1] || NULL == tokens[2] || NULL != tokens[3]) {
+      usage("usage: append <file_name> <data>\n");
+      return status;
+    }
+    if (lengths[2] > MAX_FILE_SIZE) {
+      print_error(E_MAX_FILE_SIZE, tokens[1]);
+      return status;
     }
+    // the data may contain escaped \0 bytes
     char* file_name = strdup(tokens[1]);
-    char* file_data = strdup(tokens[2]);
+    char* file_data = malloc(lengths[2]);
+    memcpy(file_data, tokens[2], lengths[2]);
 
-    int ret = jfs_write(file_name, file_data, strlen(file_data));
+    int ret = jfs_write(&session, file_name, file_data, lengths[2]);
     print_error(ret, file_name);
 
     free(file_data);
     free(file_name);
 
+  } else if (0 == strcmp(tokens[0], "fallocate")) {
+    if (NULL == tokens[1] || NULL == tokens[2] || NULL != tokens[3]) {
+      usage("usage: fallocate <file_name> <num_bytes>\n");
+      return status;
+    }
+    char* endptr = NULL;
+    unsigned long length = strtoul(tokens[2], &endptr, 10);
+    if (*endptr != '\0') {
+      usage("usage: fallocate <file_name> <num_bytes>\n<num_bytes> must be an integer.\n");
+      return status;
+    }
+    if (length > MAX_FILE_SIZE) {
+      length = MAX_FILE_SIZE + 1; // still too big once it is an unsigned int
+    }
+
+    int ret = jfs_fallocate(&session, tokens[1], length);
+    print_error(ret, tokens[1]);
+
+  } else if (0 == strcmp(tokens[0], "cp")) {
+    if (NULL == tokens[1] || NULL == tokens[2] || NULL != tokens[3]) {
+      usage("usage: cp <src_file> <dst_file>\n");
+      return status;
+    }
+    char* src_name = strdup(tokens[1]);
+    char* dst_name = strdup(tokens[2]);
+
+    int ret = jfs_clone(&session, src_name, dst_name);
+    print_error(ret, ret == E_EXISTS || ret == E_MAX_NAME_LENGTH ? dst_name : src_name);
+
+    free(dst_name);
+    free(src_name);
+
+  } else if (0 == strcmp(tokens[0], "cachestats")) {
+    if (NULL != tokens[1]) {
+      usage("usage: cachestats\n");
+      return status;
+    }
+    struct jfs_cache_stats stats;
+    jfs_cache_stats(&stats);
+    printf("Cache hits: %lu\n", stats.cache.hits);
+    printf("Cache misses: %lu\n", stats.cache.misses);
+    printf("Blocks read ahead: %lu (%lu used, %lu reads)\n", stats.cache.prefetched,
+           stats.cache.prefetch_hits, stats.cache.prefetch_reads);
+    printf("Blocks read from disk: %lu\n", stats.cache.blocks_read);
+    printf("Blocks written to disk: %lu\n", stats.cache.blocks_written);
+    printf("Sequential file reads: %lu\n", stats.sequential_reads);
+    printf("Random file reads: %lu\n", stats.random_reads);
+
+  } else if (0 == strcmp(tokens[0], "dedup")) {
+    if (NULL == tokens[1] || NULL != tokens[2]
+        || (strcmp(tokens[1], "on") && strcmp(tokens[1], "off"))) {
+      usage("usage: dedup on|off\n");
+      return status;
+    }
+    jfs_set_dedup(0 == strcmp(tokens[1], "on"));
+
+  } else if (0 == strcmp(tokens[0], "compress")) {
+    if (NULL == tokens[1] || NULL == tokens[2] || NULL != tokens[3]
+        || (strcmp(tokens[2], "on") && strcmp(tokens[2], "off"))) {
+      usage("usage: compress <file_name> on|off\n");
+      return status;
+    }
+    int ret = jfs_set_compression(&session, tokens[1], 0 == strcmp(tokens[2], "on"));
+    print_error(ret, tokens[1]);
+
+  } else if (0 == strcmp(tokens[0], "import")) {
+    if (NULL == tokens[1] || NULL != tokens[2]) {
+      usage("usage: import <host_dir>\n");
+      return status;
+    }
+    struct transfer_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    import_dir(tokens[1], &session, &stats);
+    printf("imported %u files, %u directories, %lu bytes\n", stats.files, stats.dirs, stats.bytes);
+
+  } else if (0 == strcmp(tokens[0], "export")) {
+    if (NULL == tokens[1] || NULL != tokens[2]) {
+      usage("usage: export <host_dir>\n");
+      return status;
+    }
+    if (mkdir(tokens[1], 0777) < 0 && EEXIST != errno) {
+      perror(tokens[1]);
+      return status;
+    }
+    struct export_state* state = calloc(1, sizeof(struct export_state));
+    state->root_length = snprintf(state->path, sizeof(state->path), "%s/", tokens[1]);
+    state->sessions[0] = session;
+    int ret = jfs_walk(&session, NULL, 0, export_visit, state);
+    if (ret < 0) {
+      print_error(ret, tokens[1]);
+    }
+    printf("exported %u files, %u directories, %lu bytes\n", state->stats.files, state->stats.dirs,
+           state->stats.bytes);
+    free(state);
+
+  } else if (0 == strcmp(tokens[0], "sync")) {
+    if (NULL != tokens[1]) {
+      usage("usage: sync\n");
+      return status;
+    }
+    if (jfs_sync() != 0) {
+      perror("sync failed");
+      status = E_UNKNOWN;
+    }
+
+  } else if (0 == strcmp(tokens[0], "defrag")) {
+    int report_only = NULL != tokens[1] && 0 == strcmp(tokens[1], "-n");
+    if (NULL != tokens[1 + report_only]) {
+      usage("usage: defrag [-n]\n");
+      return status;
+    }
+    struct jfs_frag_stats stats;
+    int ret = jfs_frag_stats(&stats);
+    if (E_SUCCESS == ret) {
+      print_frag_stats(report_only ? "" : "before: ", &stats);
+    }
+    if (E_SUCCESS == ret && !report_only) {
+      unsigned int moved;
+      ret = jfs_defrag(&moved);
+      if (E_SUCCESS == ret) {
+        ret = jfs_frag_stats(&stats);
+      }
+      if (E_SUCCESS == ret) {
+        print_frag_stats("after:  ", &stats);
+        printf("%u blocks moved\n", moved);
+      }
+    }
+    print_error(ret, NULL);
+
+  } else if (0 == strcmp(tokens[0], "trace")) {
+    if (NULL == tokens[1] || NULL != tokens[2]) {
+      usage("usage: trace <trace_file>|off\n");
+      return status;
+    }
+    int ret = 0 == strcmp(tokens[1], "off") ? jfs_trace_stop() : jfs_trace_start(tokens[1]);
+    if (ret != 0) {
+      perror(tokens[1]);
+      status = E_UNKNOWN;
+    }
+
   } else {
     fprintf(stderr, "ERROR: unrecognized command\n");
+    status = STATUS_USAGE;
   }
+  return status;
 }
 
 
-/* prompt_for_input
- *   Prompts the user for a command, and takes a line of input
+/* main
+ *   Runs commands from the terminal, or in batch mode from a script (-f) or
+ *   whatever stdin is when it is not a terminal, on the disk file given with
+ *   -d (DISK by default).  Batch mode prints no prompts, fully buffers
+ *   stdout, and follows the output of each command with a status line
+ *   "== <status> <line number>" (see STATUS_USAGE); the exit code is 1 if any
+ *   command failed.  Built as command_line_client, it runs the commands
+ *   through a jfsd server instead, and -d names the server's socket.
  */
-void prompt_for_input(char* input_buffer, int buflen) {
-  int done = 0; // FALSE
-  while (!done) {
-    printf("jfs$ ");  /* prompt */
-    if (NULL == fgets(input_buffer, buflen, stdin)) {
-      perror("FATAL ERROR: fgets failed");
-      exit(1);
-      /* alternatively, we could have looped to try input again
-       * but that runs the risk of an infinite loop if input is totally broken */
-    }
-
-    /* Note that if buflen isn't long enough, that isn't an error.
-     * fgets will simply get as many characters as there is room for,
-     * and leave the rest still in the stdin buffer.
-     * Our solution will be to detect the situation, report an error,
-     * empty out the stdin buffer, and then re-prompt for a new input.
-     */
-    if (input_buffer[strlen(input_buffer)-1] != '\n') {
-      fprintf(stderr, "ERROR: line exceeds maximum command line length\n");
-      while('\n' != getc(stdin)) {} /* consume rest of line from the buffer */
-    } else {
-      done = 1; // TRUE
+int main(int argc, char** argv) {
+  FILE* input = stdin;
+  const char* disk = DISK_FILENAME;
+  int batch = !isatty(STDIN_FILENO);
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "d:f:"))) {
+    if ('d' == opt) {
+      disk = optarg;
+      continue;
+    }
+    if ('f' != opt) {
+      fprintf(stderr, "usage: %s [-d disk_file] [-f script]\n", argv[0]);
+      return 1;
+    }
+    input = fopen(optarg, "r");
+    if (NULL == input) {
+      perror(optarg);
+      return 1;
     }
+    batch = 1;
+  }
+  if (batch) {
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
   }
-}
-
-
-int main() {
-  char input_buffer[MAX_CMD_LENGTH];
 
   /*
   printf("File system parameters:\n");
@@ -285,14 +807,39 @@ int main() {
   printf("sizeof block struct = %ld\n\n", sizeof(struct block));
   */
 
-  jfs_mount(DISK_FILENAME);
-
-  prompt_for_input(input_buffer, MAX_CMD_LENGTH);
-  while (0 != strcmp(input_buffer, "exit\n")) {
-    run_command(input_buffer); /* may alter input_buffer!! */
-    prompt_for_input(input_buffer, MAX_CMD_LENGTH);
+  if (jfs_mount(disk) != 0) {
+    perror(disk);
+    return 1;
+  }
+  jfs_session_init(&session);
+
+  // lines of any length are read whole
+  char* line = NULL;
+  size_t capacity = 0;
+  unsigned long line_number = 0;
+  int failed = 0;
+  while (!exiting) {
+    if (!batch) {
+      printf("jfs$ ");  /* prompt */
+      fflush(stdout);
+    }
+    if (getline(&line, &capacity, input) < 0) {
+      break; // end of input
+    }
+    line_number++;
+    int ret = run_command(line); /* may alter line!! */
+    if (STATUS_BLANK != ret) {
+      failed |= E_SUCCESS != ret;
+      if (batch) {
+        printf("== %d %lu\n", ret, line_number);
+      }
+    }
+  }
+  free(line);
+  if (input != stdin) {
+    fclose(input);
   }
 
   jfs_unmount();
-  return 0;
+  return failed;
 }
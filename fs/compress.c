@@ -0,0 +1,164 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+// Compressed data is a series of sequences, each a token byte followed by
+// literals and a back reference:
+//   token           - literal count in the high nibble, match length minus
+//                     MIN_MATCH in the low nibble (15 in either means more
+//                     bytes follow: each adds its value, until one is not 255)
+//   literals        - copied to the output as they are
+//   offset          - 2 bytes, little endian: how far back the match starts
+//   match length    - the extra length bytes, if any
+// The last sequence stops after its literals.
+#define MIN_MATCH 4
+#define HASH_BITS 8
+#define MAX_OFFSET 0xffff
+
+
+static unsigned int hash4(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+// appends one byte to out; returns -1 once it is full
+static int put(unsigned char* out, int* pos, int capacity, unsigned char byte) {
+  if (*pos >= capacity) {
+    return -1;
+  }
+  out[(*pos)++] = byte;
+  return 0;
+}
+
+
+// appends the extra bytes of a length whose nibble was 15
+static int put_length(unsigned char* out, int* pos, int capacity, int length) {
+  for (; length >= 255; length -= 255) {
+    if (put(out, pos, capacity, 255) < 0) {
+      return -1;
+    }
+  }
+  return put(out, pos, capacity, length);
+}
+
+
+// appends a sequence; match_length is 0 for the last one
+static int put_sequence(unsigned char* out, int* pos, int capacity, const unsigned char* literals,
+                        int num_literals, int offset, int match_length) {
+  int extra = match_length ? match_length - MIN_MATCH : 0;
+  int token = (num_literals < 15 ? num_literals : 15) << 4 | (extra < 15 ? extra : 15);
+  if (put(out, pos, capacity, token) < 0
+      || (num_literals >= 15 && put_length(out, pos, capacity, num_literals - 15) < 0)
+      || num_literals > capacity - *pos) {
+    return -1;
+  }
+  memcpy(out + *pos, literals, num_literals);
+  *pos += num_literals;
+  if (!match_length) {
+    return 0;
+  }
+  if (put(out, pos, capacity, offset & 0xff) < 0 || put(out, pos, capacity, offset >> 8) < 0
+      || (extra >= 15 && put_length(out, pos, capacity, extra - 15) < 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+
+int lz_compress(const void* src, int len, void* dst, int capacity) {
+  const unsigned char* in = src;
+  int table[1 << HASH_BITS]; // last position each hash was seen at
+  for (int i = 0; i < (1 << HASH_BITS); i++) {
+    table[i] = -1;
+  }
+
+  // greedily take the first match found at each position
+  int pos = 0, anchor = 0, out = 0;
+  while (pos + MIN_MATCH <= len) {
+    unsigned int hash = hash4(in + pos);
+    int ref = table[hash];
+    table[hash] = pos;
+    if (ref < 0 || pos - ref > MAX_OFFSET || memcmp(in + ref, in + pos, MIN_MATCH)) {
+      pos++;
+      continue;
+    }
+    int match_length = MIN_MATCH;
+    while (pos + match_length < len && in[ref + match_length] == in[pos + match_length]) {
+      match_length++;
+    }
+    if (put_sequence(dst, &out, capacity, in + anchor, pos - anchor, pos - ref, match_length) < 0) {
+      return -1;
+    }
+    pos += match_length;
+    anchor = pos;
+  }
+  if (put_sequence(dst, &out, capacity, in + anchor, len - anchor, 0, 0) < 0) {
+    return -1;
+  }
+  return out;
+}
+
+
+// reads the extra bytes of a length whose nibble was 15; -1 if they run out
+static int get_length(const unsigned char* in, int* pos, int len) {
+  int length = 0, byte;
+  do {
+    if (*pos >= len) {
+      return -1;
+    }
+    byte = in[(*pos)++];
+    length += byte;
+  } while (byte == 255);
+  return length;
+}
+
+
+int lz_decompress(const void* src, int len, void* dst, int capacity) {
+  const unsigned char* in = src;
+  unsigned char* out = dst;
+  int pos = 0, written = 0;
+  while (pos < len) {
+    int token = in[pos++];
+    int num_literals = token >> 4;
+    if (num_literals == 15) {
+      int extra = get_length(in, &pos, len);
+      if (extra < 0) {
+        return -1;
+      }
+      num_literals += extra;
+    }
+    if (num_literals > len - pos || num_literals > capacity - written) {
+      return -1;
+    }
+    memcpy(out + written, in + pos, num_literals);
+    pos += num_literals;
+    written += num_literals;
+    if (pos == len) {
+      break; // the last sequence has no match
+    }
+
+    if (len - pos < 2) {
+      return -1;
+    }
+    int offset = in[pos] | in[pos + 1] << 8;
+    pos += 2;
+    int match_length = (token & 15) + MIN_MATCH;
+    if ((token & 15) == 15) {
+      int extra = get_length(in, &pos, len);
+      if (extra < 0) {
+        return -1;
+      }
+      match_length += extra;
+    }
+    if (offset == 0 || offset > written || match_length > capacity - written) {
+      return -1;
+    }
+    // byte by byte, since the match may overlap what it is copying
+    for (int i = 0; i < match_length; i++, written++) {
+      out[written] = out[written - offset];
+    }
+  }
+  return written;
+}
@@ -0,0 +1,23 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+/* lz_compress
+ *   compresses len bytes of src into dst with a small LZ77 codec in the
+ *   style of LZ4: byte-aligned runs of literals and back references, with
+ *   no entropy coding, so that it is cheap enough to run on every write
+ * capacity - size of dst in bytes
+ * returns the compressed length, or -1 if it does not fit in capacity bytes
+ */
+int lz_compress(const void* src, int len, void* dst, int capacity);
+
+/* lz_decompress
+ *   decompresses len bytes of src (produced by lz_compress) into dst; every
+ *   length and offset is checked, so corrupt input cannot overrun either
+ *   buffer
+ * capacity - size of dst in bytes
+ * returns the decompressed length, or -1 if src is corrupt or does not fit
+ * in capacity bytes
+ */
+int lz_decompress(const void* src, int len, void* dst, int capacity);
+
+#endif // _COMPRESS_H_
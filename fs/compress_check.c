@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jumbo_file_system.h"
+
+// Round-trip check of the compressed file format (see CHUNK_BLOCKS): writes
+// a compressed file through jfs_pwrite, with chunks that compress, chunks
+// that are stored as they are, holes and writes that cross chunk boundaries,
+// and after every write reads the whole file back and compares it with a
+// copy kept in memory.  The file is checked again after a remount, and after
+// compression is turned off and on.  Exits with 0 if every read matched.
+//
+//   compress_check [disk_file] [random_writes] [seed]
+
+#define DISK_FILENAME "CHECK_DISK"
+#define DEFAULT_WRITES 500
+#define FILE_NAME "c"
+
+static struct jfs_session session;
+static char expected[MAX_FILE_SIZE]; // what the file should hold
+static unsigned int expected_size;
+static int failures;
+
+
+// a byte pattern that compresses (kind 0) or one that does not (kind 1)
+static void fill(char* buf, unsigned int count, int kind) {
+  for (unsigned int i = 0; i < count; i++) {
+    buf[i] = kind ? (char) rand() : 'a' + (char) (i / 16 % 4);
+  }
+}
+
+
+/* check
+ *   reads the whole file and compares it with expected
+ * what - describes the step just taken, for the report
+ */
+static void check(const char* what) {
+  static char buf[MAX_FILE_SIZE];
+  struct stats stats;
+  unsigned short count = MAX_FILE_SIZE;
+  memset(buf, 0x5a, sizeof(buf));
+  int ret = jfs_stat(&session, FILE_NAME, &stats);
+  if (ret == E_SUCCESS) {
+    ret = jfs_pread(&session, FILE_NAME, buf, &count, 0);
+  }
+  if (ret != E_SUCCESS) {
+    printf("FAIL %s: error %d\n", what, ret);
+    failures++;
+  } else if (stats.file_size != expected_size || count != expected_size) {
+    printf("FAIL %s: size %u, read %u, expected %u\n", what, stats.file_size, count, expected_size);
+    failures++;
+  } else if (memcmp(buf, expected, expected_size) != 0) {
+    unsigned int i = 0;
+    while (buf[i] == expected[i]) {
+      i++;
+    }
+    printf("FAIL %s: first difference at byte %u (chunk %u)\n", what, i, i / CHUNK_SIZE);
+    failures++;
+  }
+}
+
+
+// writes count bytes of kind at offset, to the file and to expected
+static void write_at(unsigned int offset, unsigned int count, int kind, const char* what) {
+  char buf[MAX_FILE_SIZE];
+  fill(buf, count, kind);
+  int ret = jfs_pwrite(&session, FILE_NAME, buf, count, offset);
+  if (ret != E_SUCCESS) {
+    printf("FAIL %s: jfs_pwrite(%u, %u) returned %d\n", what, count, offset, ret);
+    failures++;
+    return;
+  }
+  memcpy(expected + offset, buf, count);
+  if (offset + count > expected_size) {
+    expected_size = offset + count;
+  }
+  check(what);
+}
+
+
+static int remount(const char* disk) {
+  if (jfs_unmount() != 0 || jfs_mount(disk) != 0) {
+    perror("remount failed");
+    return -1;
+  }
+  jfs_session_init(&session);
+  return 0;
+}
+
+
+int main(int argc, char** argv) {
+  const char* disk = DISK_FILENAME;
+  int writes = DEFAULT_WRITES;
+  unsigned int seed = 1;
+  if (argc > 1) disk = argv[1];
+  if (argc > 2) writes = atoi(argv[2]);
+  if (argc > 3) seed = strtoul(argv[3], NULL, 10);
+  if (argc > 4 || writes < 0) {
+    fprintf(stderr, "usage: %s [disk_file] [random_writes] [seed]\n", argv[0]);
+    return 1;
+  }
+  srand(seed);
+
+  remove(disk);
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    return 1;
+  }
+  jfs_session_init(&session);
+  if (jfs_creat(&session, FILE_NAME) != E_SUCCESS
+      || jfs_set_compression(&session, FILE_NAME, 1) != E_SUCCESS) {
+    printf("FAIL could not create a compressed file\n");
+    jfs_unmount();
+    return 1;
+  }
+
+  // each kind of chunk, a hole, and writes across chunk boundaries
+  write_at(0, CHUNK_SIZE, 0, "compressed chunk");
+  write_at(CHUNK_SIZE, CHUNK_SIZE, 1, "raw chunk");
+  write_at(3 * CHUNK_SIZE, CHUNK_SIZE / 2, 0, "write past a hole");
+  write_at(CHUNK_SIZE - 10, 20, 1, "compressed/raw boundary");
+  write_at(2 * CHUNK_SIZE - 5, 10, 0, "raw/hole boundary");
+  write_at(3 * CHUNK_SIZE - 1, 2, 1, "hole/compressed boundary");
+  write_at(10, 3, 0, "inside a compressed chunk");
+  write_at(CHUNK_SIZE + 100, 1, 0, "inside a raw chunk");
+  write_at(MAX_FILE_SIZE - CHUNK_SIZE - 7, CHUNK_SIZE + 7, 1, "last chunk");
+  struct stats stats;
+  if (jfs_stat(&session, FILE_NAME, &stats) == E_SUCCESS && stats.physical_size >= stats.file_size) {
+    printf("FAIL nothing was saved: %u bytes on disk for %u\n", stats.physical_size, stats.file_size);
+    failures++;
+  }
+
+  if (remount(disk) != 0) return 1;
+  check("after remounting");
+  if (jfs_set_compression(&session, FILE_NAME, 0) != E_SUCCESS) {
+    printf("FAIL could not decompress the file\n");
+    failures++;
+  }
+  check("after decompressing");
+  if (jfs_set_compression(&session, FILE_NAME, 1) != E_SUCCESS) {
+    printf("FAIL could not compress the file again\n");
+    failures++;
+  }
+  check("after compressing again");
+
+  // random writes of either kind, often across chunk boundaries
+  char what[64];
+  for (int i = 0; i < writes && failures < 10; i++) {
+    unsigned int offset = rand() % MAX_FILE_SIZE;
+    unsigned int count = 1 + rand() % (rand() % 4 ? CHUNK_SIZE / 4 : 2 * CHUNK_SIZE);
+    if (offset + count > MAX_FILE_SIZE) {
+      count = MAX_FILE_SIZE - offset;
+    }
+    snprintf(what, sizeof(what), "random write %d (%u bytes at %u)", i, count, offset);
+    write_at(offset, count, rand() % 2, what);
+  }
+
+  if (remount(disk) != 0) return 1;
+  check("after remounting at the end");
+  jfs_unmount();
+  printf("%s: %d random writes, %d failures\n", failures ? "FAILED" : "ok", writes, failures);
+  return failures != 0;
+}
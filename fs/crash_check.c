@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "jumbo_file_system.h"
+
+// Crash check of the journal: a child process runs a sequence of jfs_* calls
+// on a fresh disk and stops dead with _exit() in the middle of it, without
+// unmounting, as if the machine had crashed.  fsck then replays the journal
+// and checks the image.  The first run is a fixed sequence that reuses a
+// freed inode block for file data; every other run is random, from its own
+// seed, with a jfs_sync() now and then.  Blocks leaked by a crash are
+// expected; exits with 0 if fsck found nothing else wrong with any image.
+//
+//   crash_check [runs] [first_seed] [disk_file]
+//
+// fsck is run from the directory crash_check was run from.
+
+#define DISK_FILENAME "CRASH_DISK"
+#define DEFAULT_RUNS 60
+#define FSCK_ERRORS 4 // fsck's exit code when it finds problems
+#define MAX_OPS 40
+#define NUM_NAMES 4 // the root directory holds MAX_DIR_ENTRIES entries
+
+static const char* names[NUM_NAMES] = {"a", "b", "c", "d"};
+
+
+// mounts disk and creates some files, then remounts it so that they are
+// checkpointed home and only the calls after this are in the journal
+static void prepare(const char* disk, struct jfs_session* session) {
+  char buf[MAX_FILE_SIZE];
+  memset(buf, 'x', sizeof(buf));
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    _exit(2);
+  }
+  jfs_session_init(session);
+  for (int i = 0; i < NUM_NAMES; i++) {
+    jfs_creat(session, names[i]);
+    jfs_pwrite(session, names[i], buf, BLOCK_SIZE * (1 + rand() % 4), 0);
+  }
+  if (jfs_unmount() != 0 || jfs_mount(disk) != 0) {
+    perror("remount failed");
+    _exit(2);
+  }
+  jfs_session_init(session);
+}
+
+
+// the case the check was written for: a file's inode block, freed by a
+// removal that is still only in memory, reused as another file's data
+static void freed_inode_reused(const char* disk) {
+  struct jfs_session session;
+  char buf[BLOCK_SIZE];
+  memset(buf, 'y', sizeof(buf));
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    _exit(2);
+  }
+  jfs_session_init(&session);
+  jfs_creat(&session, "a");
+  jfs_creat(&session, "b");
+  if (jfs_unmount() != 0 || jfs_mount(disk) != 0) {
+    perror("remount failed");
+    _exit(2);
+  }
+  jfs_session_init(&session);
+  jfs_remove(&session, "a");
+  jfs_pwrite(&session, "b", buf, BLOCK_SIZE, 2 * BLOCK_SIZE);
+  _exit(0);
+}
+
+
+// random creations, removals and writes, cut short after a random number of
+// calls
+static void random_calls(const char* disk, unsigned int seed) {
+  struct jfs_session session;
+  char buf[MAX_FILE_SIZE];
+  srand(seed);
+  prepare(disk, &session);
+  int ops = rand() % MAX_OPS;
+  for (int i = 0; i < ops; i++) {
+    const char* name = names[rand() % NUM_NAMES];
+    switch (rand() % 8) {
+    case 0:
+      jfs_sync();
+      break;
+    case 1:
+    case 2:
+      jfs_remove(&session, name);
+      break;
+    case 3:
+      jfs_creat(&session, name);
+      break;
+    default: {
+      unsigned int offset = rand() % (MAX_FILE_SIZE / 2);
+      unsigned short count = 1 + rand() % (MAX_FILE_SIZE / 2);
+      memset(buf, 'a' + rand() % 26, count);
+      jfs_pwrite(&session, name, buf, count, offset);
+      break;
+    }
+    }
+  }
+  _exit(0);
+}
+
+
+/* check_image
+ *   runs fsck on disk and prints every problem it finds other than orphaned
+ *   blocks: a crash may leak blocks, but must not lose or corrupt anything
+ * returns the number of such problems, or -1 if fsck could not be run
+ */
+static int check_image(const char* fsck, const char* disk) {
+  int out[2];
+  if (pipe(out) < 0) {
+    return -1;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    execl(fsck, fsck, disk, (char*) NULL);
+    perror(fsck);
+    _exit(127);
+  }
+  close(out[1]);
+  FILE* report = fdopen(out[0], "r");
+  char line[256];
+  size_t disk_length = strlen(disk);
+  int problems = 0;
+  while (report && fgets(line, sizeof(line), report)) {
+    int summary = strncmp(line, disk, disk_length) == 0 && line[disk_length] == ':';
+    if (!summary && !strstr(line, ": orphaned (")) {
+      printf("  %s", line);
+      problems++;
+    }
+  }
+  if (report) {
+    fclose(report);
+  } else {
+    close(out[0]);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+      || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != FSCK_ERRORS)) {
+    return -1;
+  }
+  return problems;
+}
+
+
+int main(int argc, char** argv) {
+  int runs = DEFAULT_RUNS;
+  unsigned int first_seed = 1;
+  const char* disk = DISK_FILENAME;
+  if (argc > 1) runs = atoi(argv[1]);
+  if (argc > 2) first_seed = strtoul(argv[2], NULL, 10);
+  if (argc > 3) disk = argv[3];
+  if (argc > 4 || runs <= 0) {
+    fprintf(stderr, "usage: %s [runs] [first_seed] [disk_file]\n", argv[0]);
+    return 1;
+  }
+  char fsck[256];
+  const char* slash = strrchr(argv[0], '/');
+  snprintf(fsck, sizeof(fsck), "%.*sfsck", slash ? (int) (slash - argv[0] + 1) : 2, slash ? argv[0] : "./");
+
+  int failures = 0;
+  for (int run = 0; run < runs; run++) {
+    unsigned int seed = first_seed + run - 1;
+    remove(disk);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (run == 0) {
+        freed_inode_reused(disk);
+      }
+      random_calls(disk, seed);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("FAIL run %d: the calls before the crash did not run\n", run);
+      failures++;
+      continue;
+    }
+    int problems = check_image(fsck, disk);
+    if (problems < 0) {
+      printf("FAIL run %d: could not run %s\n", run, fsck);
+      failures++;
+    } else if (problems > 0) {
+      if (run == 0) {
+        printf("FAIL run 0 (freed inode block reused for data): %d problems\n", problems);
+      } else {
+        printf("FAIL run %d (seed %u): %d problems\n", run, seed, problems);
+      }
+      failures++;
+    }
+  }
+  remove(disk);
+  printf("%s: %d crashes, %d failures\n", failures ? "FAILED" : "ok", runs, failures);
+  return failures != 0;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "jumbo_file_system.h"
+
+// the blocks kept as the one copy of their contents, with their fingerprints
+static block_num_t keepers[NUM_BLOCKS];
+static uint16_t keeper_fingerprints[NUM_BLOCKS];
+static unsigned int num_keepers;
+static char is_keeper[NUM_BLOCKS];
+
+static unsigned int duplicates, freed;
+
+
+/* share_keeper
+ *   finds a kept block other than block with the same contents and adds a
+ *   reference to it; if there is none, block itself is kept from now on
+ * returns the block the caller's reference should point at
+ */
+static block_num_t share_keeper(block_num_t block, const char* contents, uint16_t fingerprint) {
+  if (is_keeper[block]) {
+    return block;
+  }
+  for (unsigned int i = 0; i < num_keepers; i++) {
+    char kept[BLOCK_SIZE];
+    if (keeper_fingerprints[i] == fingerprint && read_block(keepers[i], kept) == 0
+        && !memcmp(kept, contents, BLOCK_SIZE) && share_blocks(&keepers[i], 1) == 0) {
+      return keepers[i];
+    }
+  }
+  keepers[num_keepers] = block;
+  keeper_fingerprints[num_keepers++] = fingerprint;
+  is_keeper[block] = 1;
+  return block;
+}
+
+
+/* dedup_inode
+ *   points every data block of a file that has the same contents as a block
+ *   seen before at that block instead, then releases the blocks it stopped
+ *   using; holes and preallocated blocks are left alone
+ * returns 0 on success or -1 on failure
+ */
+static int dedup_inode(block_num_t inode_num) {
+  struct block inode;
+  if (journal_read_block(inode_num, &inode) < 0) {
+    return -1;
+  }
+  if (inode.contents.inode.flags & INODE_INLINE) {
+    return 0;
+  }
+  unsigned int size = inode.contents.inode.file_size;
+  unsigned int used = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  block_num_t old[MAX_DATA_BLOCKS], kept[MAX_DATA_BLOCKS];
+  int num_old = 0;
+  journal_begin();
+  for (unsigned int i = 0; i < used; i++) {
+    block_num_t block = inode.contents.inode.data_blocks[i];
+    char contents[BLOCK_SIZE];
+    if (!block || read_block(block, contents) < 0) {
+      continue;
+    }
+    uint16_t fingerprint = block_fingerprint(contents);
+    block_num_t keeper = share_keeper(block, contents, fingerprint);
+    if (keeper != block) {
+      inode.contents.inode.data_blocks[i] = keeper;
+      kept[num_old] = keeper;
+      old[num_old++] = block;
+    }
+    // full blocks are never changed in place, so appends may share them
+    if ((i + 1) * BLOCK_SIZE <= size) {
+      set_fingerprint(keeper, fingerprint);
+    }
+  }
+  if (num_old > 0) {
+    journal_write_block(inode_num, &inode);
+  }
+  if (journal_end() < 0) {
+    // nothing was committed: the old blocks are still in use, and the
+    // references added to the kept ones are not
+    release_blocks(kept, num_old);
+    return -1;
+  }
+
+  int released = release_blocks(old, num_old);
+  if (released < 0) {
+    return -1;
+  }
+  duplicates += num_old;
+  freed += released;
+  return 0;
+}
+
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s disk_file\n", argv[0]);
+    return 1;
+  }
+  const char* disk = argv[1];
+
+  // bfs_mount() would create a missing disk
+  struct stat st;
+  if (stat(disk, &st) < 0 || st.st_size < NUM_BLOCKS * BLOCK_SIZE) {
+    fprintf(stderr, "%s: not a disk image\n", disk);
+    return 1;
+  }
+  struct block root;
+  if (bfs_mount(disk) < 0 || journal_read_block(1, &root) < 0) {
+    perror(disk);
+    return 1;
+  }
+  if (root.is_dir != 0 || root.contents.dirnode.magic != JFS_MAGIC
+      || root.contents.dirnode.version != JFS_VERSION) {
+    fprintf(stderr, "%s: not formatted by this version of the file system\n", disk);
+    bfs_unmount();
+    return 1;
+  }
+
+  // visit every file once, walking the tree from the root
+  static block_num_t stack[NUM_BLOCKS];
+  static char visited[NUM_BLOCKS];
+  int depth = 0, ret = 0;
+  stack[depth++] = 1;
+  visited[1] = 1;
+  while (depth > 0 && ret == 0) {
+    struct block dir;
+    if (journal_read_block(stack[--depth], &dir) < 0) {
+      ret = -1;
+      break;
+    }
+    for (int i = 0; i < dir.contents.dirnode.num_entries && ret == 0; i++) {
+      block_num_t block = dir.contents.dirnode.entries[i].block_num;
+      struct block entry;
+      if (block >= NUM_BLOCKS || visited[block] || journal_read_block(block, &entry) < 0) {
+        continue;
+      }
+      visited[block] = 1;
+      if (entry.is_dir == 0) {
+        stack[depth++] = block;
+      } else {
+        ret = dedup_inode(block);
+      }
+    }
+  }
+
+  if (ret < 0) {
+    perror(disk);
+  }
+  unsigned int allocated = count_allocated_blocks();
+  if (bfs_unmount() < 0) {
+    perror(disk);
+    return 1;
+  }
+  printf("%s: %u duplicate blocks, %u blocks freed, %u/%d blocks used\n",
+         disk, duplicates, freed, allocated, NUM_BLOCKS);
+  return ret < 0;
+}
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "jumbo_file_system.h"
+
+#define MAX_WORKERS 16
+
+// exit codes, as in e2fsck
+#define FSCK_OK 0       // no problems found
+#define FSCK_REPAIRED 1 // problems found and all of them repaired
+#define FSCK_ERRORS 4   // problems left unrepaired
+#define FSCK_FAILED 8   // the image could not be checked
+
+// owner key of a block no directory entry has claimed yet
+#define NO_OWNER UINT64_MAX
+
+_Static_assert(sizeof(struct block) == BLOCK_SIZE, "a struct block must fill exactly one disk block");
+
+// the whole image, read with one sequential read; the workers only read it,
+// repairs are made afterwards by the main thread
+static struct block image[NUM_BLOCKS];
+static unsigned char* const bitmap = (unsigned char*) &image[0];
+static unsigned char* const refcounts = (unsigned char*) &image[REFCOUNT_START];
+static uint16_t* const fingerprints = (uint16_t*) &image[FINGERPRINT_START];
+static char dirty[NUM_BLOCKS];
+
+// directory entries and inode data block entries found pointing at each block
+static unsigned int meta_refs[NUM_BLOCKS];
+static unsigned int data_refs[NUM_BLOCKS];
+
+// the entry that keeps a directory or inode block referenced more than once:
+// the one closest to the root, then the one in the lowest block and slot
+static uint64_t owner[NUM_BLOCKS];
+
+// level of each directory below the root
+static uint32_t depth[NUM_BLOCKS];
+
+// the directories of the level being checked, and those of the next level
+static block_num_t frontier[2][NUM_BLOCKS];
+static unsigned int frontier_count[2];
+static int level;
+static unsigned int next_item;
+static int walk_done;
+static pthread_barrier_t level_start, level_end;
+
+static unsigned int num_dirs, num_files;
+static int problems;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// prints one problem (called from any worker)
+static void problem(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  pthread_mutex_lock(&report_lock);
+  problems++;
+  vprintf(format, args);
+  putchar('\n');
+  pthread_mutex_unlock(&report_lock);
+  va_end(args);
+}
+
+
+static int is_allocated(block_num_t block) {
+  return bitmap[block / 8] & (1 << (block % 8));
+}
+
+
+// blocks that are always allocated: superblock, root, tables and journal
+static int is_reserved(block_num_t block) {
+  return block < 2 || block >= RESERVED_START;
+}
+
+
+static uint64_t entry_key(block_num_t dir_num, int index) {
+  return (uint64_t) (depth[dir_num] + 1) << 32 | (uint64_t) dir_num << 8 | index;
+}
+
+
+// makes key the owner of block if it is closer to the root than the owner so far
+static void claim(block_num_t block, uint64_t key) {
+  uint64_t old = __atomic_load_n(&owner[block], __ATOMIC_RELAXED);
+  while (key < old && !__atomic_compare_exchange_n(&owner[block], &old, key, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+
+/* entry_problem
+ *   checks entry index of a directory on its own (not whether some other
+ *   entry points at the same block)
+ * returns what is wrong with the entry, or NULL if nothing is
+ */
+static const char* entry_problem(const struct block* dir, int index) {
+  const char* name = dir->contents.dirnode.entries[index].name;
+  block_num_t block = dir->contents.dirnode.entries[index].block_num;
+  if (!memchr(name, '\0', MAX_NAME_LENGTH + 1)) {
+    return "name is not terminated";
+  }
+  if (name[0] == '\0') {
+    return "name is empty";
+  }
+  for (int i = 0; i < index; i++) {
+    if (!strncmp(dir->contents.dirnode.entries[i].name, name, MAX_NAME_LENGTH + 1)) {
+      return "name appears earlier in the directory";
+    }
+  }
+  if (block == 1) {
+    return "points at the root directory";
+  }
+  if (block >= NUM_BLOCKS || is_reserved(block)) {
+    return "points outside the data area";
+  }
+  if (image[block].is_dir > 1) {
+    return "points at a block that is neither a directory nor an inode";
+  }
+  return NULL;
+}
+
+
+// largest size an inode can have given its flags
+static unsigned int size_limit(const struct block* inode) {
+  return inode->contents.inode.flags & INODE_INLINE ? INLINE_DATA_SIZE : MAX_FILE_SIZE;
+}
+
+
+/* inode_refs
+ *   finds the data block entries of an inode that count as references: those
+ *   of used blocks (a 0 entry is a hole) and the run of preallocated blocks
+ *   after them.  Entries past that run must be 0.
+ * refs - set to 1 for each entry that counts and 0 for the others
+ * returns the number of nonzero entries that do not count (repair clears them)
+ */
+static int inode_refs(const struct block* inode, char refs[MAX_DATA_BLOCKS]) {
+  memset(refs, 0, MAX_DATA_BLOCKS);
+  if (inode->contents.inode.flags & INODE_INLINE) {
+    return 0;
+  }
+  unsigned int size = inode->contents.inode.file_size;
+  if (size > MAX_FILE_SIZE) {
+    size = MAX_FILE_SIZE;
+  }
+  unsigned int used = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  int invalid = 0, preallocated = 1;
+  for (unsigned int i = 0; i < MAX_DATA_BLOCKS; i++) {
+    block_num_t block = inode->contents.inode.data_blocks[i];
+    if (block == 0) {
+      preallocated = i < used;
+      continue;
+    }
+    if ((i < used || preallocated) && block < NUM_BLOCKS && !is_reserved(block)) {
+      refs[i] = 1;
+    } else {
+      invalid++;
+      preallocated = i < used;
+    }
+  }
+  return invalid;
+}
+
+
+static void check_inode(block_num_t inode_num) {
+  const struct block* inode = &image[inode_num];
+  if (inode->contents.inode.file_size > size_limit(inode)) {
+    problem("inode %d: size %d is larger than %d", inode_num,
+            inode->contents.inode.file_size, size_limit(inode));
+  }
+
+  char refs[MAX_DATA_BLOCKS];
+  int invalid = inode_refs(inode, refs);
+  if (invalid) {
+    problem("inode %d: %d data block entries are out of range or past the file", inode_num, invalid);
+  }
+  for (unsigned int i = 0; i < MAX_DATA_BLOCKS; i++) {
+    if (refs[i]) {
+      __atomic_fetch_add(&data_refs[inode->contents.inode.data_blocks[i]], 1, __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_fetch_add(&num_files, 1, __ATOMIC_RELAXED);
+}
+
+
+// checks a directory and the inodes in it, and queues its subdirectories
+// for the next level
+static void check_dir(block_num_t dir_num) {
+  const struct block* dir = &image[dir_num];
+  int num_entries = dir->contents.dirnode.num_entries;
+  if (num_entries > (int) MAX_DIR_ENTRIES) {
+    problem("directory %d: %d entries (at most %d fit)", dir_num, num_entries, (int) MAX_DIR_ENTRIES);
+    num_entries = MAX_DIR_ENTRIES;
+  }
+
+  for (int i = 0; i < num_entries; i++) {
+    const char* why = entry_problem(dir, i);
+    if (why) {
+      problem("directory %d, entry %d: %s", dir_num, i, why);
+      continue;
+    }
+
+    // only the first entry to reach a block checks it
+    block_num_t block = dir->contents.dirnode.entries[i].block_num;
+    claim(block, entry_key(dir_num, i));
+    if (__atomic_fetch_add(&meta_refs[block], 1, __ATOMIC_RELAXED) > 0) {
+      continue;
+    }
+    if (image[block].is_dir == 0) {
+      depth[block] = depth[dir_num] + 1;
+      int next = !level;
+      frontier[next][__atomic_fetch_add(&frontier_count[next], 1, __ATOMIC_RELAXED)] = block;
+    } else {
+      check_inode(block);
+    }
+  }
+  __atomic_fetch_add(&num_dirs, 1, __ATOMIC_RELAXED);
+}
+
+
+/* worker
+ *   checks the directories of each level of the tree, taking them one at a
+ *   time from the shared frontier, until the main thread ends the walk
+ */
+static void* worker(void* arg) {
+  (void) arg;
+  for (;;) {
+    pthread_barrier_wait(&level_start);
+    if (walk_done) {
+      return NULL;
+    }
+    unsigned int i;
+    while ((i = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < frontier_count[level]) {
+      check_dir(frontier[level][i]);
+    }
+    pthread_barrier_wait(&level_end);
+  }
+}
+
+
+/* walk
+ *   walks the tree from the root one level at a time with num_workers
+ *   threads, counting the references to every block
+ */
+static void walk(int num_workers) {
+  pthread_t threads[MAX_WORKERS];
+  pthread_barrier_init(&level_start, NULL, num_workers + 1);
+  pthread_barrier_init(&level_end, NULL, num_workers + 1);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+
+  owner[1] = 0;
+  meta_refs[1] = 1;
+  frontier[0][0] = 1;
+  frontier_count[0] = 1;
+  level = 0;
+  while (frontier_count[level] > 0) {
+    frontier_count[!level] = 0;
+    next_item = 0;
+    pthread_barrier_wait(&level_start);
+    pthread_barrier_wait(&level_end);
+    level = !level;
+  }
+
+  walk_done = 1;
+  pthread_barrier_wait(&level_start);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_barrier_destroy(&level_start);
+  pthread_barrier_destroy(&level_end);
+}
+
+
+// the number of extra references the refcount table should hold for block
+static unsigned int expected_refcount(block_num_t block) {
+  if (is_reserved(block) || meta_refs[block] > 0 || data_refs[block] < 2) {
+    return 0;
+  }
+  return data_refs[block] - 1 > MAX_SHARED_REFS ? MAX_SHARED_REFS : data_refs[block] - 1;
+}
+
+
+// whether block holds file data (only such blocks may have a fingerprint)
+static int holds_data(block_num_t block) {
+  return !is_reserved(block) && meta_refs[block] == 0 && data_refs[block] > 0;
+}
+
+
+/* check_blocks
+ *   compares the references found by the walk with the bitmap and the
+ *   reference count table; runs after the walk, on the main thread
+ */
+static void check_blocks() {
+  for (block_num_t block = 2; block < NUM_BLOCKS; block++) {
+    if (meta_refs[block] > 1) {
+      problem("block %d: referenced by %d directory entries", block, meta_refs[block]);
+    }
+    if (meta_refs[block] > 0 && image[block].is_dir == 1) {
+      char refs[MAX_DATA_BLOCKS];
+      inode_refs(&image[block], refs);
+      for (unsigned int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        block_num_t data = image[block].contents.inode.data_blocks[i];
+        if (refs[i] && meta_refs[data] > 0) {
+          problem("inode %d: data block %d is directory or inode block %d", block, i, data);
+        }
+      }
+    }
+  }
+
+  for (block_num_t block = 0; block < NUM_BLOCKS; block++) {
+    int in_use = is_reserved(block) || meta_refs[block] > 0 || data_refs[block] > 0;
+    if (in_use && !is_allocated(block)) {
+      problem("block %d: in use but marked free", block);
+    } else if (!in_use && is_allocated(block)) {
+      problem("block %d: orphaned (marked allocated but not referenced)", block);
+    }
+    if (refcounts[block] != expected_refcount(block)) {
+      problem("block %d: reference count %d, expected %d", block, refcounts[block], expected_refcount(block));
+    }
+    if (fingerprints[block] && !holds_data(block)) {
+      problem("block %d: has a fingerprint but holds no file data", block);
+    }
+  }
+}
+
+
+// applies the repair of one directory's entries
+static void repair_dir(block_num_t dir_num) {
+  struct block* dir = &image[dir_num];
+  int num_entries = dir->contents.dirnode.num_entries;
+  if (num_entries > (int) MAX_DIR_ENTRIES) {
+    num_entries = MAX_DIR_ENTRIES;
+  }
+
+  // decide on every entry before moving any of them
+  int keep[MAX_DIR_ENTRIES];
+  for (int i = 0; i < num_entries; i++) {
+    keep[i] = !entry_problem(dir, i)
+      && owner[dir->contents.dirnode.entries[i].block_num] == entry_key(dir_num, i);
+  }
+  int kept = 0;
+  for (int i = 0; i < num_entries; i++) {
+    if (keep[i]) {
+      dir->contents.dirnode.entries[kept++] = dir->contents.dirnode.entries[i];
+    }
+  }
+  if (kept != dir->contents.dirnode.num_entries) {
+    dir->contents.dirnode.num_entries = kept;
+    dirty[dir_num] = 1;
+  }
+}
+
+
+// applies the repair of one inode's size and data block entries
+static void repair_inode(block_num_t inode_num) {
+  struct block* inode = &image[inode_num];
+  if (inode->contents.inode.file_size > size_limit(inode)) {
+    inode->contents.inode.file_size = size_limit(inode);
+    dirty[inode_num] = 1;
+  }
+  if (inode->contents.inode.flags & INODE_INLINE) {
+    return;
+  }
+
+  char refs[MAX_DATA_BLOCKS];
+  inode_refs(inode, refs);
+  for (unsigned int i = 0; i < MAX_DATA_BLOCKS; i++) {
+    block_num_t block = inode->contents.inode.data_blocks[i];
+    if (block && (!refs[i] || meta_refs[block] > 0)) {
+      // the entry becomes a hole (or stops the preallocated run)
+      inode->contents.inode.data_blocks[i] = 0;
+      if (refs[i]) {
+        data_refs[block]--;
+      }
+      dirty[inode_num] = 1;
+    }
+  }
+}
+
+
+/* repair
+ *   fixes every problem check_blocks() and the walk found, in memory:
+ *   entries that are invalid or that lost a block to another entry are
+ *   removed, bad inode entries are cleared, and the bitmap and reference
+ *   counts are rebuilt from the references that are left
+ */
+static void repair() {
+  for (block_num_t block = 1; block < NUM_BLOCKS; block++) {
+    if (meta_refs[block] > 0 && image[block].is_dir == 0) {
+      repair_dir(block);
+    } else if (meta_refs[block] > 0 && image[block].is_dir == 1) {
+      repair_inode(block);
+    }
+  }
+
+  for (block_num_t block = 0; block < NUM_BLOCKS; block++) {
+    int in_use = is_reserved(block) || meta_refs[block] > 0 || data_refs[block] > 0;
+    if (in_use != !!is_allocated(block)) {
+      bitmap[block / 8] ^= 1 << (block % 8);
+      dirty[0] = 1;
+    }
+    if (refcounts[block] != expected_refcount(block)) {
+      refcounts[block] = expected_refcount(block);
+      dirty[REFCOUNT_START + block / BLOCK_SIZE] = 1;
+    }
+    if (fingerprints[block] && !holds_data(block)) {
+      fingerprints[block] = 0;
+      dirty[FINGERPRINT_START + block / (BLOCK_SIZE / 2)] = 1;
+    }
+  }
+}
+
+
+int main(int argc, char** argv) {
+  int fix = 0;
+  long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "rj:")) != -1) {
+    if (opt == 'r') {
+      fix = 1;
+    } else if (opt == 'j') {
+      num_workers = atoi(optarg);
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (num_workers > MAX_WORKERS) {
+    num_workers = MAX_WORKERS;
+  }
+  if (optind != argc - 1 || num_workers <= 0) {
+    fprintf(stderr, "usage: %s [-r] [-j workers (1-%d)] disk_file\n", argv[0], MAX_WORKERS);
+    return FSCK_FAILED;
+  }
+  const char* disk = argv[optind];
+
+  // raw_mount() would create a missing disk; fsck must not
+  struct stat st;
+  if (stat(disk, &st) < 0 || st.st_size < NUM_BLOCKS * BLOCK_SIZE) {
+    fprintf(stderr, "%s: not a disk image\n", disk);
+    return FSCK_FAILED;
+  }
+
+  // replay the journal, as mounting would, then read everything at once
+  double start = now();
+  if (raw_mount(disk) < 0 || journal_open() < 0 || read_blocks(0, image, NUM_BLOCKS) < 0) {
+    perror(disk);
+    return FSCK_FAILED;
+  }
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    owner[i] = NO_OWNER;
+  }
+
+  if (image[1].is_dir != 0) {
+    problem("root directory: block 1 is not a directory");
+    if (fix) {
+      // start over with an empty root; everything else becomes an orphan
+      memset(&image[1], 0, sizeof(image[1]));
+      image[1].contents.dirnode.magic = JFS_MAGIC;
+      image[1].contents.dirnode.version = JFS_VERSION;
+      dirty[1] = 1;
+    }
+  }
+  if (image[1].is_dir == 0 && (image[1].contents.dirnode.magic != JFS_MAGIC
+                                || image[1].contents.dirnode.version != JFS_VERSION)) {
+    problem("root directory: no JFS_MAGIC/JFS_VERSION (mounting would format the disk)");
+    if (fix) {
+      image[1].contents.dirnode.magic = JFS_MAGIC;
+      image[1].contents.dirnode.version = JFS_VERSION;
+      dirty[1] = 1;
+    }
+  }
+  if (image[1].is_dir == 0) {
+    walk(num_workers);
+  }
+  check_blocks();
+
+  int ret = problems ? FSCK_ERRORS : FSCK_OK;
+  if (fix && problems) {
+    repair();
+    for (block_num_t block = 0; block < NUM_BLOCKS; block++) {
+      if (dirty[block] && write_block(block, &image[block]) < 0) {
+        perror(disk);
+        return FSCK_FAILED;
+      }
+    }
+    if (raw_sync() < 0) {
+      perror(disk);
+      return FSCK_FAILED;
+    }
+    ret = FSCK_REPAIRED;
+  }
+  raw_unmount();
+
+  unsigned int used = 0, shared = 0;
+  for (block_num_t block = 0; block < NUM_BLOCKS; block++) {
+    used += !!is_allocated(block);
+    shared += refcounts[block] > 0;
+  }
+  printf("%s: %d problem%s%s, %u directories, %u files, %u/%d blocks used (%u shared), %.3f s\n",
+         disk, problems, problems == 1 ? "" : "s", ret == FSCK_REPAIRED ? " repaired" : "",
+         num_dirs, num_files, used, NUM_BLOCKS, shared, now() - start);
+  return ret;
+}
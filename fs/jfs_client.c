@@ -0,0 +1,585 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "jumbo_file_system.h"
+#include "jfsd_protocol.h"
+
+// A drop-in replacement for jumbo_file_system.o: the same jfs_* calls, each
+// forwarded to a jfsd server (see jfsd.c) instead of running on a disk this
+// process mounts.  jfs_mount() connects to the server's socket and
+// jfs_unmount() disconnects.  Sessions stay on this side: every request
+// carries the caller's current directory, so sessions can be copied and
+// used from any thread as with the local file system.  Calls from several
+// threads share one connection and are pipelined: a call sends its request
+// as soon as the previous one has been sent, without waiting for responses,
+// and the server answers in order.
+
+// A call whose request has been sent, waiting for its response
+struct pending {
+  uint32_t id;
+  struct jfsd_buffer* results;
+  int32_t result;
+  int done; // the response has been read, or the connection failed (ok is 0)
+  int ok;
+  struct pending* next;
+};
+
+static int server = -1;
+static int broken; // the connection failed and is out of step; every call fails
+static uint32_t next_id;
+// held while a request is being written, so requests are not interleaved
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+// protects everything else here
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t response_read = PTHREAD_COND_INITIALIZER;
+// calls sent and not answered yet, in the order they were sent
+static struct pending* oldest;
+static struct pending* newest;
+static int reading; // a thread is reading the response of oldest
+
+static int write_all(int fd, const char* buf, size_t count) {
+  while (count > 0) {
+    ssize_t done = send(fd, buf, count, MSG_NOSIGNAL);
+    if (done < 0 && EINTR == errno) {
+      continue;
+    }
+    if (done <= 0) {
+      return -1;
+    }
+    buf += done;
+    count -= done;
+  }
+  return 0;
+}
+
+static int read_all(int fd, char* buf, size_t count) {
+  while (count > 0) {
+    ssize_t done = read(fd, buf, count);
+    if (done < 0 && EINTR == errno) {
+      continue;
+    }
+    if (done <= 0) {
+      return -1;
+    }
+    buf += done;
+    count -= done;
+  }
+  return 0;
+}
+
+
+// marks the connection failed; the caller holds server_lock
+static void fail_connection() {
+  if (!broken && server >= 0) {
+    shutdown(server, SHUT_RDWR); // wakes up anyone sending or reading
+  }
+  broken = 1;
+}
+
+
+/* read_response
+ *   reads the response to the oldest call waiting for one, without holding
+ *   server_lock; the caller holds it on entry and exit, and has set reading
+ */
+static void read_response() {
+  struct pending* call = oldest;
+  int ok = !broken;
+  pthread_mutex_unlock(&server_lock);
+  struct jfsd_response response;
+  ok = ok && read_all(server, (char*) &response, sizeof(response)) == 0
+    && response.id == call->id && response.length <= JFSD_MAX_MESSAGE;
+  if (ok && response.length) {
+    call->results->length = 0;
+    call->results->capacity = response.length;
+    call->results->data = realloc(call->results->data, call->results->capacity);
+    ok = read_all(server, call->results->data, response.length) == 0;
+    call->results->length = response.length;
+  }
+  pthread_mutex_lock(&server_lock);
+
+  if (!ok) {
+    fail_connection();
+  }
+  call->result = ok ? response.result : E_UNKNOWN;
+  call->ok = ok;
+  call->done = 1;
+  oldest = call->next;
+  if (!oldest) {
+    newest = NULL;
+  }
+}
+
+
+/* call
+ *   sends one request to the server and waits for its response.  While it
+ *   waits, other threads can send theirs; whichever waiting thread gets
+ *   there first reads the responses, in order, for all of them.
+ * args - the request's arguments (NULL for none)
+ * results - receives the results (NULL to ignore them); the caller frees
+ *   results->data
+ * returns the call's return code, or E_UNKNOWN if the server could not be
+ *   reached (the connection is then given up, since it is out of step)
+ */
+static int call(int op, block_num_t dir, const struct jfsd_buffer* args, struct jfsd_buffer* results) {
+  struct jfsd_request request = { args ? args->length : 0, 0, dir, op, 0 };
+  struct jfsd_buffer message = { NULL, 0, 0 };
+  struct jfsd_buffer ignored = { NULL, 0, 0 };
+  struct pending pending = { 0, results ? results : &ignored, E_UNKNOWN, 0, 0, NULL };
+
+  pthread_mutex_lock(&send_lock);
+  pthread_mutex_lock(&server_lock);
+  int sending = server >= 0 && !broken;
+  if (sending) {
+    // queued before it is sent, so the queue is in the order of the stream
+    request.id = pending.id = next_id++;
+    if (newest) {
+      newest->next = &pending;
+    } else {
+      oldest = &pending;
+    }
+    newest = &pending;
+  }
+  pthread_mutex_unlock(&server_lock);
+  if (sending) {
+    jfsd_put(&message, &request, sizeof(request));
+    if (args) {
+      jfsd_put(&message, args->data, args->length);
+    }
+    if (write_all(server, message.data, message.length) < 0) {
+      pthread_mutex_lock(&server_lock);
+      fail_connection();
+      pthread_mutex_unlock(&server_lock);
+    }
+  }
+  pthread_mutex_unlock(&send_lock);
+
+  pthread_mutex_lock(&server_lock);
+  while (sending && !pending.done) {
+    if (reading) {
+      pthread_cond_wait(&response_read, &server_lock);
+      continue;
+    }
+    reading = 1;
+    read_response();
+    reading = 0;
+    pthread_cond_broadcast(&response_read);
+  }
+  pthread_mutex_unlock(&server_lock);
+
+  free(message.data);
+  free(ignored.data);
+  return pending.ok ? pending.result : E_UNKNOWN;
+}
+
+// reads the results of a call
+static struct jfsd_cursor results_cursor(const struct jfsd_buffer* results) {
+  struct jfsd_cursor cursor = { results->data, results->data + results->length, 0 };
+  return cursor;
+}
+
+// a call whose only argument is a name, and which has no results
+static int call_name(int op, struct jfs_session* session, const char* name) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_name(&args, name);
+  int ret = call(op, session->current_dir, &args, NULL);
+  free(args.data);
+  return ret;
+}
+
+
+/* jfs_mount
+ *   connects to a jfsd server
+ * filename - the server's socket (see JFSD_SOCKET)
+ * returns 0 on success or -1 on failure
+ */
+int jfs_mount(const char* filename) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(filename) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, filename);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  pthread_mutex_lock(&server_lock);
+  server = fd;
+  broken = 0;
+  pthread_mutex_unlock(&server_lock);
+  return 0;
+}
+
+
+void jfs_session_init(struct jfs_session* session) {
+  session->current_dir = 1;
+}
+
+
+// the server checks the directory of every request itself
+int jfs_check_session(struct jfs_session* session) {
+  return session->current_dir && session->current_dir < NUM_BLOCKS ? E_SUCCESS : E_NOT_EXISTS;
+}
+
+
+int jfs_mkdir(struct jfs_session* session, const char* directory_name) {
+  return call_name(JFSD_MKDIR, session, directory_name);
+}
+
+
+int jfs_chdir(struct jfs_session* session, const char* directory_name) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_name(&args, directory_name);
+  int ret = call(JFSD_CHDIR, session->current_dir, &args, &results);
+  struct jfsd_cursor cursor = results_cursor(&results);
+  uint32_t dir = jfsd_get_u32(&cursor);
+  if (E_SUCCESS == ret) {
+    ret = cursor.error || dir == 0 || dir >= NUM_BLOCKS ? E_UNKNOWN : E_SUCCESS;
+  }
+  if (E_SUCCESS == ret) {
+    session->current_dir = dir;
+  }
+  free(args.data);
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_ls(struct jfs_session* session, char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]) {
+  struct jfsd_buffer results = { NULL, 0, 0 };
+  int ret = call(JFSD_LS, session->current_dir, NULL, &results);
+  if (E_SUCCESS == ret) {
+    struct jfsd_cursor cursor = results_cursor(&results);
+    for (int list = 0; list < 2; list++) {
+      char** names = list ? files : directories;
+      uint32_t count = jfsd_get_u32(&cursor);
+      uint32_t i;
+      for (i = 0; i < count && i < MAX_DIR_ENTRIES && !cursor.error; i++) {
+        char name[256];
+        names[i] = strdup(jfsd_get_name(&cursor, name) ? name : "");
+      }
+      names[i] = NULL;
+    }
+  }
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_rmdir(struct jfs_session* session, const char* directory_name) {
+  return call_name(JFSD_RMDIR, session, directory_name);
+}
+
+
+/* jfs_walk
+ *   as jfs_walk in jumbo_file_system.c, except that the server walks the
+ *   whole tree first and fn is then called for each entry it sent back
+ */
+int jfs_walk(struct jfs_session* session, const char* directory_name, int flags, jfs_walk_fn fn, void* arg) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_name(&args, directory_name);
+  jfsd_put_u32(&args, flags);
+  int ret = call(JFSD_WALK, session->current_dir, &args, &results);
+  free(args.data);
+
+  struct jfsd_cursor cursor = results_cursor(&results);
+  uint32_t count = E_SUCCESS == ret ? jfsd_get_u32(&cursor) : 0;
+  for (uint32_t i = 0; i < count && !cursor.error; i++) {
+    uint32_t length;
+    const char* path = jfsd_get_data(&cursor, &length);
+    struct jfs_walk_entry entry;
+    entry.depth = jfsd_get_u32(&cursor);
+    entry.is_dir = jfsd_get_u32(&cursor);
+    entry.block_num = jfsd_get_u32(&cursor);
+    entry.num_data_blocks = jfsd_get_u32(&cursor);
+    entry.file_size = jfsd_get_u32(&cursor);
+    if (cursor.error) {
+      ret = E_UNKNOWN;
+      break;
+    }
+    char* copy = strndup(path, length);
+    const char* slash = strrchr(copy, '/');
+    entry.path = copy;
+    entry.name = slash ? slash + 1 : copy;
+    ret = fn(&entry, arg);
+    free(copy);
+    if (ret) {
+      break;
+    }
+  }
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_remove_tree(struct jfs_session* session, const char* name) {
+  return call_name(JFSD_REMOVE_TREE, session, name);
+}
+
+
+int jfs_creat(struct jfs_session* session, const char* file_name) {
+  return call_name(JFSD_CREAT, session, file_name);
+}
+
+
+int jfs_remove(struct jfs_session* session, const char* file_name) {
+  return call_name(JFSD_REMOVE, session, file_name);
+}
+
+
+int jfs_stat(struct jfs_session* session, const char* name, struct stats* buf) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_name(&args, name);
+  int ret = call(JFSD_STAT, session->current_dir, &args, &results);
+  if (E_SUCCESS == ret) {
+    struct jfsd_cursor cursor = results_cursor(&results);
+    jfsd_get(&cursor, buf, sizeof(*buf));
+    ret = cursor.error ? E_UNKNOWN : ret;
+  }
+  free(args.data);
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_listdir(struct jfs_session* session, const char* directory_name, struct jfs_listing** listing) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_name(&args, directory_name);
+  int ret = call(JFSD_LISTDIR, session->current_dir, &args, &results);
+  if (E_SUCCESS == ret) {
+    struct jfsd_cursor cursor = results_cursor(&results);
+    uint32_t num_entries = jfsd_get_u32(&cursor);
+    size_t size = num_entries * sizeof(struct stats);
+    if (cursor.error || size != (size_t) (cursor.end - cursor.next)) {
+      ret = E_UNKNOWN;
+    } else {
+      *listing = malloc(sizeof(struct jfs_listing) + size);
+      (*listing)->num_entries = num_entries;
+      jfsd_get(&cursor, (*listing)->entries, size);
+    }
+  }
+  free(args.data);
+  free(results.data);
+  return ret;
+}
+
+
+void jfs_free_listing(struct jfs_listing* listing) {
+  free(listing);
+}
+
+
+int jfs_write(struct jfs_session* session, const char* file_name, const void* buf, unsigned short count) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_name(&args, file_name);
+  jfsd_put_data(&args, buf, count);
+  int ret = call(JFSD_WRITE, session->current_dir, &args, NULL);
+  free(args.data);
+  return ret;
+}
+
+
+int jfs_pwrite(struct jfs_session* session, const char* file_name, const void* buf, unsigned short count, unsigned int offset) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_name(&args, file_name);
+  jfsd_put_u32(&args, offset);
+  jfsd_put_data(&args, buf, count);
+  int ret = call(JFSD_PWRITE, session->current_dir, &args, NULL);
+  free(args.data);
+  return ret;
+}
+
+
+int jfs_fallocate(struct jfs_session* session, const char* file_name, unsigned int length) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_name(&args, file_name);
+  jfsd_put_u32(&args, length);
+  int ret = call(JFSD_FALLOCATE, session->current_dir, &args, NULL);
+  free(args.data);
+  return ret;
+}
+
+
+// jfs_read() and jfs_pread(), which differ only in the offset sent
+static int read_data(int op, struct jfs_session* session, const char* file_name, void* buf,
+                     unsigned short* ptr_count, unsigned int offset) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_name(&args, file_name);
+  jfsd_put_u32(&args, *ptr_count);
+  if (JFSD_PREAD == op) {
+    jfsd_put_u32(&args, offset);
+  }
+  int ret = call(op, session->current_dir, &args, &results);
+  if (E_SUCCESS == ret) {
+    struct jfsd_cursor cursor = results_cursor(&results);
+    uint32_t count;
+    const char* data = jfsd_get_data(&cursor, &count);
+    if (cursor.error || count > *ptr_count) {
+      ret = E_UNKNOWN;
+    } else {
+      memcpy(buf, data, count);
+      *ptr_count = count;
+    }
+  }
+  free(args.data);
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_read(struct jfs_session* session, const char* file_name, void* buf, unsigned short* ptr_count) {
+  return read_data(JFSD_READ, session, file_name, buf, ptr_count, 0);
+}
+
+
+int jfs_pread(struct jfs_session* session, const char* file_name, void* buf, unsigned short* ptr_count, unsigned int offset) {
+  return read_data(JFSD_PREAD, session, file_name, buf, ptr_count, offset);
+}
+
+
+int jfs_seek(struct jfs_session* session, const char* file_name, unsigned int offset, int whence, unsigned int* result) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_name(&args, file_name);
+  jfsd_put_u32(&args, offset);
+  jfsd_put_u32(&args, whence);
+  int ret = call(JFSD_SEEK, session->current_dir, &args, &results);
+  if (E_SUCCESS == ret) {
+    struct jfsd_cursor cursor = results_cursor(&results);
+    *result = jfsd_get_u32(&cursor);
+    ret = cursor.error ? E_UNKNOWN : ret;
+  }
+  free(args.data);
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_clone(struct jfs_session* session, const char* src_name, const char* dst_name) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_name(&args, src_name);
+  jfsd_put_name(&args, dst_name);
+  int ret = call(JFSD_CLONE, session->current_dir, &args, NULL);
+  free(args.data);
+  return ret;
+}
+
+
+int jfs_set_compression(struct jfs_session* session, const char* file_name, int enabled) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_name(&args, file_name);
+  jfsd_put_u32(&args, enabled);
+  int ret = call(JFSD_SET_COMPRESSION, session->current_dir, &args, NULL);
+  free(args.data);
+  return ret;
+}
+
+
+int jfs_batch(struct jfs_session* session, struct jfs_op* ops, int num_ops) {
+  struct jfsd_buffer args = { NULL, 0, 0 }, results = { NULL, 0, 0 };
+  jfsd_put_u32(&args, num_ops);
+  for (int i = 0; i < num_ops; i++) {
+    uint8_t op = ops[i].op;
+    jfsd_put(&args, &op, 1);
+    jfsd_put_name(&args, ops[i].name);
+    jfsd_put_data(&args, ops[i].buf, JFS_OP_WRITE == ops[i].op ? ops[i].count : 0);
+  }
+  int ret = call(JFSD_BATCH, session->current_dir, &args, &results);
+  struct jfsd_cursor cursor = results_cursor(&results);
+  uint32_t count = E_SUCCESS == ret ? jfsd_get_u32(&cursor) : 0;
+  for (int i = 0; i < num_ops; i++) {
+    ops[i].result = (uint32_t) i < count ? (int) jfsd_get_u32(&cursor) : E_UNKNOWN;
+  }
+  free(args.data);
+  free(results.data);
+  return ret;
+}
+
+
+void jfs_cache_stats(struct jfs_cache_stats* buf) {
+  struct jfsd_buffer results = { NULL, 0, 0 };
+  struct jfsd_cursor cursor = { NULL, NULL, 1 };
+  if (call(JFSD_CACHE_STATS, 0, NULL, &results) == E_SUCCESS) {
+    cursor = results_cursor(&results);
+  }
+  jfsd_get(&cursor, buf, sizeof(*buf)); // zeros if the call failed
+  free(results.data);
+}
+
+
+int jfs_frag_stats(struct jfs_frag_stats* buf) {
+  struct jfsd_buffer results = { NULL, 0, 0 };
+  int ret = call(JFSD_FRAG_STATS, 0, NULL, &results);
+  if (E_SUCCESS == ret) {
+    struct jfsd_cursor cursor = results_cursor(&results);
+    jfsd_get(&cursor, buf, sizeof(*buf));
+    ret = cursor.error ? E_UNKNOWN : ret;
+  }
+  free(results.data);
+  return ret;
+}
+
+
+int jfs_defrag(unsigned int* blocks_moved) {
+  struct jfsd_buffer results = { NULL, 0, 0 };
+  int ret = call(JFSD_DEFRAG, 0, NULL, &results);
+  struct jfsd_cursor cursor = results_cursor(&results);
+  uint32_t moved = E_SUCCESS == ret ? jfsd_get_u32(&cursor) : 0;
+  if (blocks_moved) {
+    *blocks_moved = moved;
+  }
+  free(results.data);
+  return ret;
+}
+
+
+void jfs_set_dedup(int enabled) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_u32(&args, enabled);
+  call(JFSD_SET_DEDUP, 0, &args, NULL);
+  free(args.data);
+}
+
+
+int jfs_sync() {
+  return call(JFSD_SYNC, 0, NULL, NULL) == E_SUCCESS ? 0 : -1;
+}
+
+
+/* jfs_trace_start
+ *   starts a trace on the server; filename is opened by the server, relative
+ *   to its working directory
+ */
+int jfs_trace_start(const char* filename) {
+  struct jfsd_buffer args = { NULL, 0, 0 };
+  jfsd_put_data(&args, filename, strlen(filename));
+  int ret = call(JFSD_TRACE_START, 0, &args, NULL);
+  free(args.data);
+  return ret == E_SUCCESS ? 0 : -1;
+}
+
+
+int jfs_trace_stop() {
+  return call(JFSD_TRACE_STOP, 0, NULL, NULL) == E_SUCCESS ? 0 : -1;
+}
+
+
+/* jfs_unmount
+ *   disconnects from the server, which keeps the disk mounted
+ */
+int jfs_unmount() {
+  pthread_mutex_lock(&server_lock);
+  int ret = server >= 0 ? close(server) : 0;
+  server = -1;
+  pthread_mutex_unlock(&server_lock);
+  return ret;
+}
@@ -0,0 +1,576 @@
+#define _GNU_SOURCE // for accept4()
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "jumbo_file_system.h"
+#include "jfsd_protocol.h"
+
+#define DISK_FILENAME "DISK"
+#define MAX_EVENTS 64
+#define RECEIVE_SIZE (64 * 1024)     // bytes asked for by each read()
+#define READ_BUFFER_SIZE (64 * 1024) // room for any count a read can ask for
+
+// A connected client
+struct connection {
+  int fd;
+  struct jfsd_buffer in;  // bytes received and not yet handled
+  struct jfsd_buffer out; // responses not yet sent
+  size_t out_start;       // bytes of out already sent
+  uint32_t events;        // registered with epoll
+  int eof;                // the client will send no more requests
+  // directories the client has been given (the root and what jfs_chdir
+  // returned); requests made from any other directory are refused, and so
+  // are requests from one of these that is no longer a directory (see
+  // jfs_check_session), so a client cannot pass off a file or a free block
+  // as a directory
+  char dirs[NUM_BLOCKS];
+  struct connection* prev;
+  struct connection* next;
+};
+
+static struct connection* connections;
+static volatile sig_atomic_t stopping;
+
+
+static void stop(int signal) {
+  (void) signal;
+  stopping = 1;
+}
+
+
+// What walk_visit() collects: the entries walked, as JFSD_WALK results
+struct walk_results {
+  struct jfsd_buffer* out;
+  uint32_t count;
+};
+
+static int walk_visit(const struct jfs_walk_entry* entry, void* arg) {
+  struct walk_results* results = arg;
+  jfsd_put_data(results->out, entry->path, strlen(entry->path));
+  jfsd_put_u32(results->out, entry->depth);
+  jfsd_put_u32(results->out, entry->is_dir);
+  jfsd_put_u32(results->out, entry->block_num);
+  jfsd_put_u32(results->out, entry->num_data_blocks);
+  jfsd_put_u32(results->out, entry->file_size);
+  results->count++;
+  return 0;
+}
+
+
+/* serve_call
+ *   decodes the arguments of a request, makes the call and appends its
+ *   results to out
+ * returns the call's return code (E_UNKNOWN if the request is malformed)
+ */
+static int serve_call(struct connection* conn, const struct jfsd_request* request,
+                      struct jfsd_cursor* cursor, struct jfsd_buffer* out) {
+  static char buf[READ_BUFFER_SIZE];
+  char name[256], other[256];
+  struct jfs_session session = { request->dir };
+  int op = request->op;
+  if (op < JFSD_SET_DEDUP || JFSD_LISTDIR == op) {
+    if (request->dir >= NUM_BLOCKS || !conn->dirs[request->dir]) {
+      return E_UNKNOWN;
+    }
+    // another client may have removed it; this is the only thread making
+    // calls, so it cannot be removed between the check and the call
+    if (jfs_check_session(&session) != E_SUCCESS) {
+      return E_NOT_EXISTS;
+    }
+  }
+
+  int ret = E_UNKNOWN;
+  switch (op) {
+  case JFSD_MKDIR:
+  case JFSD_RMDIR:
+  case JFSD_REMOVE_TREE:
+  case JFSD_CREAT:
+  case JFSD_REMOVE: {
+    char* n = jfsd_get_name(cursor, name);
+    if (cursor->error) {
+      break;
+    }
+    switch (op) {
+    case JFSD_MKDIR:       ret = jfs_mkdir(&session, n); break;
+    case JFSD_RMDIR:       ret = jfs_rmdir(&session, n); break;
+    case JFSD_REMOVE_TREE: ret = jfs_remove_tree(&session, n); break;
+    case JFSD_CREAT:       ret = jfs_creat(&session, n); break;
+    case JFSD_REMOVE:      ret = jfs_remove(&session, n); break;
+    }
+    break;
+  }
+
+  case JFSD_CHDIR: {
+    char* n = jfsd_get_name(cursor, name);
+    if (cursor->error) {
+      break;
+    }
+    ret = jfs_chdir(&session, n);
+    if (E_SUCCESS == ret) {
+      conn->dirs[session.current_dir] = 1;
+      jfsd_put_u32(out, session.current_dir);
+    }
+    break;
+  }
+
+  case JFSD_LS: {
+    char* directories[MAX_DIR_ENTRIES+1];
+    char* files[MAX_DIR_ENTRIES+1];
+    ret = jfs_ls(&session, directories, files);
+    if (E_SUCCESS != ret) {
+      break;
+    }
+    for (int list = 0; list < 2; list++) {
+      char** names = list ? files : directories;
+      uint32_t count = 0;
+      while (names[count]) {
+        count++;
+      }
+      jfsd_put_u32(out, count);
+      for (uint32_t i = 0; i < count; i++) {
+        jfsd_put_name(out, names[i]);
+        free(names[i]);
+      }
+    }
+    break;
+  }
+
+  case JFSD_WALK: {
+    char* n = jfsd_get_name(cursor, name);
+    uint32_t flags = jfsd_get_u32(cursor);
+    if (cursor->error) {
+      break;
+    }
+    struct walk_results results = { out, 0 };
+    size_t count_at = out->length;
+    jfsd_put_u32(out, 0);
+    ret = jfs_walk(&session, n, flags, walk_visit, &results);
+    memcpy(out->data + count_at, &results.count, sizeof(results.count));
+    break;
+  }
+
+  case JFSD_STAT:
+  case JFSD_LISTDIR: {
+    char* n = jfsd_get_name(cursor, name);
+    if (cursor->error) {
+      break;
+    }
+    if (JFSD_STAT == op) {
+      struct stats stats;
+      ret = jfs_stat(&session, n, &stats);
+      jfsd_put(out, &stats, sizeof(stats));
+      break;
+    }
+    struct jfs_listing* listing;
+    ret = jfs_listdir(&session, n, &listing);
+    if (E_SUCCESS == ret) {
+      jfsd_put_u32(out, listing->num_entries);
+      jfsd_put(out, listing->entries, listing->num_entries * sizeof(struct stats));
+      jfs_free_listing(listing);
+    }
+    break;
+  }
+
+  case JFSD_WRITE:
+  case JFSD_PWRITE: {
+    char* n = jfsd_get_name(cursor, name);
+    uint32_t offset = JFSD_PWRITE == op ? jfsd_get_u32(cursor) : 0;
+    uint32_t count;
+    const char* data = jfsd_get_data(cursor, &count);
+    if (cursor->error || count > UINT16_MAX) {
+      break;
+    }
+    if (JFSD_WRITE == op) {
+      ret = jfs_write(&session, n, data, count);
+    } else {
+      ret = jfs_pwrite(&session, n, data, count, offset);
+    }
+    break;
+  }
+
+  case JFSD_FALLOCATE:
+  case JFSD_SET_COMPRESSION: {
+    char* n = jfsd_get_name(cursor, name);
+    uint32_t value = jfsd_get_u32(cursor);
+    if (cursor->error) {
+      break;
+    }
+    if (JFSD_FALLOCATE == op) {
+      ret = jfs_fallocate(&session, n, value);
+    } else {
+      ret = jfs_set_compression(&session, n, value);
+    }
+    break;
+  }
+
+  case JFSD_READ:
+  case JFSD_PREAD:
+  case JFSD_SEEK: {
+    char* n = jfsd_get_name(cursor, name);
+    uint32_t first = jfsd_get_u32(cursor);
+    uint32_t second = JFSD_READ != op ? jfsd_get_u32(cursor) : 0;
+    if (cursor->error || (JFSD_SEEK != op && first > UINT16_MAX)) {
+      break;
+    }
+    unsigned short count = first;
+    unsigned int result;
+    if (JFSD_SEEK == op) {
+      ret = jfs_seek(&session, n, first, second, &result);
+      jfsd_put_u32(out, result);
+      break;
+    }
+    if (JFSD_READ == op) {
+      ret = jfs_read(&session, n, buf, &count);
+    } else {
+      ret = jfs_pread(&session, n, buf, &count, second);
+    }
+    jfsd_put_data(out, buf, E_SUCCESS == ret ? count : 0);
+    break;
+  }
+
+  case JFSD_CLONE: {
+    char* src = jfsd_get_name(cursor, name);
+    char* dst = jfsd_get_name(cursor, other);
+    if (!cursor->error) {
+      ret = jfs_clone(&session, src, dst);
+    }
+    break;
+  }
+
+  case JFSD_BATCH: {
+    uint32_t num_ops = jfsd_get_u32(cursor);
+    if (cursor->error || num_ops > request->length) {
+      break;
+    }
+    struct jfs_op* ops = calloc(num_ops + 1, sizeof(struct jfs_op));
+    char (*names)[256] = malloc((num_ops + 1) * sizeof(*names));
+    for (uint32_t i = 0; i < num_ops && !cursor->error; i++) {
+      uint8_t batch_op;
+      uint32_t count;
+      jfsd_get(cursor, &batch_op, 1);
+      ops[i].op = batch_op;
+      ops[i].name = jfsd_get_name(cursor, names[i]);
+      ops[i].buf = jfsd_get_data(cursor, &count);
+      ops[i].count = count;
+      if (!ops[i].name || count > UINT16_MAX) {
+        cursor->error = 1;
+      }
+    }
+    if (!cursor->error) {
+      ret = jfs_batch(&session, ops, num_ops);
+      jfsd_put_u32(out, num_ops);
+      for (uint32_t i = 0; i < num_ops; i++) {
+        jfsd_put_u32(out, ops[i].result);
+      }
+    }
+    free(names);
+    free(ops);
+    break;
+  }
+
+  case JFSD_SET_DEDUP: {
+    uint32_t enabled = jfsd_get_u32(cursor);
+    if (!cursor->error) {
+      jfs_set_dedup(enabled);
+      ret = E_SUCCESS;
+    }
+    break;
+  }
+
+  case JFSD_SYNC:
+    ret = jfs_sync();
+    break;
+
+  case JFSD_DEFRAG: {
+    unsigned int moved;
+    ret = jfs_defrag(&moved);
+    jfsd_put_u32(out, moved);
+    break;
+  }
+
+  case JFSD_CACHE_STATS: {
+    struct jfs_cache_stats stats;
+    jfs_cache_stats(&stats);
+    jfsd_put(out, &stats, sizeof(stats));
+    ret = E_SUCCESS;
+    break;
+  }
+
+  case JFSD_FRAG_STATS: {
+    struct jfs_frag_stats stats;
+    ret = jfs_frag_stats(&stats);
+    jfsd_put(out, &stats, sizeof(stats));
+    break;
+  }
+
+  case JFSD_TRACE_START: {
+    uint32_t length;
+    const char* data = jfsd_get_data(cursor, &length);
+    if (cursor->error) {
+      break;
+    }
+    char* filename = strndup(data, length);
+    ret = filename ? jfs_trace_start(filename) : E_UNKNOWN;
+    free(filename);
+    break;
+  }
+
+  case JFSD_TRACE_STOP:
+    ret = jfs_trace_stop();
+    break;
+  }
+  return ret;
+}
+
+
+// handles one request, appending its response to the connection's output
+static void handle_request(struct connection* conn, const struct jfsd_request* request, const char* args) {
+  struct jfsd_cursor cursor = { args, args + request->length, 0 };
+  size_t header_at = conn->out.length;
+  struct jfsd_response response = { 0, request->id, 0 };
+  jfsd_put(&conn->out, &response, sizeof(response));
+
+  response.result = serve_call(conn, request, &cursor, &conn->out);
+  if (cursor.error) {
+    response.result = E_UNKNOWN;
+  }
+  int has_results = E_SUCCESS == response.result || JFSD_READ == request->op || JFSD_PREAD == request->op;
+  if (cursor.error || !has_results) {
+    conn->out.length = header_at + sizeof(response);
+  }
+  response.length = conn->out.length - header_at - sizeof(response);
+  memcpy(conn->out.data + header_at, &response, sizeof(response));
+}
+
+
+/* receive
+ *   reads what the client has sent, up to a little more than the longest
+ *   request (the rest is read once that has been handled)
+ * returns 0 on success or -1 if the connection failed
+ */
+static int receive(struct connection* conn) {
+  while (conn->in.length < sizeof(struct jfsd_request) + JFSD_MAX_MESSAGE) {
+    if (conn->in.capacity < conn->in.length + RECEIVE_SIZE) {
+      conn->in.capacity = conn->in.length + RECEIVE_SIZE;
+      conn->in.data = realloc(conn->in.data, conn->in.capacity);
+    }
+    ssize_t got = read(conn->fd, conn->in.data + conn->in.length, RECEIVE_SIZE);
+    if (got > 0) {
+      conn->in.length += got;
+    } else if (0 == got) {
+      conn->eof = 1;
+      break;
+    } else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+      break;
+    } else if (EINTR != errno) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* service
+ *   handles every whole request received (requests are pipelined: the
+ *   client need not wait for one response before sending the next), sends
+ *   what it can of the responses, and waits for more input or for room to
+ *   send the rest.  No more requests are handled while more than
+ *   JFSD_MAX_MESSAGE bytes of responses wait to be sent.
+ * returns 0, or -1 if the connection failed or is finished
+ */
+static int service(int epoll_fd, struct connection* conn) {
+  size_t start = 0;
+  while (conn->out.length - conn->out_start < JFSD_MAX_MESSAGE) {
+    struct jfsd_request request;
+    size_t available = conn->in.length - start;
+    if (available < sizeof(request)) {
+      break;
+    }
+    memcpy(&request, conn->in.data + start, sizeof(request));
+    if (request.length > JFSD_MAX_MESSAGE) {
+      return -1;
+    }
+    if (available < sizeof(request) + request.length) {
+      break;
+    }
+    handle_request(conn, &request, conn->in.data + start + sizeof(request));
+    start += sizeof(request) + request.length;
+  }
+  if (start) {
+    memmove(conn->in.data, conn->in.data + start, conn->in.length - start);
+    conn->in.length -= start;
+  }
+
+  while (conn->out_start < conn->out.length) {
+    ssize_t sent = send(conn->fd, conn->out.data + conn->out_start, conn->out.length - conn->out_start,
+                        MSG_NOSIGNAL);
+    if (sent >= 0) {
+      conn->out_start += sent;
+    } else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+      break;
+    } else if (EINTR != errno) {
+      return -1;
+    }
+  }
+  size_t pending = conn->out.length - conn->out_start;
+  if (!pending) {
+    conn->out.length = conn->out_start = 0;
+    if (conn->eof) {
+      return -1; // everything the client asked for has been answered
+    }
+  }
+
+  uint32_t events = (pending ? EPOLLOUT : 0) | (!conn->eof && pending < JFSD_MAX_MESSAGE ? EPOLLIN : 0);
+  if (events != conn->events) {
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+      return -1;
+    }
+    conn->events = events;
+  }
+  return 0;
+}
+
+
+static void accept_connections(int epoll_fd, int listen_fd) {
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno) {
+        perror("accept");
+      }
+      return;
+    }
+    struct connection* conn = calloc(1, sizeof(struct connection));
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    conn->dirs[1] = 1; // the root directory, from jfs_session_init()
+    struct epoll_event event = { .events = conn->events, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      perror("epoll_ctl");
+      close(fd);
+      free(conn);
+      continue;
+    }
+    conn->next = connections;
+    if (connections) {
+      connections->prev = conn;
+    }
+    connections = conn;
+  }
+}
+
+
+static void close_connection(struct connection* conn) {
+  close(conn->fd); // which also takes it out of the epoll set
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  free(conn->in.data);
+  free(conn->out.data);
+  free(conn);
+}
+
+
+/* main
+ *   Mounts a disk and serves the jfs_* calls of any number of local clients
+ *   (see jfs_client.c) over a Unix domain socket until it is interrupted,
+ *   then unmounts the disk.  One thread runs an epoll loop and makes the
+ *   calls, so the mount, its block cache and buffered appends stay warm
+ *   from one client to the next and every client sees the same disk.
+ */
+int main(int argc, char** argv) {
+  const char* socket_path = JFSD_SOCKET;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if ('s' == opt) {
+      socket_path = optarg;
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (optind < argc - 1 || optind > argc) {
+    fprintf(stderr, "usage: %s [-s socket] [disk_file]\n", argv[0]);
+    return 1;
+  }
+  const char* disk = optind < argc ? argv[optind] : DISK_FILENAME;
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", socket_path);
+    return 1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    return 1;
+  }
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(socket_path);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) < 0
+      || listen(listen_fd, SOMAXCONN) < 0) {
+    perror(socket_path);
+    jfs_unmount();
+    return 1;
+  }
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+    perror("epoll");
+    jfs_unmount();
+    return 1;
+  }
+  fprintf(stderr, "jfsd: serving %s on %s\n", disk, socket_path);
+
+  struct epoll_event events[MAX_EVENTS];
+  while (!stopping) {
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (count < 0 && EINTR != errno) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      struct connection* conn = events[i].data.ptr;
+      if (!conn) {
+        accept_connections(epoll_fd, listen_fd);
+        continue;
+      }
+      int failed = 0;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        failed = receive(conn) < 0;
+      }
+      if (failed || service(epoll_fd, conn) < 0) {
+        close_connection(conn);
+      }
+    }
+  }
+
+  while (connections) {
+    close_connection(connections);
+  }
+  close(epoll_fd);
+  close(listen_fd);
+  unlink(socket_path);
+  return jfs_unmount() < 0;
+}
@@ -0,0 +1,81 @@
+#include "jfsd_protocol.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NULL_NAME 0xff // length byte of a NULL name
+
+
+void jfsd_put(struct jfsd_buffer* buffer, const void* bytes, size_t count) {
+  if (!count) {
+    return;
+  }
+  if (buffer->length + count > buffer->capacity) {
+    buffer->capacity = (buffer->length + count) * 2 + 64;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+  }
+  memcpy(buffer->data + buffer->length, bytes, count);
+  buffer->length += count;
+}
+
+
+void jfsd_put_u32(struct jfsd_buffer* buffer, uint32_t value) {
+  jfsd_put(buffer, &value, sizeof(value));
+}
+
+
+void jfsd_put_name(struct jfsd_buffer* buffer, const char* name) {
+  uint8_t length = name ? strnlen(name, NULL_NAME - 1) : NULL_NAME;
+  jfsd_put(buffer, &length, 1);
+  if (name) {
+    jfsd_put(buffer, name, length);
+  }
+}
+
+
+void jfsd_put_data(struct jfsd_buffer* buffer, const void* data, uint32_t count) {
+  jfsd_put_u32(buffer, count);
+  jfsd_put(buffer, data, count);
+}
+
+
+void jfsd_get(struct jfsd_cursor* cursor, void* bytes, size_t count) {
+  if (cursor->error || (size_t) (cursor->end - cursor->next) < count) {
+    cursor->error = 1;
+    memset(bytes, 0, count);
+    return;
+  }
+  memcpy(bytes, cursor->next, count);
+  cursor->next += count;
+}
+
+
+uint32_t jfsd_get_u32(struct jfsd_cursor* cursor) {
+  uint32_t value;
+  jfsd_get(cursor, &value, sizeof(value));
+  return value;
+}
+
+
+char* jfsd_get_name(struct jfsd_cursor* cursor, char* name) {
+  uint8_t length;
+  jfsd_get(cursor, &length, 1);
+  if (cursor->error || NULL_NAME == length) {
+    return NULL;
+  }
+  jfsd_get(cursor, name, length);
+  name[length] = '\0';
+  return cursor->error ? NULL : name;
+}
+
+
+const char* jfsd_get_data(struct jfsd_cursor* cursor, uint32_t* count) {
+  *count = jfsd_get_u32(cursor);
+  if (cursor->error || (size_t) (cursor->end - cursor->next) < *count) {
+    cursor->error = 1;
+    *count = 0;
+    return NULL;
+  }
+  const char* data = cursor->next;
+  cursor->next += *count;
+  return data;
+}
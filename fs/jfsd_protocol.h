@@ -0,0 +1,100 @@
+#ifndef _JFSD_PROTOCOL_H_
+#define _JFSD_PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "raw_disk.h"
+
+// The protocol spoken over the Unix domain socket of jfsd.  A client sends
+// requests, each a struct jfsd_request followed by length bytes of
+// arguments, and may send any number of them before reading the responses,
+// which come back in the same order: each a struct jfsd_response followed by
+// length bytes of results.  Both ends run on the same machine, so integers
+// and the structs of jumbo_file_system.h are sent as they are in memory.
+#define JFSD_SOCKET "jfsd.sock"
+#define JFSD_MAX_MESSAGE (1 << 20) // longest arguments or results a peer accepts
+
+struct jfsd_request {
+  uint32_t length;  // bytes of arguments following the header
+  uint32_t id;      // chosen by the client and echoed in the response
+  block_num_t dir;  // the caller's current directory (see struct jfs_session)
+  uint8_t op;       // one of the JFSD_* codes below
+  uint8_t reserved; // 0
+};
+
+struct jfsd_response {
+  uint32_t length; // bytes of results following the header
+  uint32_t id;     // of the request
+  int32_t result;  // the call's return code
+};
+
+// The calls, numbered as the TRACE_* codes where there is one, with their
+// arguments (encoded as in trace.h) and results.  A call that fails has no
+// results, except that a read that fails still returns its (empty) data.
+#define JFSD_MKDIR            1  // s directory_name
+#define JFSD_CHDIR            2  // s directory_name -> u the new current directory
+#define JFSD_LS               3  // -> u count, then that many s, for the directories and then the files
+#define JFSD_RMDIR            4  // s directory_name
+#define JFSD_WALK             5  // s directory_name, u flags -> u count, then for each entry
+                                 //    d path, u depth, u is_dir, u block_num, u num_data_blocks, u file_size
+#define JFSD_REMOVE_TREE      6  // s name
+#define JFSD_CREAT            7  // s file_name
+#define JFSD_REMOVE           8  // s file_name
+#define JFSD_STAT             9  // s name -> struct stats
+#define JFSD_WRITE            10 // s file_name, d buf
+#define JFSD_PWRITE           11 // s file_name, u offset, d buf
+#define JFSD_FALLOCATE        12 // s file_name, u length
+#define JFSD_READ             13 // s file_name, u count -> d buf
+#define JFSD_PREAD            14 // s file_name, u count, u offset -> d buf
+#define JFSD_SEEK             15 // s file_name, u offset, u whence -> u result
+#define JFSD_CLONE            16 // s src_name, s dst_name
+#define JFSD_SET_COMPRESSION  17 // s file_name, u enabled
+#define JFSD_BATCH            18 // b ops -> u count, then each op's result as a u
+#define JFSD_SET_DEDUP        19 // u enabled
+#define JFSD_SYNC             20 //
+#define JFSD_LISTDIR          21 // s directory_name -> u num_entries, then that many struct stats
+#define JFSD_DEFRAG           22 // -> u blocks_moved
+#define JFSD_CACHE_STATS      23 // -> struct jfs_cache_stats
+#define JFSD_FRAG_STATS       24 // -> struct jfs_frag_stats
+#define JFSD_TRACE_START      25 // d filename (on the server's side)
+#define JFSD_TRACE_STOP       26 //
+
+// A message being built, grown with realloc() as needed
+struct jfsd_buffer {
+  char* data;
+  size_t length, capacity;
+};
+
+// Reads the arguments or results of a message, in order; error is set once
+// anything is read past the end
+struct jfsd_cursor {
+  const char* next;
+  const char* end;
+  int error;
+};
+
+void jfsd_put(struct jfsd_buffer* buffer, const void* bytes, size_t count);
+void jfsd_put_u32(struct jfsd_buffer* buffer, uint32_t value);
+void jfsd_put_name(struct jfsd_buffer* buffer, const char* name);
+void jfsd_put_data(struct jfsd_buffer* buffer, const void* data, uint32_t count);
+
+/* jfsd_get
+ *   copies the next count bytes of a message into bytes (or zeros if the
+ *   message is too short)
+ */
+void jfsd_get(struct jfsd_cursor* cursor, void* bytes, size_t count);
+uint32_t jfsd_get_u32(struct jfsd_cursor* cursor);
+
+/* jfsd_get_name
+ *   decodes an s argument into name, which must have room for 256 bytes
+ * returns name, or NULL if the argument is NULL (or missing)
+ */
+char* jfsd_get_name(struct jfsd_cursor* cursor, char* name);
+
+/* jfsd_get_data
+ *   decodes a d argument
+ * returns a pointer to its bytes in the message, with their number in count
+ */
+const char* jfsd_get_data(struct jfsd_cursor* cursor, uint32_t* count);
+
+#endif // _JFSD_PROTOCOL_H_
@@ -0,0 +1,399 @@
+#include "journal.h"
+#include <pthread.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC 0x4a464a4c // "JFJL"
+#define DESCRIPTOR_MAGIC 0x4a464452 // "JFDR"
+
+// first block of the log (right after the journal header)
+#define LOG_START (JOURNAL_START + 1)
+
+
+// The journal header, stored in block JOURNAL_START
+struct journal_header {
+  uint32_t magic;
+  uint32_t sequence; // sequence number of the first valid record in the log
+};
+
+// The first block of every log record; it is followed by count blocks of data
+struct journal_descriptor {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t checksum; // covers the block numbers and the data blocks
+  uint16_t count;
+  block_num_t blocks[JOURNAL_RECORD_BLOCKS];
+};
+
+// One journaled version of a block
+struct journal_entry {
+  block_num_t block_num;
+  char data[BLOCK_SIZE];
+};
+
+_Static_assert(JOURNAL_MAX_TXN_BLOCKS <= JOURNAL_RECORD_BLOCKS,
+               "a transaction must fit in one log record to commit atomically");
+
+// blocks written by the calling thread's transaction in progress
+static _Thread_local struct journal_entry txn[JOURNAL_MAX_TXN_BLOCKS];
+static _Thread_local int txn_count;
+static _Thread_local int txn_depth;
+static _Thread_local int txn_failed; // a write of it failed; it will not commit
+
+// protects everything below; transactions in progress are per thread
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// committed transactions that have not been written to the log yet
+static struct journal_entry pending[JOURNAL_RECORD_BLOCKS];
+static int pending_count;
+
+// blocks in the log that have not been written back to their home location
+static struct journal_entry logged[JOURNAL_BLOCKS];
+static int logged_count;
+
+// blocks released since the last flush, by records that are not in the log yet
+static unsigned char released[NUM_BLOCKS / 8];
+
+static block_num_t log_tail; // next free block of the log
+static uint32_t sequence;    // sequence number of the next record
+
+
+// FNV-1a hash, used as the record checksum
+static uint32_t checksum(uint32_t hash, const void* buf, int len) {
+  const unsigned char* bytes = buf;
+  for (int i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t record_checksum(const struct journal_descriptor* desc, const char* data) {
+  uint32_t hash = checksum(2166136261u, desc->blocks, desc->count * sizeof(block_num_t));
+  return checksum(hash, data, desc->count * BLOCK_SIZE);
+}
+
+// finds block_num in a list of entries; returns its index or -1
+static int find_entry(struct journal_entry* entries, int count, block_num_t block_num) {
+  for (int i = 0; i < count; i++) {
+    if (entries[i].block_num == block_num) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// adds (or replaces) a version of a block in a list of entries
+static void put_entry(struct journal_entry* entries, int* count, block_num_t block_num, const void* buf) {
+  int i = find_entry(entries, *count, block_num);
+  if (i < 0) {
+    i = (*count)++;
+    entries[i].block_num = block_num;
+  }
+  memcpy(entries[i].data, buf, BLOCK_SIZE);
+}
+
+// removes a block from a list of entries, if it is there
+static void drop_entry(struct journal_entry* entries, int* count, block_num_t block_num) {
+  int i = find_entry(entries, *count, block_num);
+  if (i >= 0) {
+    entries[i] = entries[--(*count)];
+  }
+}
+
+static int write_header() {
+  char block[BLOCK_SIZE];
+  memset(block, 0, BLOCK_SIZE);
+  struct journal_header* header = (struct journal_header*) block;
+  header->magic = JOURNAL_MAGIC;
+  header->sequence = sequence;
+  return write_block(JOURNAL_START, block);
+}
+
+// writes every logged block back to its home location and empties the log
+static int write_back() {
+  for (int i = 0; i < logged_count; i++) {
+    if (write_block(logged[i].block_num, logged[i].data) < 0) {
+      return -1;
+    }
+  }
+  logged_count = 0;
+
+  if (log_tail != LOG_START) {
+    // the home blocks must be durable before the log forgets them; the new
+    // header sequence number invalidates every record already in the log
+    if (raw_sync() < 0) {
+      return -1;
+    }
+    log_tail = LOG_START;
+    return write_header();
+  }
+  return 0;
+}
+
+static int flush_locked();
+
+// moves the blocks of the current transaction into the pending group,
+// flushing the group to the log first if they would not fit in one record;
+// a failed transaction, or one the group has no room for, is dropped
+static int commit_txn() {
+  int ret = txn_failed ? -1 : 0;
+  pthread_mutex_lock(&journal_lock);
+  if (ret == 0 && pending_count + txn_count > (int) JOURNAL_RECORD_BLOCKS) {
+    ret = flush_locked();
+  }
+  if (ret == 0) {
+    for (int i = 0; i < txn_count; i++) {
+      put_entry(pending, &pending_count, txn[i].block_num, txn[i].data);
+    }
+  }
+  pthread_mutex_unlock(&journal_lock);
+  txn_count = 0;
+  txn_failed = 0;
+  return ret;
+}
+
+
+int journal_open() {
+  struct journal_header header;
+  char block[BLOCK_SIZE];
+  if (read_block(JOURNAL_START, block) < 0) {
+    return -1;
+  }
+  memcpy(&header, block, sizeof(header));
+
+  txn_count = txn_depth = txn_failed = pending_count = logged_count = 0;
+  memset(released, 0, sizeof(released));
+  log_tail = LOG_START;
+
+  if (header.magic != JOURNAL_MAGIC) {
+    // fresh disk; start an empty log
+    sequence = 1;
+    return write_header();
+  }
+
+  // replay every complete record, in order, until the first invalid one
+  sequence = header.sequence;
+  int replayed = 0;
+  char data[JOURNAL_RECORD_BLOCKS * BLOCK_SIZE];
+  while (log_tail < NUM_BLOCKS) {
+    struct journal_descriptor desc;
+    if (read_block(log_tail, block) < 0) {
+      return -1;
+    }
+    memcpy(&desc, block, sizeof(desc));
+    if (desc.magic != DESCRIPTOR_MAGIC || desc.sequence != sequence
+        || desc.count == 0 || desc.count > JOURNAL_RECORD_BLOCKS
+        || log_tail + 1 + desc.count > NUM_BLOCKS) {
+      break;
+    }
+    if (read_blocks(log_tail + 1, data, desc.count) < 0) {
+      return -1;
+    }
+    if (record_checksum(&desc, data) != desc.checksum) {
+      break; // torn write; the record was never committed
+    }
+    for (int i = 0; i < desc.count; i++) {
+      if (write_block(desc.blocks[i], data + i * BLOCK_SIZE) < 0) {
+        return -1;
+      }
+    }
+    log_tail += 1 + desc.count;
+    sequence++;
+    replayed = 1;
+  }
+
+  // the replayed blocks are home now, so the log can start over
+  log_tail = LOG_START;
+  if (replayed && raw_sync() < 0) {
+    return -1;
+  }
+  return write_header();
+}
+
+
+void journal_begin() {
+  txn_depth++;
+}
+
+
+int journal_end() {
+  if (txn_depth > 0 && --txn_depth > 0) {
+    return txn_failed ? -1 : 0; // nested; the outer transaction commits
+  }
+  return commit_txn();
+}
+
+
+int journal_read_block(block_num_t block_num, void* buf) {
+  // newest version first: this transaction, then committed, then logged
+  int i;
+  if ((i = find_entry(txn, txn_count, block_num)) >= 0) {
+    memcpy(buf, txn[i].data, BLOCK_SIZE);
+    return 0;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  int found = 1;
+  if ((i = find_entry(pending, pending_count, block_num)) >= 0) {
+    memcpy(buf, pending[i].data, BLOCK_SIZE);
+  } else if ((i = find_entry(logged, logged_count, block_num)) >= 0) {
+    memcpy(buf, logged[i].data, BLOCK_SIZE);
+  } else {
+    found = 0;
+  }
+  pthread_mutex_unlock(&journal_lock);
+
+  // the home block is current; nobody can journal a new version of it
+  // while the caller holds the lock on whatever it stores
+  return found ? 0 : read_block(block_num, buf);
+}
+
+
+int journal_write_block(block_num_t block_num, void* buf) {
+  journal_begin();
+  if (find_entry(txn, txn_count, block_num) < 0 && txn_count == JOURNAL_MAX_TXN_BLOCKS) {
+    txn_failed = 1; // too big to commit atomically
+  }
+  if (!txn_failed) {
+    put_entry(txn, &txn_count, block_num, buf);
+  }
+  int ret = txn_failed ? -1 : 0;
+  if (journal_end() < 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+
+int journal_write_shared(block_num_t block_num, void* buf) {
+  pthread_mutex_lock(&journal_lock);
+  int ret = 0;
+  if (find_entry(pending, pending_count, block_num) < 0
+      && pending_count == (int) JOURNAL_RECORD_BLOCKS) {
+    ret = flush_locked();
+  }
+  if (ret == 0) {
+    put_entry(pending, &pending_count, block_num, buf);
+  }
+  pthread_mutex_unlock(&journal_lock);
+  return ret;
+}
+
+
+void journal_release_block(block_num_t block_num) {
+  pthread_mutex_lock(&journal_lock);
+  released[block_num / 8] |= 1 << (block_num % 8);
+  pthread_mutex_unlock(&journal_lock);
+}
+
+
+int journal_write_data(block_num_t block_num, void* buf) {
+  return journal_write_data_blocks(block_num, buf, 1);
+}
+
+
+int journal_write_data_blocks(block_num_t first_block, void* buf, int count) {
+  // a block that used to hold metadata may still have journaled versions;
+  // those must never be replayed or checkpointed over the new data.  And
+  // a block released by a record that is not in the log yet is still in use
+  // on disk: a crash before that record is written would bring it back
+  int stale = 0, unlogged = 0;
+  pthread_mutex_lock(&journal_lock);
+  for (block_num_t block_num = first_block; block_num < first_block + count; block_num++) {
+    drop_entry(txn, &txn_count, block_num);
+    if (find_entry(pending, pending_count, block_num) >= 0
+        || find_entry(logged, logged_count, block_num) >= 0) {
+      stale = 1;
+    }
+    if (released[block_num / 8] & (1 << (block_num % 8))) {
+      unlogged = 1;
+    }
+  }
+  int ret = 0;
+  if (stale || unlogged) {
+    ret = flush_locked();
+  }
+  if (stale && ret == 0) {
+    ret = write_back();
+  }
+  pthread_mutex_unlock(&journal_lock);
+  if (ret < 0) {
+    return -1;
+  }
+  return write_blocks(first_block, buf, count);
+}
+
+
+int journal_flush() {
+  pthread_mutex_lock(&journal_lock);
+  int ret = flush_locked();
+  pthread_mutex_unlock(&journal_lock);
+  return ret;
+}
+
+
+// journal_flush() with the journal lock held
+static int flush_locked() {
+  if (pending_count == 0) {
+    memset(released, 0, sizeof(released)); // every release is in the log
+    return 0;
+  }
+  if (log_tail + 1 + pending_count > NUM_BLOCKS) {
+    // the log is full; write everything home and start it over
+    if (write_back() < 0) {
+      return -1;
+    }
+  }
+
+  // build the whole record and write it with one sequential write
+  char record[(1 + JOURNAL_RECORD_BLOCKS) * BLOCK_SIZE];
+  struct journal_descriptor desc;
+  memset(&desc, 0, sizeof(desc));
+  desc.magic = DESCRIPTOR_MAGIC;
+  desc.sequence = sequence;
+  desc.count = pending_count;
+  for (int i = 0; i < pending_count; i++) {
+    desc.blocks[i] = pending[i].block_num;
+    memcpy(record + (1 + i) * BLOCK_SIZE, pending[i].data, BLOCK_SIZE);
+  }
+  desc.checksum = record_checksum(&desc, record + BLOCK_SIZE);
+  memset(record, 0, BLOCK_SIZE);
+  memcpy(record, &desc, sizeof(desc));
+
+  if (write_blocks(log_tail, record, 1 + pending_count) < 0 || raw_sync() < 0) {
+    return -1;
+  }
+  log_tail += 1 + pending_count;
+  sequence++;
+
+  for (int i = 0; i < pending_count; i++) {
+    put_entry(logged, &logged_count, pending[i].block_num, pending[i].data);
+  }
+  pending_count = 0;
+  memset(released, 0, sizeof(released));
+  return 0;
+}
+
+
+int journal_checkpoint() {
+  pthread_mutex_lock(&journal_lock);
+  int ret = flush_locked();
+  if (ret == 0) {
+    ret = write_back();
+  }
+  pthread_mutex_unlock(&journal_lock);
+  return ret;
+}
+
+
+int journal_close() {
+  int ret = 0;
+  if (txn_count > 0 || txn_failed) {
+    ret = commit_txn();
+  }
+  txn_depth = 0;
+  if (journal_checkpoint() < 0) {
+    return -1;
+  }
+  return raw_sync() < 0 ? -1 : ret;
+}
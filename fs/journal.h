@@ -0,0 +1,118 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "raw_disk.h"
+
+// the journal occupies the last JOURNAL_BLOCKS blocks of the disk; the first
+// of them is the journal header and the rest hold the log records
+#define JOURNAL_BLOCKS 32
+#define JOURNAL_START (NUM_BLOCKS - JOURNAL_BLOCKS)
+
+// maximum number of blocks a single log record (one group commit) can hold
+#define JOURNAL_RECORD_BLOCKS ((BLOCK_SIZE - 3 * sizeof(uint32_t) - sizeof(uint16_t)) / sizeof(block_num_t))
+
+// maximum number of distinct blocks a single transaction may dirty, more than
+// any jfs_* call needs (jfs_batch() writes the most: MAX_DIR_ENTRIES + 1); a
+// transaction that would grow past this fails as a whole
+#define JOURNAL_MAX_TXN_BLOCKS 16
+
+
+/* journal_open
+ *   prepares the journal on a freshly mounted raw disk and replays every
+ *   complete record left in the log by an earlier crash, so that the disk is
+ *   consistent before anything else reads it
+ * returns 0 on success or -1 on failure
+ */
+int journal_open();
+
+/* journal_begin
+ *   starts a transaction; every block written with journal_write_block()
+ *   until the matching journal_end() is committed atomically.  Transactions
+ *   may be nested, in which case only the outermost journal_end() commits.
+ *   Each thread has its own transaction; callers must make sure no two
+ *   transactions in progress write the same block.
+ */
+void journal_begin();
+
+/* journal_end
+ *   commits the current transaction.  Committed transactions are batched in
+ *   memory and written to the log together as one sequential record once
+ *   enough of them have accumulated (or by journal_flush()).
+ * returns 0 on success or -1 on failure, in which case nothing the
+ * transaction wrote is committed
+ */
+int journal_end();
+
+/* journal_read_block
+ *   reads a metadata block, returning the newest version of it even if that
+ *   version has only been journaled and not yet written back to its home
+ *   location
+ * returns 0 on success or -1 on failure
+ */
+int journal_read_block(block_num_t block_num, void* buf);
+
+/* journal_write_block
+ *   writes a metadata block as part of the current transaction (a write
+ *   outside of any transaction is committed on its own)
+ * returns 0 on success or -1 on failure; once a write fails (the transaction
+ * would dirty more than JOURNAL_MAX_TXN_BLOCKS blocks) the whole transaction
+ * fails, and journal_end() discards it
+ */
+int journal_write_block(block_num_t block_num, void* buf);
+
+/* journal_write_shared
+ *   writes a metadata block that many transactions update concurrently
+ *   (such as the allocation bitmap) straight into the next group commit,
+ *   outside of any transaction; the caller must serialize writes of the
+ *   block and must write it only with changes that are safe to commit ahead
+ *   of the transactions that caused them
+ * returns 0 on success or -1 on failure
+ */
+int journal_write_shared(block_num_t block_num, void* buf);
+
+/* journal_release_block
+ *   records that a block has just been freed by a committed transaction
+ *   whose record may still be only in memory; until that record is in the
+ *   log, a crash would bring back whatever pointed at the block, so the
+ *   block is not written in place before then.  Call this before the block
+ *   can be allocated again.
+ */
+void journal_release_block(block_num_t block_num);
+
+/* journal_write_data
+ *   writes a data block directly to its home location (data is not
+ *   journaled), first making sure no older journaled metadata version of the
+ *   same block can later be written over it, and that the block's release
+ *   (if it was freed since the last flush) is in the log
+ * returns 0 on success or -1 on failure
+ */
+int journal_write_data(block_num_t block_num, void* buf);
+
+/* journal_write_data_blocks
+ *   journal_write_data() for count consecutive blocks, written with a single
+ *   write_blocks() call
+ * returns 0 on success or -1 on failure
+ */
+int journal_write_data_blocks(block_num_t first_block, void* buf, int count);
+
+/* journal_flush
+ *   writes all committed transactions that are still only in memory to the
+ *   log and waits for them to reach stable storage
+ * returns 0 on success or -1 on failure
+ */
+int journal_flush();
+
+/* journal_checkpoint
+ *   flushes the journal, writes every journaled block back to its home
+ *   location and empties the log
+ * returns 0 on success or -1 on failure
+ */
+int journal_checkpoint();
+
+/* journal_close
+ *   checkpoints the journal; call this before unmounting the raw disk
+ * returns 0 on success or -1 on failure
+ */
+int journal_close();
+
+#endif // _JOURNAL_H_
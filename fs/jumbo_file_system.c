@@ -1,15 +1,64 @@
 #include "jumbo_file_system.h"
+#include "journal.h"
+#include "compress.h"
+#include "trace.h"
 #include "string.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-static block_num_t current_dir;
+// offset passed to write_in_dir() for appends
+#define END_OF_FILE ((unsigned int) -1)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// number of blocks in use or promised to an operation in progress
 static unsigned int allocated_blocks;
+static pthread_mutex_t allocated_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one reader/writer lock per block, protecting the directory or inode stored
+// there; a directory is always locked before any of its entries
+static pthread_rwlock_t block_locks[NUM_BLOCKS];
+
+static void lock_read(block_num_t block_num) {
+    pthread_rwlock_rdlock(&block_locks[block_num]);
+}
+
+static void lock_write(block_num_t block_num) {
+    pthread_rwlock_wrlock(&block_locks[block_num]);
+}
+
+static void unlock(block_num_t block_num) {
+    pthread_rwlock_unlock(&block_locks[block_num]);
+}
+
+/* reserve_blocks
+ *   promises up to count blocks to the caller, who may then allocate that
+ *   many without checking for a full disk; if fewer are free, all that are
+ *   left are reserved only if partial is set
+ * returns the number of blocks reserved
+ */
+static unsigned int reserve_blocks(unsigned int count, int partial) {
+    pthread_mutex_lock(&allocated_lock);
+    if (allocated_blocks + count > NUM_BLOCKS) {
+        count = partial ? NUM_BLOCKS - allocated_blocks : 0;
+    }
+    allocated_blocks += count;
+    pthread_mutex_unlock(&allocated_lock);
+    return count;
+}
+
+// gives back blocks that were reserved but not used, or that were released
+static void unreserve_blocks(unsigned int count) {
+    pthread_mutex_lock(&allocated_lock);
+    allocated_blocks -= count;
+    pthread_mutex_unlock(&allocated_lock);
+}
 
 static int is_dir(block_num_t block_num) {
     struct block block;
-    read_block(block_num, &block);
+    journal_read_block(block_num, &block);
     return block.is_dir == 0;
 }
 
@@ -17,6 +66,8 @@ static struct block create_directory_block(block_num_t block_num, block_num_t pr
     struct block block;
     block.is_dir = (uint32_t)0;
     block.contents.dirnode.num_entries = 0;
+    block.contents.dirnode.magic = 0;
+    block.contents.dirnode.version = 0;
     // char back[3] = "..";
     // char here[2] = ".";
     // strcpy(block.contents.dirnode.entries[1].name, back);
@@ -30,513 +81,2998 @@ static struct block create_inode_block() {
     struct block block;
     block.is_dir = (uint32_t)1;
     block.contents.inode.file_size = 0;
+    block.contents.inode.flags = INODE_INLINE; // new files start out inline
     return block;
 }
 
+// number of data blocks needed to hold size bytes
+static unsigned int blocks_for_size(unsigned int size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
 
-/* jfs_mount
- *   prepares the DISK file on the _real_ file system to have file system
- *   blocks read and written to it.  The application _must_ call this function
- *   exactly once before calling any other jfs_* functions.  If your code
- *   requires any additional one-time initialization before any other jfs_*
- *   functions are called, you can add it here.
- * filename - the name of the DISK file on the _real_ file system
- * returns 0 on success or -1 on error; errors should only occur due to
- *   errors in the underlying disk syscalls.
- */
-int jfs_mount(const char* filename) {
-    int ret = bfs_mount(filename);
-    current_dir = 1; // root directory
-    if (ret != 0) return ret;
-
-    // write root directory to block 1
-    struct block root = create_directory_block(1, 1);
-    ret = write_block(1, &root);
+// number of data blocks used by an inode (inline files use none); never more
+// than data_blocks holds, even if the inode's size is bad
+static unsigned int inode_num_blocks(const struct block* inode) {
+    if (inode->contents.inode.flags & INODE_INLINE) {
+        return 0;
+    }
+    return MIN(blocks_for_size(inode->contents.inode.file_size), MAX_DATA_BLOCKS);
+}
 
-    allocated_blocks = 2; // root and superblock
-    return ret;
+// number of data blocks held by an inode: the ones it uses followed by any
+// preallocated by jfs_fallocate() (the rest of data_blocks is 0)
+static unsigned int inode_num_entries(const struct block* inode) {
+    if (inode->contents.inode.flags & INODE_INLINE) {
+        return 0;
+    }
+    unsigned int num_blocks = inode_num_blocks(inode);
+    while (num_blocks < MAX_DATA_BLOCKS && inode->contents.inode.data_blocks[num_blocks]) {
+        num_blocks++;
+    }
+    return num_blocks;
 }
 
+// number of data blocks holding an inode's data once buffered more bytes
+// are appended; holes and preallocated blocks do not count
+static unsigned int inode_allocated_blocks(const struct block* inode, unsigned int buffered) {
+    unsigned int size = inode->contents.inode.file_size;
+    unsigned int total = MIN(blocks_for_size(size + buffered), MAX_DATA_BLOCKS);
+    if (inode->contents.inode.flags & INODE_INLINE) {
+        return size + buffered <= INLINE_DATA_SIZE ? 0 : total;
+    }
+    unsigned int num_blocks = inode_num_blocks(inode);
+    unsigned int allocated = total - num_blocks;
+    for (unsigned int i = 0; i < num_blocks; i++) {
+        allocated += inode->contents.inode.data_blocks[i] != 0;
+    }
+    return allocated;
+}
 
-/* jfs_mkdir
- *   creates a new subdirectory in the current directory
- * directory_name - name of the new subdirectory
- * returns 0 on success or one of the following error codes on failure:
- *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
- */
-int jfs_mkdir(const char* directory_name) {
+// finds name in a directory block; returns the entry index or -1
+static int dir_find(const struct block* dir, const char* name) {
+    for (int i = 0; i < dir->contents.dirnode.num_entries; i++) {
+        if (strcmp(dir->contents.dirnode.entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    if (strlen(directory_name) > MAX_NAME_LENGTH) {
+// checks that a new entry called name can be added to a directory block
+static int dir_can_add(const struct block* dir, const char* name) {
+    if (strlen(name) > MAX_NAME_LENGTH) {
         return E_MAX_NAME_LENGTH;
     }
+    if (dir->contents.dirnode.num_entries == MAX_DIR_ENTRIES) {
+        return E_MAX_DIR_ENTRIES;
+    }
+    if (dir_find(dir, name) >= 0) {
+        return E_EXISTS;
+    }
+    return E_SUCCESS;
+}
 
-    if (allocated_blocks + 1 > NUM_BLOCKS) {
-        return E_DISK_FULL;
+// Blocks allocated ahead of time by jfs_batch(), handed out in order
+struct block_pool {
+    block_num_t blocks[NUM_BLOCKS];
+    unsigned int count; // number of blocks in the pool
+    unsigned int next;  // index of the next block to hand out
+};
+
+// takes a new block from the pool, or from the allocator if pool is NULL
+// (in which case the caller must have reserved it)
+static block_num_t take_block(struct block_pool* pool) {
+    if (pool) {
+        return pool->blocks[pool->next++];
     }
+    return allocate_block();
+}
 
-    struct block cur;
-    read_block(current_dir, &cur);
+/* append_data
+ *   appends count bytes to the data blocks of a (non-inline) inode, filling
+ *   the last partial block first and taking new blocks as needed; the
+ *   caller must have checked that enough free blocks remain and is
+ *   responsible for writing the inode back to disk
+ * replaced - if not NULL, the last partial block is shared with another file
+ *   and must be copied to a new block before it is filled; the number of the
+ *   old block, which the caller must release after committing, is stored here
+ */
+static void append_data(struct block* inode, const char* buf, unsigned int count,
+                        struct block_pool* pool, block_num_t* replaced) {
+    char block[BLOCK_SIZE];
+    while (count > 0) {
+        unsigned int size = inode->contents.inode.file_size;
+        unsigned int index = size / BLOCK_SIZE;
+        unsigned int offset = size % BLOCK_SIZE;
+        unsigned int to_copy = BLOCK_SIZE - offset;
+        if (to_copy > count) {
+            to_copy = count;
+        }
 
-    if (cur.contents.dirnode.num_entries == MAX_DIR_ENTRIES) {
-        return E_MAX_DIR_ENTRIES;
+        block_num_t block_num;
+        if (offset) { // fill the last partial block
+            block_num = inode->contents.inode.data_blocks[index];
+            read_block(block_num, block);
+            if (replaced) { // copy on write
+                *replaced = block_num;
+                replaced = NULL;
+                block_num = take_block(pool);
+                inode->contents.inode.data_blocks[index] = block_num;
+            }
+        }
+        else { // start a new (or preallocated) block
+            block_num = inode->contents.inode.data_blocks[index];
+            if (!block_num) {
+                block_num = take_block(pool);
+                inode->contents.inode.data_blocks[index] = block_num;
+            }
+            memset(block, 0, BLOCK_SIZE);
+        }
+        memcpy(block + offset, buf, to_copy);
+        journal_write_data(block_num, block);
+
+        inode->contents.inode.file_size += to_copy;
+        buf += to_copy;
+        count -= to_copy;
     }
+}
 
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (!strcmp(directory_name, cur.contents.dirnode.entries[i].name)) {
-            return E_EXISTS;
-        }
+/* append_to_inode
+ *   appends count bytes to the file whose inode is given, keeping the data
+ *   inline while it fits and spilling it to data blocks otherwise; the caller
+ *   is responsible for writing the inode back to disk
+ * replaced - set to the block the file stopped using because it was shared
+ *   and had to be copied (the caller must release it after committing), or
+ *   to 0 if there is none
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_MAX_FILE_SIZE, E_DISK_FULL
+ */
+static int append_to_inode(struct block* inode, const char* buf, unsigned int count,
+                           struct block_pool* pool, block_num_t* replaced) {
+    *replaced = 0;
+    unsigned int new_size = inode->contents.inode.file_size + count;
+    if (new_size > MAX_FILE_SIZE) {
+        return E_MAX_FILE_SIZE;
     }
 
-    // create new directory block
-    block_num_t block_num = allocate_block();
-    allocated_blocks++;
-    struct block new_block = create_directory_block(block_num, current_dir);
+    if ((inode->contents.inode.flags & INODE_INLINE) && new_size <= INLINE_DATA_SIZE) {
+        // still fits in the inode
+        memcpy(inode->contents.inode.inline_data + inode->contents.inode.file_size, buf, count);
+        inode->contents.inode.file_size = new_size;
+        return E_SUCCESS;
+    }
 
-    // copy directory blocknum and name to curdir
-    cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].block_num = block_num;
-    strcpy(cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].name, directory_name);
-    cur.contents.dirnode.num_entries++;
+    // a shared last partial block needs to be copied before it is filled
+    unsigned int num_blocks = inode_num_blocks(inode);
+    int copy_tail = num_blocks && inode->contents.inode.file_size % BLOCK_SIZE
+        && prepare_overwrite(inode->contents.inode.data_blocks[num_blocks - 1]);
 
-    // write changes
-    write_block(block_num, &new_block);
-    // printf("MAX_DIR_ENTRIES: %d\nDIR_ENTRIES: %d\n", MAX_DIR_ENTRIES, cur.contents.dirnode.num_entries);
-    write_block(current_dir, &cur);
+    // preallocated blocks are filled first
+    unsigned int num_entries = inode_num_entries(inode);
+    unsigned int new_blocks = blocks_for_size(new_size);
+    unsigned int needed = (new_blocks > num_entries ? new_blocks - num_entries : 0) + copy_tail;
+    if (pool ? needed > pool->count - pool->next : reserve_blocks(needed, 0) != needed) {
+        return E_DISK_FULL;
+    }
+
+    if (inode->contents.inode.flags & INODE_INLINE) {
+        // spill the inline data out to real data blocks
+        char old_data[INLINE_DATA_SIZE];
+        unsigned int old_size = inode->contents.inode.file_size;
+        memcpy(old_data, inode->contents.inode.inline_data, old_size);
+        inode->contents.inode.flags &= ~INODE_INLINE;
+        inode->contents.inode.file_size = 0;
+        memset(inode->contents.inode.data_blocks, 0, sizeof(inode->contents.inode.data_blocks));
+        append_data(inode, old_data, old_size, pool, NULL);
+    }
 
+    append_data(inode, buf, count, pool, copy_tail ? replaced : NULL);
     return E_SUCCESS;
 }
 
 
-/* jfs_chdir
- *   changes the current directory to the specified subdirectory, or changes
- *   the current directory to the root directory if the directory_name is NULL
- * directory_name - name of the subdirectory to make the current
- *   directory; if directory_name is NULL then the current directory
- *   should be made the root directory instead
- * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_NOT_DIR
- */
-int jfs_chdir(const char* directory_name) {
-    if (!directory_name) {
-        current_dir = 1; // change to root directory
-        return E_SUCCESS;
+// Appends to a file that have been accepted but not written to disk yet.
+// Blocks are only allocated for them when they are flushed (by jfs_sync(),
+// jfs_unmount(), an operation that needs the file's blocks, or to make room
+// in the table), so that many small appends end up in one contiguous run of
+// blocks written sequentially.
+#define DELAYED_APPENDS 8
+
+struct delayed_append {
+    block_num_t inode_num; // 0 if the slot is unused
+    unsigned int reserved; // blocks reserved for flushing the data
+    unsigned short count;  // number of bytes buffered
+    char data[MAX_FILE_SIZE];
+};
+
+// set by jfs_set_dedup()
+static int dedup_enabled;
+
+// a slot in use only changes while its inode is write-locked; delayed_lock
+// protects finding, taking and freeing slots
+static struct delayed_append delayed[DELAYED_APPENDS];
+static pthread_mutex_t delayed_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_victim; // next slot to flush when the table is full
+
+// finds the buffered appends of an inode the caller has locked, or NULL
+static struct delayed_append* delayed_find(block_num_t inode_num) {
+    struct delayed_append* found = NULL;
+    pthread_mutex_lock(&delayed_lock);
+    for (unsigned int i = 0; i < DELAYED_APPENDS; i++) {
+        if (delayed[i].inode_num == inode_num) {
+            found = &delayed[i];
+            break;
+        }
     }
+    pthread_mutex_unlock(&delayed_lock);
+    return found;
+}
 
-    struct block block;
-    assert(read_block(current_dir, &block) == 0);
-    for (int i = 0; i < block.contents.dirnode.num_entries; i++) {
-        char* str = block.contents.dirnode.entries[i].name;
-        if (strcmp(str, directory_name) == 0) {
-            if (!is_dir(block.contents.dirnode.entries[i].block_num)) {
-                return E_NOT_DIR;
-            }
+// frees a slot of the table
+static void delayed_free(struct delayed_append* d) {
+    pthread_mutex_lock(&delayed_lock);
+    d->inode_num = 0;
+    pthread_mutex_unlock(&delayed_lock);
+}
 
-            // change curdir to directory_name
-            current_dir = block.contents.dirnode.entries[i].block_num;
-            return E_SUCCESS;
-        }
+// whether flushing appends to a (non-inline) inode writes its last partial
+// block to a new block: it does if the block is shared, and also when there
+// are no preallocated blocks after it, so that it joins the new run
+static int tail_moves(const struct block* inode) {
+    unsigned int size = inode->contents.inode.file_size;
+    if (size % BLOCK_SIZE == 0) {
+        return 0;
     }
-    return E_NOT_EXISTS;
+    block_num_t tail = inode->contents.inode.data_blocks[size / BLOCK_SIZE];
+    return inode_num_entries(inode) == blocks_for_size(size) || prepare_overwrite(tail);
 }
 
+// number of blocks flushing buffered more bytes to an inode will allocate
+static unsigned int delayed_blocks(const struct block* inode, unsigned int buffered) {
+    unsigned int size = inode->contents.inode.file_size;
+    if (inode->contents.inode.flags & INODE_INLINE) {
+        return size + buffered <= INLINE_DATA_SIZE ? 0 : blocks_for_size(size + buffered);
+    }
+    // blocks from the last partial one on, minus those the file already has
+    unsigned int first = size / BLOCK_SIZE;
+    unsigned int used = blocks_for_size(size % BLOCK_SIZE + buffered);
+    unsigned int have = inode_num_entries(inode) - first - tail_moves(inode);
+    return used > have ? used - have : 0;
+}
 
-/* jfs_ls
- *   finds the names of all the files and directories in the current directory
- *   and writes the directory names to the directories argument and the file
- *   names to the files argument
- * directories - array of strings; the function will set the strings in the
- *   array, followed by a NULL pointer after the last valid string; the strings
- *   should be malloced and the caller will free them
- * file - array of strings; the function will set the strings in the
- *   array, followed by a NULL pointer after the last valid string; the strings
- *   should be malloced and the caller will free them
- * returns 0 on success or one of the following error codes on failure:
- *   (this function should always succeed)
+/* delayed_flush
+ *   writes the appends buffered for an inode the caller has write-locked:
+ *   the last partial block (or the inline data) and the buffered bytes are
+ *   written together, into the file's preallocated blocks if it has any and
+ *   otherwise into one new run of blocks, and the inode is committed.
+ *   The caller must not be in a transaction, and frees the slot afterwards.
+ * returns 0 on success or E_UNKNOWN on failure (the data stays buffered)
  */
-int jfs_ls(char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]) {
-    struct block cur;
-    read_block(current_dir, &cur);
-    // printf("MAX_DIR_ENTRIES: %d\nDIR_ENTRIES: %d\n", MAX_DIR_ENTRIES, cur.contents.dirnode.num_entries);
+static int delayed_flush(block_num_t inode_num, struct block* inode, struct delayed_append* d) {
+    unsigned int size = inode->contents.inode.file_size;
+    int is_inline = inode->contents.inode.flags & INODE_INLINE;
+    block_num_t old_tail = 0;
+    unsigned int fresh = 0;
+
+    if (d->count == 0) {
+        // nothing to write
+    }
+    else if (is_inline && size + d->count <= INLINE_DATA_SIZE) {
+        memcpy(inode->contents.inode.inline_data + size, d->data, d->count);
+        inode->contents.inode.file_size += d->count;
+        journal_write_block(inode_num, inode);
+    }
+    else {
+        // everything from the start of the last partial block is written
+        unsigned int first = is_inline ? 0 : size / BLOCK_SIZE;
+        unsigned int partial = size - first * BLOCK_SIZE;
+        unsigned int used = blocks_for_size(partial + d->count);
+        char data[(MAX_DATA_BLOCKS + 1) * BLOCK_SIZE];
+        memset(data, 0, sizeof(data));
+        block_num_t blocks[MAX_DATA_BLOCKS];
+        memset(blocks, 0, sizeof(blocks));
+        if (is_inline) {
+            memcpy(data, inode->contents.inode.inline_data, partial);
+        }
+        else {
+            memcpy(blocks, &inode->contents.inode.data_blocks[first], used * sizeof(block_num_t));
+            if (partial) {
+                read_block(blocks[0], data);
+                if (tail_moves(inode)) {
+                    old_tail = blocks[0];
+                    blocks[0] = 0;
+                }
+            }
+        }
+        memcpy(data + partial, d->data, d->count);
+
+        // in dedup mode, new full blocks that are already on disk are shared
+        // instead of written, and ones repeated within this flush are
+        // written once (same[i] is 1 + the index of the earlier copy)
+        unsigned int full = (partial + d->count) / BLOCK_SIZE;
+        uint16_t fingerprints[MAX_DATA_BLOCKS];
+        int deduped[MAX_DATA_BLOCKS];
+        unsigned int same[MAX_DATA_BLOCKS];
+        memset(deduped, 0, sizeof(deduped));
+        memset(same, 0, sizeof(same));
+        // read once, so that jfs_set_dedup() cannot change it halfway through
+        int dedup = __atomic_load_n(&dedup_enabled, __ATOMIC_RELAXED);
+        if (dedup) {
+            for (unsigned int i = 0; i < full; i++) {
+                fingerprints[i] = block_fingerprint(data + i * BLOCK_SIZE);
+                if (blocks[i]) {
+                    continue;
+                }
+                for (unsigned int k = 0; k < i && !same[i]; k++) {
+                    if (!blocks[k] && !same[k] && fingerprints[k] == fingerprints[i]
+                        && !memcmp(data + k * BLOCK_SIZE, data + i * BLOCK_SIZE, BLOCK_SIZE)) {
+                        same[i] = k + 1;
+                    }
+                }
+                if (!same[i]) {
+                    blocks[i] = share_duplicate(data + i * BLOCK_SIZE, fingerprints[i]);
+                    deduped[i] = blocks[i] != 0;
+                }
+            }
+        }
 
-    int dir_count = 0, file_count = 0;
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        char* str = (char *) malloc(MAX_NAME_LENGTH + 1);
-        strncpy(str, cur.contents.dirnode.entries[i].name, sizeof(cur.contents.dirnode.entries[i].name));
-        if (is_dir(cur.contents.dirnode.entries[i].block_num)) { // add to dirs
-            directories[dir_count] = str;
-            dir_count++;
+        // one allocation for every block the file does not have yet
+        block_num_t run[MAX_DATA_BLOCKS];
+        for (unsigned int i = 0; i < used; i++) {
+            fresh += !blocks[i] && !same[i];
         }
-        else { // add to files
-            files[file_count] = str;
-            file_count++;
+        int got = allocate_run(run, fresh);
+        if (got != (int) fresh) {
+            release_blocks(run, got);
+            for (unsigned int i = 0; i < used; i++) {
+                if (deduped[i]) {
+                    release_blocks(&blocks[i], 1);
+                }
+            }
+            return E_UNKNOWN;
+        }
+        for (unsigned int i = 0, next = 0; i < used; i++) {
+            if (!blocks[i] && !same[i]) {
+                blocks[i] = run[next++];
+            }
+        }
+        for (unsigned int i = 0; i < used; i++) {
+            if (same[i]) {
+                blocks[i] = blocks[same[i] - 1];
+                share_blocks(&blocks[i], 1); // a fresh block; cannot fail
+                deduped[i] = 1;
+            }
+        }
+
+        // write each stretch of consecutive blocks with one call
+        unsigned int j;
+        for (unsigned int i = 0; i < used; i = j) {
+            if (deduped[i]) {
+                j = i + 1;
+                continue;
+            }
+            for (j = i + 1; j < used && !deduped[j] && blocks[j] == blocks[j - 1] + 1; j++) {}
+            journal_write_data_blocks(blocks[i], data + i * BLOCK_SIZE, j - i);
         }
+
+        // full blocks written in dedup mode can be shared from now on
+        if (dedup) {
+            for (unsigned int i = 0; i < full; i++) {
+                if (!deduped[i]) {
+                    set_fingerprint(blocks[i], fingerprints[i]);
+                }
+            }
+        }
+
+        if (is_inline) {
+            inode->contents.inode.flags &= ~INODE_INLINE;
+            memset(inode->contents.inode.data_blocks, 0, sizeof(inode->contents.inode.data_blocks));
+        }
+        memcpy(&inode->contents.inode.data_blocks[first], blocks, used * sizeof(block_num_t));
+        inode->contents.inode.file_size += d->count;
+        journal_write_block(inode_num, inode);
     }
-    // put null after in both arrays
-    directories[dir_count] = NULL;
-    files[file_count] = NULL;
 
+    // the old last block is released once the inode no longer uses it
+    unsigned int unused = d->reserved - fresh;
+    if (old_tail) {
+        int freed = release_blocks(&old_tail, 1);
+        if (freed > 0) {
+            unused += freed;
+        }
+    }
+    unreserve_blocks(unused);
+    d->count = 0;
+    d->reserved = 0;
     return E_SUCCESS;
 }
 
+// flushes the buffered appends of an inode the caller has not locked
+static int delayed_flush_inode(block_num_t inode_num) {
+    int ret = E_SUCCESS;
+    lock_write(inode_num);
+    struct delayed_append* d = delayed_find(inode_num);
+    if (d) {
+        struct block inode;
+        journal_read_block(inode_num, &inode);
+        ret = delayed_flush(inode_num, &inode, d);
+        if (ret == E_SUCCESS) {
+            delayed_free(d);
+        }
+    }
+    unlock(inode_num);
+    return ret;
+}
 
-/* jfs_rmdir
- *   removes the specified subdirectory of the current directory
- * directory_name - name of the subdirectory to remove
- * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_NOT_DIR, E_NOT_EMPTY
- */
-int jfs_rmdir(const char* directory_name) {
-    struct block cur;
-    read_block(current_dir, &cur);
-    int flag = 0, pos = 0;
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (strcmp(cur.contents.dirnode.entries[i].name, directory_name) == 0) {
-            if (!is_dir(cur.contents.dirnode.entries[i].block_num)) {
-                return E_NOT_DIR;
-            }
+// flushes every buffered append
+static int delayed_flush_all() {
+    int ret = 0;
+    for (unsigned int i = 0; i < DELAYED_APPENDS; i++) {
+        pthread_mutex_lock(&delayed_lock);
+        block_num_t inode_num = delayed[i].inode_num;
+        pthread_mutex_unlock(&delayed_lock);
+        if (inode_num && delayed_flush_inode(inode_num) != E_SUCCESS) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
 
-            struct block block;
-            read_block(cur.contents.dirnode.entries[i].block_num, &block);
-            if (block.contents.dirnode.num_entries != 0) {
-                return E_NOT_EMPTY;
-            }
+// throws away the buffered appends of an inode the caller has write-locked
+static void delayed_discard(block_num_t inode_num) {
+    struct delayed_append* d = delayed_find(inode_num);
+    if (d) {
+        unreserve_blocks(d->reserved);
+        delayed_free(d);
+    }
+}
 
-            // remove dirblock
-            release_block(cur.contents.dirnode.entries[i].block_num);
-            allocated_blocks--;
-            cur.contents.dirnode.num_entries--;
-            flag = 1;
-            pos = i;
-            break;
+/* delayed_take
+ *   takes a free slot of the table for an inode the caller has write-locked,
+ *   flushing the appends of some file nobody is using if the table is full
+ * returns the slot, or NULL if no slot could be freed
+ */
+static struct delayed_append* delayed_take(block_num_t inode_num) {
+    struct delayed_append* d = NULL;
+    pthread_mutex_lock(&delayed_lock);
+    for (unsigned int i = 0; i < DELAYED_APPENDS && !d; i++) {
+        if (!delayed[i].inode_num) {
+            d = &delayed[i];
         }
     }
-    if (flag) { // if removed
-        // fix curdir entries list
-        for (int i = pos; i < cur.contents.dirnode.num_entries; i++) {
-            cur.contents.dirnode.entries[i].block_num = cur.contents.dirnode.entries[i + 1].block_num;
-            strcpy(cur.contents.dirnode.entries[i].name, cur.contents.dirnode.entries[i + 1].name);
+    for (unsigned int i = 0; i < DELAYED_APPENDS && !d; i++) {
+        struct delayed_append* victim = &delayed[next_victim];
+        next_victim = (next_victim + 1) % DELAYED_APPENDS;
+        // never wait for another inode's lock while holding one
+        block_num_t victim_num = victim->inode_num;
+        if (pthread_rwlock_trywrlock(&block_locks[victim_num]) != 0) {
+            continue;
         }
-        // write changes
-        write_block(current_dir, &cur);
-        return E_SUCCESS;
+        struct block inode;
+        journal_read_block(victim_num, &inode);
+        if (delayed_flush(victim_num, &inode, victim) == E_SUCCESS) {
+            d = victim;
+        }
+        unlock(victim_num);
     }
-    return E_NOT_EXISTS;
+    if (d) {
+        d->inode_num = inode_num;
+        d->count = 0;
+        d->reserved = 0;
+    }
+    pthread_mutex_unlock(&delayed_lock);
+    return d;
+}
+
+/* delayed_append
+ *   buffers count more bytes to append to an inode, reserving the blocks
+ *   flushing them will need so that the flush cannot run out of space
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_MAX_FILE_SIZE, E_DISK_FULL
+ */
+static int delayed_append(const struct block* inode, struct delayed_append* d, const char* buf, unsigned int count) {
+    if (inode->contents.inode.file_size + d->count + count > MAX_FILE_SIZE) {
+        return E_MAX_FILE_SIZE;
+    }
+    unsigned int needed = delayed_blocks(inode, d->count + count);
+    if (needed > d->reserved) {
+        if (reserve_blocks(needed - d->reserved, 0) != needed - d->reserved) {
+            return E_DISK_FULL;
+        }
+        d->reserved = needed;
+    }
+    memcpy(d->data + d->count, buf, count);
+    d->count += count;
+    return E_SUCCESS;
 }
 
 
-/* jfs_creat
- *   creates a new, empty file with the specified name
- * file_name - name to give the new file
+/* write_at
+ *   writes count bytes at offset of a file the caller has write-locked and
+ *   that has no buffered appends.  Data is overwritten in place, except in
+ *   shared blocks, which are copied first; blocks skipped over when the file
+ *   grows are left as holes (0 entries in data_blocks) that read as zeros.
+ *   The caller must not be in a transaction.
  * returns 0 on success or one of the following error codes on failure:
- *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ *   E_MAX_FILE_SIZE, E_DISK_FULL, E_UNKNOWN
  */
-int jfs_creat(const char* file_name) {
-    if (strlen(file_name) > MAX_NAME_LENGTH) {
-        return E_MAX_NAME_LENGTH;
+static int write_at(block_num_t inode_num, struct block* inode, const char* buf, unsigned int count, unsigned int offset) {
+    unsigned int size = inode->contents.inode.file_size;
+    unsigned int end = offset + count;
+    if (end > MAX_FILE_SIZE) {
+        return E_MAX_FILE_SIZE;
+    }
+    if (count == 0) {
+        return E_SUCCESS;
     }
 
-    struct block cur;
-    read_block(current_dir, &cur);
-    if (cur.contents.dirnode.num_entries == MAX_DIR_ENTRIES) {
-        return E_MAX_DIR_ENTRIES;
+    int is_inline = inode->contents.inode.flags & INODE_INLINE;
+    if (is_inline && end <= INLINE_DATA_SIZE) {
+        if (offset > size) {
+            memset(inode->contents.inode.inline_data + size, 0, offset - size);
+        }
+        memcpy(inode->contents.inode.inline_data + offset, buf, count);
+        if (end > size) {
+            inode->contents.inode.file_size = end;
+        }
+        journal_write_block(inode_num, inode);
+        return E_SUCCESS;
     }
 
-    if (allocated_blocks == NUM_BLOCKS) {
+    // the new block map; an inline file's data moves to block 0
+    block_num_t blocks[MAX_DATA_BLOCKS];
+    char inline_data[INLINE_DATA_SIZE];
+    unsigned int num_blocks = 0; // blocks (or holes) holding file data
+    unsigned int num_entries = 0;
+    if (is_inline) {
+        memset(blocks, 0, sizeof(blocks));
+        memcpy(inline_data, inode->contents.inode.inline_data, size);
+    }
+    else {
+        memcpy(blocks, inode->contents.inode.data_blocks, sizeof(blocks));
+        num_blocks = inode_num_blocks(inode);
+        num_entries = inode_num_entries(inode);
+    }
+    unsigned int first = offset / BLOCK_SIZE;
+    unsigned int last = (end - 1) / BLOCK_SIZE;
+    int spill = is_inline && size > 0 && first > 0;
+
+    // new blocks for holes, for the range past the end and for shared blocks
+    int copy[MAX_DATA_BLOCKS];
+    unsigned int needed = spill;
+    for (unsigned int i = first; i <= last; i++) {
+        copy[i] = blocks[i] && i < num_blocks && prepare_overwrite(blocks[i]);
+        needed += !blocks[i] || copy[i];
+    }
+    if (reserve_blocks(needed, 0) != needed) {
         return E_DISK_FULL;
     }
+    block_num_t run[MAX_DATA_BLOCKS];
+    int got = allocate_run(run, needed);
+    if (got != (int) needed) {
+        release_blocks(run, got);
+        unreserve_blocks(needed);
+        return E_UNKNOWN;
+    }
+    unsigned int next = 0;
+
+    char block[BLOCK_SIZE];
+    if (spill) {
+        blocks[0] = run[next++];
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(block, inline_data, size);
+        journal_write_data(blocks[0], block);
+    }
 
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (!strcmp(cur.contents.dirnode.entries[i].name, file_name)) {
-            return E_EXISTS;
-        }
+    // preallocated blocks that end up inside the file without being
+    // written must read as zeros, like holes
+    memset(block, 0, BLOCK_SIZE);
+    for (unsigned int i = num_blocks; i < first && i < num_entries; i++) {
+        journal_write_data(blocks[i], block);
     }
 
-    // create inode
-    block_num_t block_num = allocate_block();
-    allocated_blocks++;
+    // build the new contents of every block in the range
+    char data[MAX_DATA_BLOCKS * BLOCK_SIZE];
+    block_num_t replaced[MAX_DATA_BLOCKS];
+    unsigned int num_replaced = 0;
+    for (unsigned int i = first; i <= last; i++) {
+        char* contents = data + (i - first) * BLOCK_SIZE;
+        if (blocks[i] && i < num_blocks) {
+            read_block(blocks[i], contents);
+        }
+        else if (is_inline && i == 0) {
+            memset(contents, 0, BLOCK_SIZE);
+            memcpy(contents, inline_data, size);
+        }
+        else {
+            memset(contents, 0, BLOCK_SIZE);
+        }
+        unsigned int from = i == first ? offset % BLOCK_SIZE : 0;
+        unsigned int to = i == last ? end - i * BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(contents + from, buf + (i * BLOCK_SIZE + from - offset), to - from);
 
-    // add inode to entries list
-    cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].block_num = block_num;
-    strcpy(cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].name, file_name);
-    cur.contents.dirnode.num_entries++;
+        if (copy[i]) {
+            replaced[num_replaced++] = blocks[i];
+        }
+        if (!blocks[i] || copy[i]) {
+            blocks[i] = run[next++];
+        }
+    }
+
+    // write each stretch of consecutive blocks with one call
+    unsigned int j;
+    for (unsigned int i = first; i <= last; i = j) {
+        for (j = i + 1; j <= last && blocks[j] == blocks[j - 1] + 1; j++) {}
+        journal_write_data_blocks(blocks[i], data + (i - first) * BLOCK_SIZE, j - i);
+    }
+
+    inode->contents.inode.flags &= ~INODE_INLINE;
+    memcpy(inode->contents.inode.data_blocks, blocks, sizeof(blocks));
+    if (end > size) {
+        inode->contents.inode.file_size = end;
+    }
+    journal_write_block(inode_num, inode);
+
+    // the shared blocks that were copied lose a reference
+    int freed = release_blocks(replaced, num_replaced);
+    if (freed > 0) {
+        unreserve_blocks(freed);
+    }
+    return E_SUCCESS;
+}
+
+
+// number of bytes of chunk c of a compressed file of the given size
+static unsigned int chunk_length(unsigned int size, unsigned int c) {
+    unsigned int start = c * CHUNK_SIZE;
+    if (size <= start) {
+        return 0;
+    }
+    return size - start < CHUNK_SIZE ? size - start : CHUNK_SIZE;
+}
+
+// number of blocks chunk c of a compressed inode is stored in (0 for a hole)
+static unsigned int chunk_blocks(const struct block* inode, unsigned int c) {
+    unsigned int count = 0;
+    while (count < CHUNK_BLOCKS && inode->contents.inode.data_blocks[c * CHUNK_BLOCKS + count]) {
+        count++;
+    }
+    return count;
+}
+
+/* read_chunk
+ *   reads chunk c of a compressed, non-inline inode into data (CHUNK_SIZE
+ *   bytes long), decompressing it if it is stored compressed; holes and
+ *   bytes past the end of the file read as zeros
+ * returns 0 on success or -1 if the chunk is corrupt
+ */
+static int read_chunk(const struct block* inode, unsigned int c, char* data) {
+    unsigned int length = chunk_length(inode->contents.inode.file_size, c);
+    unsigned int stored = chunk_blocks(inode, c);
+    memset(data, 0, CHUNK_SIZE);
+    if (stored == 0) {
+        return 0;
+    }
+
+    char raw[CHUNK_SIZE];
+    for (unsigned int i = 0; i < stored; i++) {
+        read_block(inode->contents.inode.data_blocks[c * CHUNK_BLOCKS + i], raw + i * BLOCK_SIZE);
+    }
+    if (stored == blocks_for_size(length)) {
+        memcpy(data, raw, length);
+        return 0;
+    }
+    uint16_t compressed;
+    memcpy(&compressed, raw, sizeof(compressed));
+    if (compressed > stored * BLOCK_SIZE - sizeof(compressed)
+        || lz_decompress(raw + sizeof(compressed), compressed, data, length) != (int) length) {
+        return -1;
+    }
+    return 0;
+}
+
+/* encode_chunk
+ *   prepares length bytes of a chunk for storage, compressed if that saves
+ *   at least one block
+ * out - CHUNK_SIZE bytes; receives the blocks to store, padded with zeros
+ * returns the number of blocks to store
+ */
+static unsigned int encode_chunk(const char* data, unsigned int length, char* out) {
+    unsigned int raw_blocks = blocks_for_size(length);
+    memset(out, 0, CHUNK_SIZE);
+    if (raw_blocks > 1) {
+        int compressed = lz_compress(data, length, out + sizeof(uint16_t),
+                                     (raw_blocks - 1) * BLOCK_SIZE - sizeof(uint16_t));
+        if (compressed >= 0) {
+            uint16_t header = compressed;
+            memcpy(out, &header, sizeof(header));
+            return blocks_for_size(sizeof(header) + compressed);
+        }
+        memset(out, 0, CHUNK_SIZE);
+    }
+    memcpy(out, data, length);
+    return raw_blocks;
+}
+
+/* write_compressed
+ *   writes count bytes at offset of a compressed file the caller has
+ *   write-locked.  Every chunk the write touches (and the old last chunk,
+ *   whose length changes when the file grows) is decompressed, changed and
+ *   compressed again into new blocks, which are taken in one run; chunks
+ *   left all zeros become holes, except the last.  The caller writes the
+ *   inode back and then releases the blocks the file stopped using.
+ * pool - blocks to take new ones from, or NULL to reserve and allocate them
+ * old - receives the blocks the file stopped using (at most MAX_DATA_BLOCKS)
+ * num_old - set to the number of blocks in old
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_MAX_FILE_SIZE, E_DISK_FULL, E_UNKNOWN (a chunk is corrupt)
+ */
+static int write_compressed(struct block* inode, const char* buf, unsigned int count, unsigned int offset,
+                            struct block_pool* pool, block_num_t* old, unsigned int* num_old) {
+    *num_old = 0;
+    unsigned int size = inode->contents.inode.file_size;
+    unsigned int end = offset + count;
+    if (end > MAX_FILE_SIZE) {
+        return E_MAX_FILE_SIZE;
+    }
+    if (count == 0) {
+        return E_SUCCESS;
+    }
+    unsigned int new_size = end > size ? end : size;
+    int is_inline = inode->contents.inode.flags & INODE_INLINE;
+
+    // the chunks to rewrite: those in [offset, end), plus the old last one
+    // if the file grows (all inline data goes into chunk 0)
+    unsigned int first = offset / CHUNK_SIZE;
+    unsigned int last = (end - 1) / CHUNK_SIZE;
+    unsigned int tail = first;
+    if (is_inline) {
+        tail = 0;
+    }
+    else if (end > size && size % CHUNK_SIZE && size / CHUNK_SIZE < first) {
+        tail = size / CHUNK_SIZE;
+    }
+
+    // encode every chunk first, so that all their blocks are taken at once
+    char stored[MAX_DATA_BLOCKS / CHUNK_BLOCKS][CHUNK_SIZE];
+    unsigned int num_stored[MAX_DATA_BLOCKS / CHUNK_BLOCKS];
+    unsigned int needed = 0;
+    for (unsigned int c = tail; c <= last; c++) {
+        if (c != tail && c < first) {
+            continue; // stays a hole
+        }
+        char data[CHUNK_SIZE];
+        if (is_inline) {
+            memset(data, 0, CHUNK_SIZE);
+            if (c == 0) {
+                memcpy(data, inode->contents.inode.inline_data, size);
+            }
+        }
+        else if (read_chunk(inode, c, data) < 0) {
+            return E_UNKNOWN;
+        }
+        unsigned int from = c * CHUNK_SIZE > offset ? c * CHUNK_SIZE : offset;
+        unsigned int to = (c + 1) * CHUNK_SIZE < end ? (c + 1) * CHUNK_SIZE : end;
+        if (from < to) {
+            memcpy(data + (from - c * CHUNK_SIZE), buf + (from - offset), to - from);
+        }
+
+        unsigned int length = chunk_length(new_size, c);
+        num_stored[c] = encode_chunk(data, length, stored[c]);
+        if ((c + 1) * CHUNK_SIZE < new_size) {
+            int zeros = 1;
+            for (unsigned int i = 0; i < length && zeros; i++) {
+                zeros = !data[i];
+            }
+            if (zeros) {
+                num_stored[c] = 0;
+            }
+        }
+        needed += num_stored[c];
+    }
+
+    block_num_t run[MAX_DATA_BLOCKS];
+    if (pool) {
+        if (needed > pool->count - pool->next) {
+            return E_DISK_FULL;
+        }
+        for (unsigned int i = 0; i < needed; i++) {
+            run[i] = take_block(pool);
+        }
+    }
+    else {
+        if (reserve_blocks(needed, 0) != needed) {
+            return E_DISK_FULL;
+        }
+        int got = allocate_run(run, needed);
+        if (got != (int) needed) {
+            release_blocks(run, got);
+            unreserve_blocks(needed);
+            return E_UNKNOWN;
+        }
+    }
+
+    if (is_inline) {
+        inode->contents.inode.flags &= ~INODE_INLINE;
+        memset(inode->contents.inode.data_blocks, 0, sizeof(inode->contents.inode.data_blocks));
+    }
+    unsigned int next = 0;
+    for (unsigned int c = tail; c <= last; c++) {
+        if (c != tail && c < first) {
+            continue;
+        }
+        block_num_t* entries = &inode->contents.inode.data_blocks[c * CHUNK_BLOCKS];
+        for (unsigned int i = 0; i < CHUNK_BLOCKS; i++) {
+            if (entries[i]) {
+                old[(*num_old)++] = entries[i];
+            }
+            entries[i] = i < num_stored[c] ? run[next + i] : 0;
+        }
+
+        // write each stretch of consecutive blocks with one call
+        unsigned int j;
+        for (unsigned int i = 0; i < num_stored[c]; i = j) {
+            for (j = i + 1; j < num_stored[c] && entries[j] == entries[j - 1] + 1; j++) {}
+            journal_write_data_blocks(entries[i], stored[c] + i * BLOCK_SIZE, j - i);
+        }
+        next += num_stored[c];
+    }
+    inode->contents.inode.file_size = new_size;
+    return E_SUCCESS;
+}
+
+// write_compressed() for a file the caller has write-locked, committing the
+// inode and releasing the old blocks
+static int write_compressed_inode(block_num_t inode_num, struct block* inode, const char* buf,
+                                  unsigned int count, unsigned int offset) {
+    if ((inode->contents.inode.flags & INODE_INLINE) && offset + count <= INLINE_DATA_SIZE) {
+        return write_at(inode_num, inode, buf, count, offset); // still fits in the inode
+    }
+    block_num_t old[MAX_DATA_BLOCKS];
+    unsigned int num_old;
+    int ret = write_compressed(inode, buf, count, offset, NULL, old, &num_old);
+    if (ret != E_SUCCESS) {
+        return ret;
+    }
+    journal_write_block(inode_num, inode);
+    int freed = release_blocks(old, num_old);
+    if (freed > 0) {
+        unreserve_blocks(freed);
+    }
+    return E_SUCCESS;
+}
+
+/* read_inode_data
+ *   copies bytes [offset, end) of a file's data on disk into out; holes and
+ *   compressed chunks are taken care of (end must not be past the end of the
+ *   file)
+ * returns 0 on success or -1 if the data is corrupt
+ */
+static int read_inode_data(const struct block* inode, char* out, unsigned int offset, unsigned int end) {
+    if (offset >= end) {
+        return 0;
+    }
+    if (inode->contents.inode.flags & INODE_INLINE) {
+        memcpy(out, inode->contents.inode.inline_data + offset, end - offset);
+        return 0;
+    }
+
+    int compressed = inode->contents.inode.flags & INODE_COMPRESSED;
+    unsigned int unit = compressed ? CHUNK_SIZE : BLOCK_SIZE;
+    unsigned int first = offset / unit;
+    unsigned int last = (end - 1) / unit;
+    char data[CHUNK_SIZE];
+    for (unsigned int index = first; index <= last; index++) {
+        // the part of [offset, end) inside this block or chunk
+        unsigned int from = index == first ? offset % unit : 0;
+        unsigned int to = index == last ? end - index * unit : unit;
+        if (compressed) {
+            if (read_chunk(inode, index, data) < 0) {
+                return -1;
+            }
+        }
+        else if (inode->contents.inode.data_blocks[index]) {
+            read_block(inode->contents.inode.data_blocks[index], data);
+        }
+        else { // a hole
+            memset(data, 0, BLOCK_SIZE);
+        }
+        memcpy(out + (index * unit + from - offset), data + from, to - from);
+    }
+    return 0;
+}
+
+
+// Sequential readahead: reads that carry on where the previous read of the
+// same file stopped double the number of blocks read ahead of them (up to
+// READAHEAD_MAX); any other read turns readahead off for the file until it
+// is read sequentially again
+#define READAHEAD_FILES 16
+#define READAHEAD_MIN 2
+#define READAHEAD_MAX 16
+
+struct readahead_state {
+    block_num_t inode_num; // 0 if the slot is unused
+    unsigned int next;     // index of the block after the last one read
+    unsigned int window;   // blocks to read ahead; 0 after a random read
+    unsigned int ahead;    // index of the block after the last one read ahead
+};
+
+static struct readahead_state readahead_states[READAHEAD_FILES];
+static unsigned int next_readahead_slot;
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sequential_reads, random_reads;
+
+/* jfs_mount
+ *   prepares the DISK file on the _real_ file system to have file system
+ *   blocks read and written to it.  The application _must_ call this function
+ *   exactly once before calling any other jfs_* functions.  If your code
+ *   requires any additional one-time initialization before any other jfs_*
+ *   functions are called, you can add it here.
+ *   A disk that was formatted before keeps its files and directories; any
+ *   other disk is formatted first (the root directory holds JFS_MAGIC).
+ *   Mounting takes time proportional to the size of the bitmap, not of the
+ *   tree.
+ * filename - the name of the DISK file on the _real_ file system
+ * returns 0 on success or -1 on error; errors should only occur due to
+ *   errors in the underlying disk syscalls, or a disk formatted by an
+ *   incompatible version (see JFS_VERSION).  After an error nothing is left
+ *   mounted.
+ */
+int jfs_mount(const char* filename) {
+    int ret = bfs_mount(filename);
+    if (ret != 0) return ret;
+
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        pthread_rwlock_init(&block_locks[i], NULL);
+    }
+
+    // on failure the disk is unmounted again, so that it can be mounted anew
+    struct block root;
+    if (journal_read_block(1, &root) < 0) {
+        bfs_unmount();
+        return -1;
+    }
+    if (root.is_dir != 0 || root.contents.dirnode.magic != JFS_MAGIC) {
+        // not formatted yet: free everything and write an empty root
+        // directory to block 1
+        root = create_directory_block(1, 1);
+        root.contents.dirnode.magic = JFS_MAGIC;
+        root.contents.dirnode.version = JFS_VERSION;
+        if (bfs_format() < 0 || journal_write_block(1, &root) < 0) {
+            bfs_unmount();
+            return -1;
+        }
+    } else if (root.contents.dirnode.version != JFS_VERSION) {
+        bfs_unmount();
+        return -1;
+    }
+
+    // blocks in use are exactly the ones the bitmap marks allocated
+    allocated_blocks = count_allocated_blocks();
+    memset(delayed, 0, sizeof(delayed));
+    memset(readahead_states, 0, sizeof(readahead_states));
+    sequential_reads = random_reads = 0;
+    return 0;
+}
+
+
+/* jfs_session_init
+ *   prepares a session for use; every jfs_* call (other than jfs_mount,
+ *   jfs_sync and jfs_unmount) takes a session, which holds the caller's
+ *   current directory.  Sessions are independent of each other, so each
+ *   thread using the file system should have its own; the file system
+ *   itself may be used by any number of threads at once.  (Removing a
+ *   directory that is some other session's current directory leaves that
+ *   session in an invalid state.)
+ * session - the session to initialize; it starts in the root directory
+ */
+void jfs_session_init(struct jfs_session* session) {
+    session->current_dir = 1; // root directory
+}
+
+
+/* jfs_check_session
+ *   checks that a session's current directory is still a directory.  It may
+ *   not be if another session removed it (and its block was reused) after
+ *   this one changed into it; the jfs_* calls trust the current directory,
+ *   so a caller that cannot rule this out (e.g. a server taking current
+ *   directories from its clients) should check before each call.
+ * returns 0 if it is a directory, or E_NOT_EXISTS
+ */
+int jfs_check_session(struct jfs_session* session) {
+    block_num_t dir = session->current_dir;
+    if (dir == 0 || dir >= NUM_BLOCKS) {
+        return E_NOT_EXISTS;
+    }
+    lock_read(dir);
+    int ret = block_allocated(dir) && is_dir(dir) ? E_SUCCESS : E_NOT_EXISTS;
+    unlock(dir);
+    return ret;
+}
+
+
+// jfs_mkdir() on a directory the caller has write-locked
+static int mkdir_in_dir(block_num_t current_dir, const char* directory_name) {
+
+    if (strlen(directory_name) > MAX_NAME_LENGTH) {
+        return E_MAX_NAME_LENGTH;
+    }
+
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+
+    if (cur.contents.dirnode.num_entries == MAX_DIR_ENTRIES) {
+        return E_MAX_DIR_ENTRIES;
+    }
+
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        if (!strcmp(directory_name, cur.contents.dirnode.entries[i].name)) {
+            return E_EXISTS;
+        }
+    }
+
+    if (!reserve_blocks(1, 0)) {
+        return E_DISK_FULL;
+    }
+
+    // create new directory block
+    journal_begin();
+    block_num_t block_num = allocate_block();
+    struct block new_block = create_directory_block(block_num, current_dir);
+
+    // copy directory blocknum and name to curdir
+    cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].block_num = block_num;
+    strcpy(cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].name, directory_name);
+    cur.contents.dirnode.num_entries++;
 
     // write changes
-    write_block(current_dir, &cur);
-    struct block inode = create_inode_block();
-    write_block(block_num, &inode);
+    journal_write_block(block_num, &new_block);
+    // printf("MAX_DIR_ENTRIES: %d\nDIR_ENTRIES: %d\n", MAX_DIR_ENTRIES, cur.contents.dirnode.num_entries);
+    journal_write_block(current_dir, &cur);
+    if (journal_end() < 0) { // nothing was committed
+        release_block(block_num);
+        unreserve_blocks(1);
+        return E_UNKNOWN;
+    }
+
+    return E_SUCCESS;
+}
+
+
+/* jfs_mkdir
+ *   creates a new subdirectory in the current directory
+ * directory_name - name of the new subdirectory
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ */
+int jfs_mkdir(struct jfs_session* session, const char* directory_name) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = mkdir_in_dir(dir, directory_name);
+    unlock(dir);
+    trace_call(start, TRACE_MKDIR, dir, ret, "s", directory_name);
+    return ret;
+}
+
+
+/* jfs_chdir
+ *   changes the current directory to the specified subdirectory, or changes
+ *   the current directory to the root directory if the directory_name is NULL
+ * directory_name - name of the subdirectory to make the current
+ *   directory; if directory_name is NULL then the current directory
+ *   should be made the root directory instead
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR
+ */
+int jfs_chdir(struct jfs_session* session, const char* directory_name) {
+    uint64_t start = trace_begin();
+    block_num_t current_dir = session->current_dir;
+    if (!directory_name) {
+        session->current_dir = 1; // change to root directory
+        trace_call(start, TRACE_CHDIR, current_dir, E_SUCCESS, "su", directory_name, 1);
+        return E_SUCCESS;
+    }
+
+
+    lock_read(current_dir);
+    struct block block;
+    assert(journal_read_block(current_dir, &block) == 0);
+    int ret = E_NOT_EXISTS;
+    for (int i = 0; i < block.contents.dirnode.num_entries; i++) {
+        char* str = block.contents.dirnode.entries[i].name;
+        if (strcmp(str, directory_name) == 0) {
+            if (!is_dir(block.contents.dirnode.entries[i].block_num)) {
+                ret = E_NOT_DIR;
+                break;
+            }
+
+            // change curdir to directory_name
+            session->current_dir = block.contents.dirnode.entries[i].block_num;
+            ret = E_SUCCESS;
+            break;
+        }
+    }
+    unlock(current_dir);
+    trace_call(start, TRACE_CHDIR, current_dir, ret, "su", directory_name, session->current_dir);
+    return ret;
+}
+
+
+// jfs_ls() on a directory the caller has read-locked
+static int ls_in_dir(block_num_t current_dir, char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    // printf("MAX_DIR_ENTRIES: %d\nDIR_ENTRIES: %d\n", MAX_DIR_ENTRIES, cur.contents.dirnode.num_entries);
+
+    int dir_count = 0, file_count = 0;
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        char* str = (char *) malloc(MAX_NAME_LENGTH + 1);
+        strncpy(str, cur.contents.dirnode.entries[i].name, sizeof(cur.contents.dirnode.entries[i].name));
+        if (is_dir(cur.contents.dirnode.entries[i].block_num)) { // add to dirs
+            directories[dir_count] = str;
+            dir_count++;
+        }
+        else { // add to files
+            files[file_count] = str;
+            file_count++;
+        }
+    }
+    // put null after in both arrays
+    directories[dir_count] = NULL;
+    files[file_count] = NULL;
 
     return E_SUCCESS;
 }
 
 
-/* jfs_remove
- *   deletes the specified file and all its data (note that this cannot delete
- *   directories; use rmdir instead to remove directories)
- * file_name - name of the file to remove
- * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR
+/* jfs_ls
+ *   finds the names of all the files and directories in the current directory
+ *   and writes the directory names to the directories argument and the file
+ *   names to the files argument
+ * directories - array of strings; the function will set the strings in the
+ *   array, followed by a NULL pointer after the last valid string; the strings
+ *   should be malloced and the caller will free them
+ * file - array of strings; the function will set the strings in the
+ *   array, followed by a NULL pointer after the last valid string; the strings
+ *   should be malloced and the caller will free them
+ * returns 0 on success or one of the following error codes on failure:
+ *   (this function should always succeed)
+ */
+int jfs_ls(struct jfs_session* session, char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = ls_in_dir(dir, directories, files);
+    unlock(dir);
+    trace_call(start, TRACE_LS, dir, ret, "");
+    return ret;
+}
+
+
+// jfs_rmdir() on a directory the caller has write-locked
+static int rmdir_in_dir(block_num_t current_dir, const char* directory_name) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    block_num_t removed = 0;
+    int flag = 0, pos = 0;
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        if (strcmp(cur.contents.dirnode.entries[i].name, directory_name) == 0) {
+            if (!is_dir(cur.contents.dirnode.entries[i].block_num)) {
+                return E_NOT_DIR;
+            }
+
+            // a session inside the directory may be adding to it
+            block_num_t block_num = cur.contents.dirnode.entries[i].block_num;
+            lock_write(block_num);
+            struct block block;
+            journal_read_block(block_num, &block);
+            if (block.contents.dirnode.num_entries != 0) {
+                unlock(block_num);
+                return E_NOT_EMPTY;
+            }
+
+            // remove dirblock
+            journal_begin();
+            removed = block_num;
+            cur.contents.dirnode.num_entries--;
+            flag = 1;
+            pos = i;
+            break;
+        }
+    }
+    if (flag) { // if removed
+        // fix curdir entries list
+        for (int i = pos; i < cur.contents.dirnode.num_entries; i++) {
+            cur.contents.dirnode.entries[i].block_num = cur.contents.dirnode.entries[i + 1].block_num;
+            strcpy(cur.contents.dirnode.entries[i].name, cur.contents.dirnode.entries[i + 1].name);
+        }
+        // write changes; the block is only released once that has committed
+        journal_write_block(current_dir, &cur);
+        if (journal_end() < 0) { // the directory is still there
+            unlock(removed);
+            return E_UNKNOWN;
+        }
+        unlock(removed);
+        release_block(removed);
+        unreserve_blocks(1);
+        return E_SUCCESS;
+    }
+    return E_NOT_EXISTS;
+}
+
+
+/* jfs_rmdir
+ *   removes the specified subdirectory of the current directory
+ * directory_name - name of the subdirectory to remove
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR, E_NOT_EMPTY
+ */
+int jfs_rmdir(struct jfs_session* session, const char* directory_name) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = rmdir_in_dir(dir, directory_name);
+    unlock(dir);
+    trace_call(start, TRACE_RMDIR, dir, ret, "s", directory_name);
+    return ret;
+}
+
+
+// jfs_creat() on a directory the caller has write-locked
+static int creat_in_dir(block_num_t current_dir, const char* file_name) {
+    if (strlen(file_name) > MAX_NAME_LENGTH) {
+        return E_MAX_NAME_LENGTH;
+    }
+
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    if (cur.contents.dirnode.num_entries == MAX_DIR_ENTRIES) {
+        return E_MAX_DIR_ENTRIES;
+    }
+
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        if (!strcmp(cur.contents.dirnode.entries[i].name, file_name)) {
+            return E_EXISTS;
+        }
+    }
+
+    if (!reserve_blocks(1, 0)) {
+        return E_DISK_FULL;
+    }
+
+    // create inode
+    journal_begin();
+    block_num_t block_num = allocate_block();
+
+    // add inode to entries list
+    cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].block_num = block_num;
+    strcpy(cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].name, file_name);
+    cur.contents.dirnode.num_entries++;
+
+    // write changes
+    journal_write_block(current_dir, &cur);
+    struct block inode = create_inode_block();
+    journal_write_block(block_num, &inode);
+    if (journal_end() < 0) { // nothing was committed
+        release_block(block_num);
+        unreserve_blocks(1);
+        return E_UNKNOWN;
+    }
+
+    return E_SUCCESS;
+}
+
+
+/* jfs_creat
+ *   creates a new, empty file with the specified name
+ * file_name - name to give the new file
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ */
+int jfs_creat(struct jfs_session* session, const char* file_name) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = creat_in_dir(dir, file_name);
+    unlock(dir);
+    trace_call(start, TRACE_CREAT, dir, ret, "s", file_name);
+    return ret;
+}
+
+
+// jfs_remove() on a directory the caller has write-locked
+static int remove_in_dir(block_num_t current_dir, const char* file_name) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+
+    // the inode and data blocks are released once the removal has committed
+    block_num_t released[MAX_DATA_BLOCKS + 1];
+    unsigned int num_released = 0;
+    block_num_t inode_num = 0;
+
+    int flag = 0, pos = 0;
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        if (!strcmp(cur.contents.dirnode.entries[i].name, file_name)) {
+            if (is_dir(cur.contents.dirnode.entries[i].block_num)) {
+                return E_IS_DIR;
+            }
+
+            // jfs_sync() may be flushing the file's buffered appends
+            inode_num = cur.contents.dirnode.entries[i].block_num;
+            lock_write(inode_num);
+            delayed_discard(inode_num);
+            struct block found;
+            journal_read_block(inode_num, &found);
+
+            // release inode
+            journal_begin();
+            released[num_released++] = cur.contents.dirnode.entries[i].block_num;
+            cur.contents.dirnode.num_entries--;
+
+            // release data blocks, including preallocated ones
+            unsigned int num_blocks = inode_num_entries(&found);
+            for (unsigned int i = 0; i < num_blocks; i++) {
+                if (found.contents.inode.data_blocks[i]) { // not a hole
+                    released[num_released++] = found.contents.inode.data_blocks[i];
+                }
+            }
+
+            flag = 1;
+            pos = i;
+            break;
+        }
+    }
+    if (!flag) {
+        return E_NOT_EXISTS;
+    }
+    // fix curdir entries
+    for (int i = pos; i < cur.contents.dirnode.num_entries; i++) {
+        cur.contents.dirnode.entries[i].block_num = cur.contents.dirnode.entries[i + 1].block_num;
+        strcpy(cur.contents.dirnode.entries[i].name, cur.contents.dirnode.entries[i + 1].name);
+    }
+    // write curdir changes
+    journal_write_block(current_dir, &cur);
+    int ret = journal_end();
+    unlock(inode_num);
+    if (ret < 0) { // the file is still there
+        return E_UNKNOWN;
+    }
+    int freed = release_blocks(released, num_released);
+    if (freed > 0) {
+        unreserve_blocks(freed);
+    }
+    return E_SUCCESS;
+}
+
+
+/* jfs_remove
+ *   deletes the specified file and all its data (note that this cannot delete
+ *   directories; use rmdir instead to remove directories)
+ * file_name - name of the file to remove
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR
+ */
+int jfs_remove(struct jfs_session* session, const char* file_name) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = remove_in_dir(dir, file_name);
+    unlock(dir);
+    trace_call(start, TRACE_REMOVE, dir, ret, "s", file_name);
+    return ret;
+}
+
+
+// A directory jfs_walk() is inside of, with the entries it read on entering it
+struct walk_frame {
+    unsigned int num_entries;
+    unsigned int next;        // entry to visit next
+    unsigned int path_length; // of the directory's path, including its '/'
+    struct jfs_walk_entry entries[MAX_DIR_ENTRIES];
+    char names[MAX_DIR_ENTRIES][MAX_NAME_LENGTH + 1];
+};
+
+/* walk_read_dir
+ *   reads a directory block and then the blocks of all its entries, so that
+ *   a walk reads every block of the tree once, and keeps what it needs of
+ *   them in frame; no lock is held once it returns
+ */
+static void walk_read_dir(block_num_t dir_num, unsigned int depth, struct walk_frame* frame) {
+    lock_read(dir_num);
+    struct block dir;
+    journal_read_block(dir_num, &dir);
+    frame->num_entries = dir.contents.dirnode.num_entries;
+    frame->next = 0;
+    for (unsigned int i = 0; i < frame->num_entries; i++) {
+        struct jfs_walk_entry* entry = &frame->entries[i];
+        block_num_t block_num = dir.contents.dirnode.entries[i].block_num;
+        strcpy(frame->names[i], dir.contents.dirnode.entries[i].name);
+        entry->name = frame->names[i];
+        entry->depth = depth;
+        entry->block_num = block_num;
+
+        // the same as jfs_stat() reports, buffered appends included
+        struct block block;
+        lock_read(block_num);
+        journal_read_block(block_num, &block);
+        struct delayed_append* d = delayed_find(block_num);
+        unsigned int buffered = d ? d->count : 0;
+        unlock(block_num);
+        entry->is_dir = block.is_dir;
+        entry->file_size = 0;
+        entry->num_data_blocks = 0;
+        if (entry->is_dir) {
+            entry->file_size = block.contents.inode.file_size + buffered;
+            entry->num_data_blocks = inode_allocated_blocks(&block, buffered);
+        }
+    }
+    unlock(dir_num);
+}
+
+// sets the path of entry i of frame, writing its name after the path of the
+// frame's directory in path
+static void walk_path(struct walk_frame* frame, unsigned int i, char* path) {
+    strcpy(path + frame->path_length, frame->entries[i].name);
+    frame->entries[i].path = path;
+}
+
+/* walk_tree
+ *   jfs_walk() from directory top, depth first, with an explicit stack of
+ *   the directories it is inside of.  A directory reached a second time
+ *   (only possible on a corrupt disk) is visited but not walked again.
+ */
+static int walk_tree(block_num_t top, int flags, jfs_walk_fn fn, void* arg) {
+    // one frame per directory on the way down, and each directory's path is
+    // at most a name and a '/' longer than its parent's
+    struct walk_frame* frames = malloc(NUM_BLOCKS * sizeof(struct walk_frame));
+    char* path = malloc(NUM_BLOCKS * (MAX_NAME_LENGTH + 1) + 1);
+    char visited[NUM_BLOCKS];
+    if (!frames || !path) {
+        free(frames);
+        free(path);
+        return E_UNKNOWN;
+    }
+    memset(visited, 0, sizeof(visited));
+    visited[top] = 1;
+
+    int depth = 0, ret = 0;
+    frames[0].path_length = 0;
+    walk_read_dir(top, 0, &frames[0]);
+    while (depth >= 0 && ret == 0) {
+        struct walk_frame* frame = &frames[depth];
+        if (frame->next == frame->num_entries) {
+            // done with this directory; in postorder, it is visited now
+            depth--;
+            if (depth >= 0 && (flags & JFS_WALK_POSTORDER)) {
+                walk_path(&frames[depth], frames[depth].next - 1, path);
+                ret = fn(&frames[depth].entries[frames[depth].next - 1], arg);
+            }
+            continue;
+        }
+
+        unsigned int i = frame->next++;
+        struct jfs_walk_entry* entry = &frame->entries[i];
+        int descend = entry->is_dir == 0 && entry->block_num < NUM_BLOCKS && !visited[entry->block_num];
+        walk_path(frame, i, path);
+        if (!descend || !(flags & JFS_WALK_POSTORDER)) {
+            ret = fn(entry, arg);
+        }
+        if (descend && ret == 0) {
+            visited[entry->block_num] = 1;
+            struct walk_frame* child = &frames[++depth];
+            child->path_length = frame->path_length + strlen(entry->name) + 1;
+            path[child->path_length - 1] = '/';
+            walk_read_dir(entry->block_num, depth, child);
+        }
+    }
+
+    free(frames);
+    free(path);
+    return ret;
+}
+
+
+/* jfs_walk
+ *   visits every file and directory under a directory, depth first, calling
+ *   fn for each with its path and stats.  Each directory's block and the
+ *   blocks of its entries are read once, together, when the walk enters
+ *   it, and no lock is held while fn runs, so fn may call other jfs_*
+ *   functions; changes made to the tree during the walk may or may not be
+ *   seen by it.
+ * directory_name - subdirectory of the current directory to walk, or NULL
+ *   to walk the current directory itself
+ * flags - JFS_WALK_POSTORDER to visit each directory after its contents
+ *   (for example to remove them) instead of before
+ * fn - called for each entry with arg; if it returns nonzero, the walk
+ *   stops and returns that value
+ * returns 0 on success, the nonzero value fn returned, or one of the
+ *   following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR, E_UNKNOWN (out of memory)
+ */
+int jfs_walk(struct jfs_session* session, const char* directory_name, int flags, jfs_walk_fn fn, void* arg) {
+    uint64_t start = trace_begin();
+    block_num_t top = session->current_dir;
+    int ret = E_SUCCESS;
+    if (directory_name) {
+        block_num_t dir = session->current_dir;
+        lock_read(dir);
+        struct block cur;
+        journal_read_block(dir, &cur);
+        int index = dir_find(&cur, directory_name);
+        if (index >= 0) {
+            top = cur.contents.dirnode.entries[index].block_num;
+        }
+        unlock(dir);
+        if (index < 0) {
+            ret = E_NOT_EXISTS;
+        } else if (!is_dir(top)) {
+            ret = E_NOT_DIR;
+        }
+    }
+    if (E_SUCCESS == ret) {
+        ret = walk_tree(top, flags, fn, arg);
+    }
+    trace_call(start, TRACE_WALK, session->current_dir, ret, "su", directory_name, flags);
+    return ret;
+}
+
+
+// jfs_remove_tree() on a directory the caller has write-locked
+static int remove_tree_in_dir(block_num_t current_dir, const char* name) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    int index = dir_find(&cur, name);
+    if (index < 0) {
+        return E_NOT_EXISTS;
+    }
+    block_num_t top = cur.contents.dirnode.entries[index].block_num;
+    if (!is_dir(top)) {
+        return remove_in_dir(current_dir, name);
+    }
+
+    // write-lock the whole tree, parents before children, reading each block
+    // once: directories are kept to be scanned in turn, and each file's
+    // blocks are noted for release.  Shared data blocks can be noted more
+    // than once (once per reference).
+    block_num_t* locked = malloc(NUM_BLOCKS * sizeof(block_num_t));
+    struct block* dirs = malloc(NUM_BLOCKS * sizeof(struct block));
+    block_num_t* released = malloc(NUM_BLOCKS * (MAX_DATA_BLOCKS + 1) * sizeof(block_num_t));
+    char seen[NUM_BLOCKS];
+    if (!locked || !dirs || !released) {
+        free(locked);
+        free(dirs);
+        free(released);
+        return E_UNKNOWN;
+    }
+    memset(seen, 0, sizeof(seen));
+    unsigned int num_locked = 0, num_dirs = 0, num_released = 0;
+
+    lock_write(top);
+    locked[num_locked++] = top;
+    seen[top] = 1;
+    journal_read_block(top, &dirs[num_dirs++]);
+    released[num_released++] = top;
+    for (unsigned int scan = 0; scan < num_dirs; scan++) {
+        for (int i = 0; i < dirs[scan].contents.dirnode.num_entries; i++) {
+            block_num_t block_num = dirs[scan].contents.dirnode.entries[i].block_num;
+            if (block_num >= NUM_BLOCKS || seen[block_num]) {
+                continue; // only on a corrupt disk
+            }
+            seen[block_num] = 1;
+            lock_write(block_num);
+            locked[num_locked++] = block_num;
+            released[num_released++] = block_num;
+
+            struct block block;
+            journal_read_block(block_num, &block);
+            if (block.is_dir == 0) {
+                dirs[num_dirs++] = block;
+                continue;
+            }
+            delayed_discard(block_num);
+            unsigned int num_entries = inode_num_entries(&block);
+            for (unsigned int j = 0; j < num_entries; j++) {
+                if (block.contents.inode.data_blocks[j]) { // not a hole
+                    released[num_released++] = block.contents.inode.data_blocks[j];
+                }
+            }
+        }
+    }
+
+    // unlinking the top directory is the only change to commit; everything
+    // under it is released in one pass once that has committed
+    journal_begin();
+    cur.contents.dirnode.num_entries--;
+    for (int i = index; i < cur.contents.dirnode.num_entries; i++) {
+        cur.contents.dirnode.entries[i] = cur.contents.dirnode.entries[i + 1];
+    }
+    journal_write_block(current_dir, &cur);
+    int ret = journal_end() < 0 ? E_UNKNOWN : E_SUCCESS;
+    while (num_locked > 0) {
+        unlock(locked[--num_locked]);
+    }
+    if (ret == E_SUCCESS) { // else the tree is still there
+        int freed = release_blocks(released, num_released);
+        if (freed > 0) {
+            unreserve_blocks(freed);
+        }
+    }
+
+    free(locked);
+    free(dirs);
+    free(released);
+    return ret;
+}
+
+
+/* jfs_remove_tree
+ *   removes the specified file, or directory together with everything under
+ *   it, from the current directory.  The tree is read once, the removal is
+ *   committed as a single change to the current directory, and all the
+ *   blocks it used are then released in one pass.  Like jfs_rmdir(), it
+ *   does not check whether other sessions are inside the tree.
+ * name - name of the file or directory to remove
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_UNKNOWN (out of memory)
+ */
+int jfs_remove_tree(struct jfs_session* session, const char* name) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = remove_tree_in_dir(dir, name);
+    unlock(dir);
+    trace_call(start, TRACE_REMOVE_TREE, dir, ret, "s", name);
+    return ret;
+}
+
+
+// fills in the stats of an entry of a directory the caller has locked
+static void stat_entry(block_num_t block_num, const char* name, struct stats* buf) {
+    struct block found;
+    lock_read(block_num);
+    journal_read_block(block_num, &found);
+    struct delayed_append* d = delayed_find(block_num);
+    unsigned int buffered = d ? d->count : 0;
+    unlock(block_num);
+    buf->is_dir = found.is_dir;
+    strcpy(buf->name, name);
+    buf->block_num = block_num;
+
+    if (buf->is_dir) { // it is a file; count buffered appends as written
+        buf->file_size = found.contents.inode.file_size + buffered;
+        buf->num_data_blocks = inode_allocated_blocks(&found, buffered);
+        buf->physical_size = buf->num_data_blocks * BLOCK_SIZE;
+    }
+}
+
+
+// jfs_stat() on a directory the caller has read-locked
+static int stat_in_dir(block_num_t current_dir, const char* name, struct stats* buf) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+
+    int index = dir_find(&cur, name);
+    if (index < 0) {
+        return E_NOT_EXISTS;
+    }
+    stat_entry(cur.contents.dirnode.entries[index].block_num, name, buf);
+    return E_SUCCESS;
+}
+
+
+/* jfs_stat
+ *   returns the file or directory stats (see struct stat for details)
+ * name - name of the file or directory to inspect
+ * buf  - pointer to a struct stat (already allocated by the caller) where the
+ *   stats will be written
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS
+ */
+int jfs_stat(struct jfs_session* session, const char* name, struct stats* buf) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = stat_in_dir(dir, name, buf);
+    unlock(dir);
+    trace_call(start, TRACE_STAT, dir, ret, "s", name);
+    return ret;
+}
+
+
+// jfs_listdir() on a directory the caller has read-locked
+static int listdir_in_dir(block_num_t current_dir, const char* directory_name, struct jfs_listing** listing) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    block_num_t listed = current_dir;
+    if (directory_name) {
+        int index = dir_find(&cur, directory_name);
+        if (index < 0) {
+            return E_NOT_EXISTS;
+        }
+        listed = cur.contents.dirnode.entries[index].block_num;
+        lock_read(listed);
+        journal_read_block(listed, &cur);
+        if (cur.is_dir != 0) {
+            unlock(listed);
+            return E_NOT_DIR;
+        }
+    }
+
+    // the names are copied into the stats, so one allocation holds it all
+    int ret = E_SUCCESS;
+    unsigned int num_entries = cur.contents.dirnode.num_entries;
+    *listing = calloc(1, sizeof(struct jfs_listing) + num_entries * sizeof(struct stats));
+    if (!*listing) {
+        ret = E_UNKNOWN;
+    } else {
+        (*listing)->num_entries = num_entries;
+        for (unsigned int i = 0; i < num_entries; i++) {
+            stat_entry(cur.contents.dirnode.entries[i].block_num, cur.contents.dirnode.entries[i].name,
+                       &(*listing)->entries[i]);
+        }
+    }
+
+    if (listed != current_dir) {
+        unlock(listed);
+    }
+    return ret;
+}
+
+
+/* jfs_listdir
+ *   lists a directory with the stats of every entry in it (as jfs_stat would
+ *   return them), in the order the entries are stored.  Unlike jfs_ls, the
+ *   whole listing is one allocation however many entries there are, and no
+ *   jfs_stat calls are needed for sizes and types.
+ * directory_name - name of a subdirectory of the current directory to list,
+ *   or NULL to list the current directory
+ * listing - receives the listing, which the caller frees with
+ *   jfs_free_listing
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR, E_UNKNOWN (out of memory)
+ */
+int jfs_listdir(struct jfs_session* session, const char* directory_name, struct jfs_listing** listing) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = listdir_in_dir(dir, directory_name, listing);
+    unlock(dir);
+    trace_call(start, TRACE_LISTDIR, dir, ret, "s", directory_name);
+    return ret;
+}
+
+
+/* jfs_free_listing
+ *   frees a listing returned by jfs_listdir
+ */
+void jfs_free_listing(struct jfs_listing* listing) {
+    free(listing);
+}
+
+
+// jfs_pwrite() on a directory the caller has read-locked; offset END_OF_FILE
+// appends
+static int write_in_dir(block_num_t current_dir, const char* file_name, const void* buf,
+                        unsigned short count, unsigned int offset) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        if (strcmp(cur.contents.dirnode.entries[i].name, file_name) == 0) {
+            block_num_t inode_num = cur.contents.dirnode.entries[i].block_num;
+            if (is_dir(inode_num)) {
+                return E_IS_DIR;
+            }
+
+            // other writers of the directory's files only hold it read-locked
+            lock_write(inode_num);
+            struct block found;
+            journal_read_block(inode_num, &found);
+
+            // compressed files are not buffered; each write recompresses the
+            // chunks it touches
+            if (found.contents.inode.flags & INODE_COMPRESSED) {
+                int ret = write_compressed_inode(inode_num, &found, buf, count,
+                                                 offset == END_OF_FILE ? found.contents.inode.file_size : offset);
+                unlock(inode_num);
+                return ret;
+            }
+
+            // anything but an append is written right away, after whatever
+            // was buffered before it
+            struct delayed_append* d = delayed_find(inode_num);
+            unsigned int size = found.contents.inode.file_size + (d ? d->count : 0);
+            if (offset != END_OF_FILE && offset != size) {
+                int ret = E_SUCCESS;
+                if (d) {
+                    ret = delayed_flush(inode_num, &found, d);
+                    if (ret == E_SUCCESS) {
+                        delayed_free(d);
+                    }
+                }
+                if (ret == E_SUCCESS) {
+                    ret = write_at(inode_num, &found, buf, count, offset);
+                }
+                unlock(inode_num);
+                return ret;
+            }
+
+            // buffer the data; if the table is full of files in use, write it
+            // straight through instead
+            struct delayed_append through;
+            if (!d) {
+                d = delayed_take(inode_num);
+            }
+            if (!d) {
+                d = &through;
+                d->count = 0;
+                d->reserved = 0;
+            }
+            int ret = delayed_append(&found, d, buf, count);
+            if (d == &through) {
+                if (ret == E_SUCCESS) {
+                    ret = delayed_flush(inode_num, &found, d);
+                }
+            }
+            else if (d->count == 0) {
+                delayed_free(d);
+            }
+            unlock(inode_num);
+            return ret;
+        }
+    }
+    return E_NOT_EXISTS;
+}
+
+
+/* jfs_write
+ *   appends the data in the buffer to the end of the specified file
+ * file_name - name of the file to append data to
+ * buf - buffer containing the data to be written (note that the data could be
+ *   binary, not text, and even if it is text should not be assumed to be null
+ *   terminated)
+ * count - number of bytes in buf (write exactly this many)
+ * The data is buffered in memory (but visible to every reader right away),
+ * and blocks are allocated for it when it is flushed; see delayed_append.
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
+ */
+int jfs_write(struct jfs_session* session, const char* file_name, const void* buf, unsigned short count) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = write_in_dir(dir, file_name, buf, count, END_OF_FILE);
+    unlock(dir);
+    trace_call(start, TRACE_WRITE, dir, ret, "sd", file_name, buf, count);
+    return ret;
+}
+
+
+/* jfs_pwrite
+ *   writes the data in the buffer at byte offset of the specified file,
+ *   overwriting what is there and growing the file if the data goes past its
+ *   end.  Writing past the end leaves a hole between the old end and offset:
+ *   blocks there are not allocated and read back as zeros.
+ * offset - position in the file to write the first byte at
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
+ */
+int jfs_pwrite(struct jfs_session* session, const char* file_name, const void* buf, unsigned short count, unsigned int offset) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = write_in_dir(dir, file_name, buf, count, offset);
+    unlock(dir);
+    trace_call(start, TRACE_PWRITE, dir, ret, "sud", file_name, offset, buf, count);
+    return ret;
+}
+
+
+// jfs_seek() on a directory the caller has read-locked
+static int seek_in_dir(block_num_t current_dir, const char* file_name, unsigned int offset,
+                       int whence, unsigned int* result) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    int index = dir_find(&cur, file_name);
+    if (index < 0) {
+        return E_NOT_EXISTS;
+    }
+    block_num_t inode_num = cur.contents.dirnode.entries[index].block_num;
+    if (is_dir(inode_num)) {
+        return E_IS_DIR;
+    }
+    if (whence != JFS_SEEK_DATA && whence != JFS_SEEK_HOLE) {
+        return E_UNKNOWN;
+    }
+
+    lock_read(inode_num);
+    struct block inode;
+    journal_read_block(inode_num, &inode);
+    struct delayed_append* d = delayed_find(inode_num);
+    unsigned int size = inode.contents.inode.file_size + (d ? d->count : 0);
+    if (offset >= size) {
+        unlock(inode_num);
+        return E_NO_DATA;
+    }
+
+    // only whole blocks (whole chunks of a compressed file) on disk can be
+    // holes; everything else is data, and the end of the file counts as a hole
+    int compressed = inode.contents.inode.flags & INODE_COMPRESSED;
+    unsigned int unit = compressed ? CHUNK_SIZE : BLOCK_SIZE;
+    unsigned int step = compressed ? CHUNK_BLOCKS : 1;
+    unsigned int num_blocks = inode_num_blocks(&inode);
+    unsigned int pos = size;
+    for (unsigned int i = offset / unit; i * step < num_blocks; i++) {
+        int hole = !inode.contents.inode.data_blocks[i * step];
+        if (hole == (whence == JFS_SEEK_HOLE)) {
+            pos = i * unit > offset ? i * unit : offset;
+            break;
+        }
+    }
+    if (whence == JFS_SEEK_DATA && pos == size && num_blocks * BLOCK_SIZE < size) {
+        // the buffered appends past the blocks on disk are data
+        pos = num_blocks * BLOCK_SIZE > offset ? num_blocks * BLOCK_SIZE : offset;
+    }
+    unlock(inode_num);
+
+    if (whence == JFS_SEEK_DATA && pos == size) {
+        return E_NO_DATA; // nothing but holes up to the end
+    }
+    *result = pos;
+    return E_SUCCESS;
+}
+
+
+/* jfs_seek
+ *   finds the next data or hole in the specified file, like lseek() with
+ *   SEEK_DATA or SEEK_HOLE
+ * offset - position in the file to start looking at
+ * whence - JFS_SEEK_DATA to find the first byte at or after offset that is
+ *   not in a hole, or JFS_SEEK_HOLE to find the first byte at or after
+ *   offset that is in a hole (the end of the file counts as one)
+ * result - set to the position found
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR, E_NO_DATA (offset is at or past the end of the
+ *   file, or only holes follow it when looking for data), E_UNKNOWN (bad
+ *   whence)
+ */
+int jfs_seek(struct jfs_session* session, const char* file_name, unsigned int offset, int whence, unsigned int* result) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = seek_in_dir(dir, file_name, offset, whence, result);
+    unlock(dir);
+    trace_call(start, TRACE_SEEK, dir, ret, "suu", file_name, offset, whence);
+    return ret;
+}
+
+
+// jfs_fallocate() on a directory the caller has read-locked
+static int fallocate_in_dir(block_num_t current_dir, const char* file_name, unsigned int length) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    int index = dir_find(&cur, file_name);
+    if (index < 0) {
+        return E_NOT_EXISTS;
+    }
+    block_num_t inode_num = cur.contents.dirnode.entries[index].block_num;
+    if (is_dir(inode_num)) {
+        return E_IS_DIR;
+    }
+    if (length > MAX_FILE_SIZE) {
+        return E_MAX_FILE_SIZE;
+    }
+
+    lock_write(inode_num);
+    struct block inode;
+    journal_read_block(inode_num, &inode);
+
+    // buffered appends go into the file's current blocks first
+    struct delayed_append* d = delayed_find(inode_num);
+    if (d) {
+        int ret = delayed_flush(inode_num, &inode, d);
+        if (ret != E_SUCCESS) {
+            unlock(inode_num);
+            return ret;
+        }
+        delayed_free(d);
+    }
+
+    int is_inline = inode.contents.inode.flags & INODE_INLINE;
+    unsigned int num_entries = inode_num_entries(&inode);
+    unsigned int wanted = blocks_for_size(length);
+    if ((is_inline && length <= INLINE_DATA_SIZE) || (inode.contents.inode.flags & INODE_COMPRESSED)) {
+        // the inode already has room for length bytes, or the file is
+        // compressed and how many blocks it needs depends on its data
+        unlock(inode_num);
+        return E_SUCCESS;
+    }
+
+    // holes in the range are filled as well as the blocks past the end
+    unsigned int holes = 0;
+    for (unsigned int i = 0; i < num_entries && i < wanted; i++) {
+        holes += !inode.contents.inode.data_blocks[i];
+    }
+    unsigned int needed = holes + (wanted > num_entries ? wanted - num_entries : 0);
+    if (needed == 0) {
+        unlock(inode_num);
+        return E_SUCCESS;
+    }
+
+    // take every missing block in one allocator pass
+    if (reserve_blocks(needed, 0) != needed) {
+        unlock(inode_num);
+        return E_DISK_FULL;
+    }
+    block_num_t run[MAX_DATA_BLOCKS];
+    int got = allocate_run(run, needed);
+    if (got != (int) needed) {
+        release_blocks(run, got);
+        unreserve_blocks(needed);
+        unlock(inode_num);
+        return E_UNKNOWN;
+    }
+
+    if (is_inline) {
+        // the inline data moves to the first of the new blocks
+        char block[BLOCK_SIZE];
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(block, inode.contents.inode.inline_data, inode.contents.inode.file_size);
+        journal_write_data(run[0], block);
+        inode.contents.inode.flags &= ~INODE_INLINE;
+        memset(inode.contents.inode.data_blocks, 0, sizeof(inode.contents.inode.data_blocks));
+    }
+    unsigned int next = 0;
+    if (holes) {
+        // a hole reads as zeros, so the block filling it must hold zeros
+        char zeros[BLOCK_SIZE];
+        memset(zeros, 0, BLOCK_SIZE);
+        for (unsigned int i = 0; i < num_entries && i < wanted; i++) {
+            if (!inode.contents.inode.data_blocks[i]) {
+                inode.contents.inode.data_blocks[i] = run[next++];
+                journal_write_data(inode.contents.inode.data_blocks[i], zeros);
+            }
+        }
+    }
+    memcpy(&inode.contents.inode.data_blocks[num_entries], run + next, (needed - next) * sizeof(block_num_t));
+    journal_write_block(inode_num, &inode);
+    unlock(inode_num);
+    return E_SUCCESS;
+}
+
+
+/* jfs_fallocate
+ *   preallocates the data blocks the specified file needs to grow to length
+ *   bytes (consecutive blocks when possible) without writing any data or
+ *   changing its size; later appends fill the preallocated blocks without
+ *   allocating.  Holes before length are filled with zeroed blocks.
+ *   Preallocated blocks are freed when the file is removed.
+ * file_name - name of the file to preallocate blocks for
+ * length - size in bytes the file should have room for
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
+ */
+int jfs_fallocate(struct jfs_session* session, const char* file_name, unsigned int length) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = fallocate_in_dir(dir, file_name, length);
+    unlock(dir);
+    trace_call(start, TRACE_FALLOCATE, dir, ret, "su", file_name, length);
+    return ret;
+}
+
+
+/* readahead
+ *   records that blocks first to last of a file were just read, and reads
+ *   ahead of them into the block cache if the file is being read sequentially
+ *   (the caller holds the inode at least read-locked)
+ */
+static void readahead(block_num_t inode_num, const struct block* inode, unsigned int first, unsigned int last) {
+    pthread_mutex_lock(&readahead_lock);
+    struct readahead_state* state = NULL;
+    for (unsigned int i = 0; i < READAHEAD_FILES && !state; i++) {
+        if (readahead_states[i].inode_num == inode_num) {
+            state = &readahead_states[i];
+        }
+    }
+    if (!state) { // a file we have not seen (recently); reuse the oldest slot
+        state = &readahead_states[next_readahead_slot];
+        next_readahead_slot = (next_readahead_slot + 1) % READAHEAD_FILES;
+        state->inode_num = inode_num;
+        state->next = state->window = state->ahead = 0;
+    }
+
+    // the previous read may have stopped in the middle of a block
+    if (first <= state->next && first + 1 >= state->next) {
+        state->window = state->window ? state->window * 2 : READAHEAD_MIN;
+        if (state->window > READAHEAD_MAX) {
+            state->window = READAHEAD_MAX;
+        }
+        sequential_reads++;
+    }
+    else {
+        state->window = 0;
+        state->ahead = 0;
+        random_reads++;
+    }
+    state->next = last + 1;
+
+    // only read the part of the window that was not read ahead already
+    unsigned int from = last + 1 > state->ahead ? last + 1 : state->ahead;
+    unsigned int to = last + 1 + state->window;
+    unsigned int num_blocks = inode_num_blocks(inode);
+    if (to > num_blocks) {
+        to = num_blocks;
+    }
+    if (state->window && from < to) {
+        state->ahead = to;
+    }
+    else {
+        to = from;
+    }
+    pthread_mutex_unlock(&readahead_lock);
+
+    // one read for every stretch of consecutive blocks (holes are skipped)
+    unsigned int j;
+    for (unsigned int i = from; i < to; i = j) {
+        const block_num_t* blocks = inode->contents.inode.data_blocks;
+        for (j = i + 1; j < to && blocks[i] && blocks[j] == blocks[j - 1] + 1; j++) {}
+        if (blocks[i]) {
+            raw_prefetch(blocks[i], j - i);
+        }
+    }
+}
+
+
+// jfs_pread() on a directory the caller has read-locked
+static int read_in_dir(block_num_t current_dir, const char* file_name, void* buf,
+                       unsigned short* ptr_count, unsigned int offset) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
+        if (strcmp(cur.contents.dirnode.entries[i].name, file_name) == 0) {
+            block_num_t inode_num = cur.contents.dirnode.entries[i].block_num;
+            if (is_dir(inode_num)) {
+                return E_IS_DIR;
+            }
+            lock_read(inode_num);
+            struct block inode;
+            journal_read_block(inode_num, &inode);
+
+            // appends that are still buffered come after the data on disk
+            struct delayed_append* d = delayed_find(inode_num);
+            unsigned int on_disk = inode.contents.inode.file_size;
+            unsigned int size = on_disk + (d ? d->count : 0);
+            if (offset >= size) {
+                *ptr_count = 0;
+            }
+            else if (*ptr_count > size - offset) {
+                *ptr_count = size - offset;
+            }
+            char* out = buf;
+            unsigned int end = offset + *ptr_count;
+            if (d && end > on_disk) {
+                unsigned int from = offset > on_disk ? offset : on_disk;
+                memcpy(out + (from - offset), d->data + (from - on_disk), end - from);
+                end = from;
+            }
+            if (offset >= end) {
+                unlock(inode_num);
+                return E_SUCCESS;
+            }
+
+            int ret = read_inode_data(&inode, out, offset, end) < 0 ? E_UNKNOWN : E_SUCCESS;
+            if (!(inode.contents.inode.flags & (INODE_INLINE | INODE_COMPRESSED))) {
+                readahead(inode_num, &inode, offset / BLOCK_SIZE, (end - 1) / BLOCK_SIZE);
+            }
+
+            unlock(inode_num);
+            return ret;
+        }
+    }
+    return E_NOT_EXISTS;
+}
+
+
+/* jfs_read
+ *   reads the specified file and copies its contents into the buffer, up to a
+ *   maximum of *ptr_count bytes copied (but obviously no more than the file
+ *   size, either)
+ * file_name - name of the file to read
+ * buf - buffer where the file data should be written
+ * ptr_count - pointer to a count variable (allocated by the caller) that
+ *   contains the size of buf when it's passed in, and will be modified to
+ *   contain the number of bytes actually written to buf (e.g., if the file is
+ *   smaller than the buffer) if this function is successful
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR
+ */
+int jfs_read(struct jfs_session* session, const char* file_name, void* buf, unsigned short* ptr_count) {
+    uint64_t start = trace_begin();
+    unsigned short count = *ptr_count;
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = read_in_dir(dir, file_name, buf, ptr_count, 0);
+    unlock(dir);
+    trace_call(start, TRACE_READ, dir, ret, "su", file_name, count);
+    return ret;
+}
+
+
+/* jfs_pread
+ *   like jfs_read, but reads starting at byte offset of the file (reading
+ *   nothing if offset is at or past the end of the file).  Reads that
+ *   continue where the previous read of the file stopped make the file
+ *   system read ahead of them; see jfs_cache_stats.
+ * offset - position in the file of the first byte to read
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR
+ */
+int jfs_pread(struct jfs_session* session, const char* file_name, void* buf, unsigned short* ptr_count, unsigned int offset) {
+    uint64_t start = trace_begin();
+    unsigned short count = *ptr_count;
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = read_in_dir(dir, file_name, buf, ptr_count, offset);
+    unlock(dir);
+    trace_call(start, TRACE_PREAD, dir, ret, "suu", file_name, count, offset);
+    return ret;
+}
+
+
+/* jfs_cache_stats
+ *   reports how well the block cache and readahead are working: the cache's
+ *   counters, plus how many reads of file data were sequential (continuing
+ *   the previous read of the same file) and how many were not
  */
-int jfs_remove(const char* file_name) {
+void jfs_cache_stats(struct jfs_cache_stats* buf) {
+    raw_cache_stats(&buf->cache);
+    pthread_mutex_lock(&readahead_lock);
+    buf->sequential_reads = sequential_reads;
+    buf->random_reads = random_reads;
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+
+// An inode or directory block loaded by jfs_batch()
+struct batch_entry {
+    block_num_t block_num; // 0 if the slot is unused
+    int dirty;             // must be written back at the end of the batch
+    struct block block;
+};
+
+// finds (loading it if needed) the block of an entry of the current directory
+static struct batch_entry* batch_lookup(struct batch_entry* entries, block_num_t block_num) {
+    struct batch_entry* unused = NULL;
+    for (unsigned int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (entries[i].block_num == block_num) {
+            return &entries[i];
+        }
+        if (!entries[i].block_num && !unused) {
+            unused = &entries[i];
+        }
+    }
+    // every live entry of the directory has a slot, so one is always free
+    assert(unused);
+    unused->block_num = block_num;
+    unused->dirty = 0;
+    journal_read_block(block_num, &unused->block);
+    return unused;
+}
+
+// jfs_batch() on a directory the caller has write-locked
+static int batch_in_dir(block_num_t current_dir, struct jfs_op* ops, int num_ops) {
     struct block cur;
-    read_block(current_dir, &cur);
+    journal_read_block(current_dir, &cur);
 
-    int flag = 0, pos = 0;
+    // the batch works on the files' blocks on disk, so buffered appends to
+    // them are flushed first (nothing can buffer more while it runs)
     for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (!strcmp(cur.contents.dirnode.entries[i].name, file_name)) {
-            if (is_dir(cur.contents.dirnode.entries[i].block_num)) {
-                return E_IS_DIR;
+        if (delayed_find(cur.contents.dirnode.entries[i].block_num)) {
+            delayed_flush_inode(cur.contents.dirnode.entries[i].block_num);
+        }
+    }
+
+    // reserve as many blocks as the batch could possibly need
+    unsigned int wanted = 0;
+    for (int i = 0; i < num_ops; i++) {
+        if (ops[i].op == JFS_OP_MKDIR || ops[i].op == JFS_OP_CREAT) {
+            wanted++;
+        }
+        else if (ops[i].op == JFS_OP_WRITE) {
+            // + partial and copied blocks, or the old last chunk of a
+            // compressed file
+            wanted += blocks_for_size(ops[i].count) + CHUNK_BLOCKS;
+        }
+        if (wanted >= NUM_BLOCKS) {
+            break;
+        }
+    }
+
+    journal_begin();
+    struct block_pool pool;
+    pool.count = allocate_blocks(pool.blocks, reserve_blocks(wanted, 1));
+    pool.next = 0;
+
+    block_num_t released[NUM_BLOCKS];
+    unsigned int num_released = 0;
+    struct batch_entry entries[MAX_DIR_ENTRIES];
+    memset(entries, 0, sizeof(entries));
+
+    for (int i = 0; i < num_ops; i++) {
+        struct jfs_op* op = &ops[i];
+        int index = dir_find(&cur, op->name);
+
+        if (op->op == JFS_OP_MKDIR || op->op == JFS_OP_CREAT) {
+            op->result = dir_can_add(&cur, op->name);
+            if (op->result == E_SUCCESS && pool.next == pool.count) {
+                op->result = E_DISK_FULL;
+            }
+            if (op->result != E_SUCCESS) {
+                continue;
             }
 
-            struct block found;
-            read_block(cur.contents.dirnode.entries[i].block_num, &found);
+            block_num_t block_num = take_block(&pool);
+            if (op->op == JFS_OP_MKDIR) {
+                // nothing else in the batch can touch the new directory
+                struct block new_block = create_directory_block(block_num, current_dir);
+                journal_write_block(block_num, &new_block);
+            }
+            else {
+                struct batch_entry* entry = batch_lookup(entries, block_num);
+                entry->block = create_inode_block();
+                entry->dirty = 1;
+            }
+            cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].block_num = block_num;
+            strcpy(cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].name, op->name);
+            cur.contents.dirnode.num_entries++;
+        }
+        else if (op->op == JFS_OP_WRITE || op->op == JFS_OP_REMOVE) {
+            if (index < 0) {
+                op->result = E_NOT_EXISTS;
+                continue;
+            }
+            struct batch_entry* entry = batch_lookup(entries, cur.contents.dirnode.entries[index].block_num);
+            if (entry->block.is_dir == 0) {
+                op->result = E_IS_DIR;
+                continue;
+            }
 
-            // release inode
-            release_block(cur.contents.dirnode.entries[i].block_num);
-            allocated_blocks--;
-            cur.contents.dirnode.num_entries--;
+            if (op->op == JFS_OP_WRITE) {
+                struct block* inode = &entry->block;
+                if ((inode->contents.inode.flags & INODE_COMPRESSED)
+                    && !((inode->contents.inode.flags & INODE_INLINE)
+                         && inode->contents.inode.file_size + op->count <= INLINE_DATA_SIZE)) {
+                    unsigned int num_old;
+                    op->result = write_compressed(inode, op->buf, op->count, inode->contents.inode.file_size,
+                                                  &pool, released + num_released, &num_old);
+                    num_released += num_old;
+                }
+                else {
+                    block_num_t replaced;
+                    op->result = append_to_inode(inode, op->buf, op->count, &pool, &replaced);
+                    if (replaced) {
+                        released[num_released++] = replaced;
+                    }
+                }
+                entry->dirty |= op->result == E_SUCCESS;
+                continue;
+            }
 
-            int num_blocks = found.contents.inode.file_size / BLOCK_SIZE;
-            if (num_blocks * BLOCK_SIZE < found.contents.inode.file_size) {
-                num_blocks++;
+            // remove: give back the inode and its data blocks at the end
+            unsigned int num_blocks = inode_num_entries(&entry->block);
+            for (unsigned int j = 0; j < num_blocks; j++) {
+                if (entry->block.contents.inode.data_blocks[j]) { // not a hole
+                    released[num_released++] = entry->block.contents.inode.data_blocks[j];
+                }
             }
-            // release data blocks
-            for (int i = 0; i < num_blocks; i++) {
-                release_block(found.contents.inode.data_blocks[i]);
-                allocated_blocks--;
+            released[num_released++] = entry->block_num;
+            entry->block_num = 0;
+
+            cur.contents.dirnode.num_entries--;
+            for (int j = index; j < cur.contents.dirnode.num_entries; j++) {
+                cur.contents.dirnode.entries[j] = cur.contents.dirnode.entries[j + 1];
             }
+            op->result = E_SUCCESS;
+        }
+        else {
+            op->result = E_UNKNOWN;
+        }
+    }
 
-            flag = 1;
-            pos = i;
-            break;
+    // write every changed inode and the directory once
+    for (unsigned int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (entries[i].block_num && entries[i].dirty) {
+            journal_write_block(entries[i].block_num, &entries[i].block);
         }
     }
-    if (!flag) {
+    journal_write_block(current_dir, &cur);
+    int ret = E_SUCCESS;
+    if (journal_end() < 0) {
+        // nothing was committed: the removed files are still there, and
+        // every block taken from the pool is unused
+        num_released = 0;
+        pool.next = 0;
+        ret = E_UNKNOWN;
+    }
+
+    // give back what was released along with what was reserved but not used
+    while (pool.next < pool.count) {
+        released[num_released++] = pool.blocks[pool.next++];
+    }
+    int freed = release_blocks(released, num_released);
+    if (freed > 0) {
+        unreserve_blocks(freed);
+    }
+
+    return ret;
+}
+
+
+/* jfs_batch
+ *   applies a list of operations to the current directory as one
+ *   transaction: the directory block is read and written once, the blocks
+ *   the batch can need are allocated in one pass up front (unused ones are
+ *   given back at the end), and every block released by the batch is
+ *   released in one pass at the end.  Operations are applied in order and
+ *   each one sees the effects of the ones before it.
+ * ops - the operations to apply; the result field of each is set to the
+ *   return code the equivalent single jfs_* call would have returned
+ * num_ops - number of operations in ops
+ * returns 0 (the per-operation results say which operations failed)
+ */
+int jfs_batch(struct jfs_session* session, struct jfs_op* ops, int num_ops) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = batch_in_dir(dir, ops, num_ops);
+    unlock(dir);
+    trace_call(start, TRACE_BATCH, dir, ret, "b", ops, num_ops);
+    return ret;
+}
+
+
+// jfs_clone() on a directory the caller has write-locked
+static int clone_in_dir(block_num_t current_dir, const char* src_name, const char* dst_name) {
+    struct block cur;
+    journal_read_block(current_dir, &cur);
+
+    int src = dir_find(&cur, src_name);
+    if (src < 0) {
         return E_NOT_EXISTS;
     }
-    // fix curdir entries
-    for (int i = pos; i < cur.contents.dirnode.num_entries; i++) {
-        cur.contents.dirnode.entries[i].block_num = cur.contents.dirnode.entries[i + 1].block_num;
-        strcpy(cur.contents.dirnode.entries[i].name, cur.contents.dirnode.entries[i + 1].name);
+    block_num_t src_num = cur.contents.dirnode.entries[src].block_num;
+    if (is_dir(src_num)) {
+        return E_IS_DIR;
     }
-    // write curdir changes
-    write_block(current_dir, &cur);
+    int ret = dir_can_add(&cur, dst_name);
+    if (ret != E_SUCCESS) {
+        return ret;
+    }
+
+    // only the new inode needs a block; the data blocks gain a reference
+    if (!reserve_blocks(1, 0)) {
+        return E_DISK_FULL;
+    }
+    // the clone shares the blocks on disk, so buffered appends go there first
+    if (delayed_flush_inode(src_num) != E_SUCCESS) {
+        unreserve_blocks(1);
+        return E_UNKNOWN;
+    }
+    struct block inode;
+    journal_read_block(src_num, &inode);
+    unsigned int num_blocks = inode_num_blocks(&inode);
+    unsigned int num_entries = inode_num_entries(&inode);
+    for (unsigned int i = num_blocks; i < num_entries; i++) {
+        inode.contents.inode.data_blocks[i] = 0; // preallocation is not shared
+    }
+    block_num_t shared[MAX_DATA_BLOCKS];
+    unsigned int num_shared = 0;
+    for (unsigned int i = 0; i < num_blocks; i++) {
+        if (inode.contents.inode.data_blocks[i]) { // not a hole
+            shared[num_shared++] = inode.contents.inode.data_blocks[i];
+        }
+    }
+    if (share_blocks(shared, num_shared) < 0) {
+        unreserve_blocks(1);
+        return E_UNKNOWN;
+    }
+
+    journal_begin();
+    block_num_t block_num = allocate_block();
+    cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].block_num = block_num;
+    strcpy(cur.contents.dirnode.entries[cur.contents.dirnode.num_entries].name, dst_name);
+    cur.contents.dirnode.num_entries++;
+    journal_write_block(current_dir, &cur);
+    journal_write_block(block_num, &inode);
+    if (journal_end() < 0) { // nothing was committed
+        release_blocks(shared, num_shared);
+        release_block(block_num);
+        unreserve_blocks(1);
+        return E_UNKNOWN;
+    }
+
     return E_SUCCESS;
 }
 
 
-/* jfs_stat
- *   returns the file or directory stats (see struct stat for details)
- * name - name of the file or directory to inspect
- * buf  - pointer to a struct stat (already allocated by the caller) where the
- *   stats will be written
+/* jfs_clone
+ *   creates a copy of a file in the current directory without copying its
+ *   data: the copy shares the data blocks of the original, and a shared
+ *   block is only copied when either file later writes to it
+ * src_name - name of the file to copy
+ * dst_name - name to give the copy
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS
+ *   E_NOT_EXISTS, E_IS_DIR, E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES,
+ *   E_DISK_FULL, E_UNKNOWN (a data block is already shared too many times)
  */
-int jfs_stat(const char* name, struct stats* buf) {
+int jfs_clone(struct jfs_session* session, const char* src_name, const char* dst_name) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_write(dir);
+    int ret = clone_in_dir(dir, src_name, dst_name);
+    unlock(dir);
+    trace_call(start, TRACE_CLONE, dir, ret, "ss", src_name, dst_name);
+    return ret;
+}
+
+
+// jfs_set_compression() on a directory the caller has read-locked
+static int compress_in_dir(block_num_t current_dir, const char* file_name, int enabled) {
     struct block cur;
-    read_block(current_dir, &cur);
+    journal_read_block(current_dir, &cur);
+    int index = dir_find(&cur, file_name);
+    if (index < 0) {
+        return E_NOT_EXISTS;
+    }
+    block_num_t inode_num = cur.contents.dirnode.entries[index].block_num;
+    if (is_dir(inode_num)) {
+        return E_IS_DIR;
+    }
 
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (strcmp(cur.contents.dirnode.entries[i].name, name) == 0) {
-            struct block found;
-            read_block(cur.contents.dirnode.entries[i].block_num, &found);
-            buf->is_dir = found.is_dir;
-            strcpy(buf->name, name);
-            buf->block_num = cur.contents.dirnode.entries[i].block_num;
-
-            if (buf->is_dir) { // it is a file
-                buf->file_size = found.contents.inode.file_size;
-                buf->num_data_blocks  = found.contents.inode.file_size / BLOCK_SIZE;
-                if (found.contents.inode.file_size % BLOCK_SIZE) {
-                    buf->num_data_blocks++;
-                }
-            }
+    lock_write(inode_num);
+    struct block inode;
+    journal_read_block(inode_num, &inode);
+    struct delayed_append* d = delayed_find(inode_num);
+    if (d) {
+        int ret = delayed_flush(inode_num, &inode, d);
+        if (ret != E_SUCCESS) {
+            unlock(inode_num);
+            return ret;
+        }
+        delayed_free(d);
+    }
+    if (!(inode.contents.inode.flags & INODE_COMPRESSED) == !enabled) {
+        unlock(inode_num);
+        return E_SUCCESS;
+    }
 
-            return E_SUCCESS;
+    // rewrite the data into a fresh inode, then give back the old blocks
+    // (preallocated ones included)
+    unsigned int size = inode.contents.inode.file_size;
+    char data[MAX_FILE_SIZE];
+    if (read_inode_data(&inode, data, 0, size) < 0) {
+        unlock(inode_num);
+        return E_UNKNOWN;
+    }
+    block_num_t old[MAX_DATA_BLOCKS];
+    unsigned int num_old = 0;
+    unsigned int num_entries = inode_num_entries(&inode);
+    for (unsigned int i = 0; i < num_entries; i++) {
+        if (inode.contents.inode.data_blocks[i]) {
+            old[num_old++] = inode.contents.inode.data_blocks[i];
         }
     }
-    return E_NOT_EXISTS;
+
+    struct block fresh = create_inode_block();
+    if (enabled) {
+        fresh.contents.inode.flags |= INODE_COMPRESSED;
+    }
+    int ret = E_SUCCESS;
+    if (size <= INLINE_DATA_SIZE) {
+        memcpy(fresh.contents.inode.inline_data, data, size);
+        fresh.contents.inode.file_size = size;
+        journal_write_block(inode_num, &fresh);
+    }
+    else if (enabled) {
+        ret = write_compressed_inode(inode_num, &fresh, data, size, 0);
+    }
+    else {
+        ret = write_at(inode_num, &fresh, data, size, 0);
+    }
+    unlock(inode_num);
+    if (ret != E_SUCCESS) {
+        return ret;
+    }
+
+    int freed = release_blocks(old, num_old);
+    if (freed > 0) {
+        unreserve_blocks(freed);
+    }
+    return E_SUCCESS;
 }
 
 
-/* jfs_write
- *   appends the data in the buffer to the end of the specified file
- * file_name - name of the file to append data to
- * buf - buffer containing the data to be written (note that the data could be
- *   binary, not text, and even if it is text should not be assumed to be null
- *   terminated)
- * count - number of bytes in buf (write exactly this many)
+/* jfs_set_compression
+ *   turns compression of the specified file on or off, rewriting the data it
+ *   already has.  The data of a compressed file is kept in chunks of
+ *   CHUNK_SIZE bytes, each compressed on its own into as few blocks as it
+ *   fits in (or stored as it is if compressing does not save a block), so
+ *   that reading or writing part of the file only decompresses the chunks
+ *   in that part.  Writes to a compressed file go straight to disk, into new
+ *   blocks; its preallocated blocks are freed and jfs_fallocate() does
+ *   nothing for it.  jfs_stat() reports how much disk the data takes up.
+ * file_name - name of the file to compress or decompress
+ * enabled - nonzero to compress the file
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
+ *   E_NOT_EXISTS, E_IS_DIR, E_DISK_FULL, E_UNKNOWN (the data is corrupt)
  */
-int jfs_write(const char* file_name, const void* buf, unsigned short count) {
-    struct block cur;
-    read_block(current_dir, &cur);
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (strcmp(cur.contents.dirnode.entries[i].name, file_name) == 0) {
-            if (is_dir(cur.contents.dirnode.entries[i].block_num)) {
-                return E_IS_DIR;
-            }
+int jfs_set_compression(struct jfs_session* session, const char* file_name, int enabled) {
+    uint64_t start = trace_begin();
+    block_num_t dir = session->current_dir;
+    lock_read(dir);
+    int ret = compress_in_dir(dir, file_name, enabled);
+    unlock(dir);
+    trace_call(start, TRACE_SET_COMPRESSION, dir, ret, "su", file_name, enabled);
+    return ret;
+}
 
-            struct block found;
-            read_block(cur.contents.dirnode.entries[i].block_num, &found);
 
-            if (found.contents.inode.file_size + count > MAX_FILE_SIZE) {
-                return E_MAX_FILE_SIZE;
-            }
+// A file jfs_defrag() may move the data of, as found by walking the tree
+struct defrag_file {
+    block_num_t parent;    // dir block holding its entry
+    block_num_t inode_num;
+    block_num_t first;     // its lowest data block when last looked at (0 if none)
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+// What defrag_visit() collects
+struct defrag_state {
+    struct defrag_file* files;
+    unsigned int num_files;
+    block_num_t dirs[NUM_BLOCKS + 1]; // dirs[d] is the directory of the entries at depth d
+};
+
+// jfs_walk() callback that collects every regular file with its directory
+static int defrag_visit(const struct jfs_walk_entry* entry, void* arg) {
+    struct defrag_state* state = arg;
+    if (!entry->is_dir) {
+        state->dirs[entry->depth + 1] = entry->block_num;
+    } else if (state->num_files < NUM_BLOCKS) {
+        struct defrag_file* file = &state->files[state->num_files++];
+        file->parent = state->dirs[entry->depth];
+        file->inode_num = entry->block_num;
+        file->first = 0;
+        strcpy(file->name, entry->name);
+    }
+    return 0;
+}
 
-            char block[64];
-            if (found.contents.inode.file_size != 0) { // old file
-                int pos_last_block = found.contents.inode.file_size / BLOCK_SIZE;
-                int to_fill = BLOCK_SIZE - (found.contents.inode.file_size % BLOCK_SIZE);
+// finds every regular file on the disk; the caller frees state->files
+static int defrag_collect(struct defrag_state* state) {
+    state->files = malloc(NUM_BLOCKS * sizeof(struct defrag_file));
+    state->num_files = 0;
+    state->dirs[0] = 1;
+    if (!state->files) {
+        return E_UNKNOWN;
+    }
+    return walk_tree(1, 0, defrag_visit, state);
+}
 
-                if (count <= to_fill) { // fill last block only
-                    read_block(found.contents.inode.data_blocks[pos_last_block], &block);
-                    memcpy(block + found.contents.inode.file_size % BLOCK_SIZE, buf, count);
-                    write_block(found.contents.inode.data_blocks[pos_last_block], &block);
-                    found.contents.inode.file_size += count;
-                    write_block(cur.contents.dirnode.entries[i].block_num, &found);
-                    return E_SUCCESS;
-                }
+/* lock_file
+ *   read-locks a collected file's directory and write-locks its inode, once
+ *   it has checked that the directory still holds the file (it may have been
+ *   removed since the walk, and its directory with it)
+ * returns 1 with both locks held and the inode read, or 0 with neither
+ */
+static int lock_file(const struct defrag_file* file, struct block* inode) {
+    lock_read(file->parent);
+    struct block dir;
+    journal_read_block(file->parent, &dir);
+    int index = -1;
+    if (dir.is_dir == 0 && dir.contents.dirnode.num_entries <= MAX_DIR_ENTRIES) {
+        index = dir_find(&dir, file->name);
+    }
+    if (index < 0 || dir.contents.dirnode.entries[index].block_num != file->inode_num) {
+        unlock(file->parent);
+        return 0;
+    }
+    lock_write(file->inode_num);
+    journal_read_block(file->inode_num, inode);
+    return 1;
+}
 
-                // fill last block
-                read_block(found.contents.inode.data_blocks[pos_last_block], &block);
-                memcpy(block + found.contents.inode.file_size % BLOCK_SIZE, buf, to_fill);
-                write_block(found.contents.inode.data_blocks[pos_last_block], &block);
-                found.contents.inode.file_size += to_fill;
-
-                // add additional blocks
-                count = count - to_fill;
-                found.contents.inode.file_size += count;
-                if (count <= BLOCK_SIZE) { // just one block
-                    if (allocated_blocks == MAX_DATA_BLOCKS) {
-                        return E_DISK_FULL;
-                    }
-                    block_num_t block_num = allocate_block();
-                    allocated_blocks++;
-                    found.contents.inode.data_blocks[pos_last_block + 1] = block_num;
-                    memcpy(block, buf, count);
-                    write_block(block_num, block);
-                }
-                else {
-                    int num_blocks = count / BLOCK_SIZE;
-                    if (count % BLOCK_SIZE != 0) num_blocks++;
-                    if (num_blocks + allocated_blocks > MAX_DATA_BLOCKS) {
-                        return E_DISK_FULL;
-                    }
-                    int i;
-                    for (i = 0; i < num_blocks - 1; i++) {
-                        block_num_t block_num = allocate_block();
-                        allocated_blocks++;
-                        found.contents.inode.data_blocks[i + pos_last_block + 1] = block_num;
-                        memcpy(block, buf + i * BLOCK_SIZE + to_fill, BLOCK_SIZE);
-                        write_block(block_num, block);
-                    }
-                    // write last block
-                    int remainder = count % BLOCK_SIZE;
-                    if (remainder) {
-                        block_num_t block_num = allocate_block();
-                        allocated_blocks++;
-                        found.contents.inode.data_blocks[i] = block_num;
-                        memcpy(block, buf + i * BLOCK_SIZE + to_fill, remainder + 1);
-                        write_block(block_num, block);
-                    }
-                }
-                write_block(cur.contents.dirnode.entries[i].block_num, &found);
-                return E_SUCCESS;
-            }
+static void unlock_file(const struct defrag_file* file) {
+    unlock(file->inode_num);
+    unlock(file->parent);
+}
 
+// lists the data blocks of an inode in file order, leaving out holes;
+// returns their number
+static unsigned int file_blocks(const struct block* inode, block_num_t* blocks) {
+    unsigned int count = 0, num_entries = inode_num_entries(inode);
+    for (unsigned int i = 0; i < num_entries; i++) {
+        if (inode->contents.inode.data_blocks[i]) {
+            blocks[count++] = inode->contents.inode.data_blocks[i];
+        }
+    }
+    return count;
+}
 
-            // new file
-            found.contents.inode.file_size += count;
-            if (count <= BLOCK_SIZE) { // just one block
-                if (allocated_blocks == MAX_DATA_BLOCKS) {
-                    return E_DISK_FULL;
-                }
-                block_num_t block_num = allocate_block();
-                allocated_blocks++;
-                found.contents.inode.data_blocks[0] = block_num;
-                memcpy(block, buf, count);
-                write_block(block_num, block);
-            }
-            else {
-                int num_blocks = count / BLOCK_SIZE;
-                if (count % BLOCK_SIZE != 0) num_blocks++;
-                if (num_blocks + allocated_blocks > MAX_DATA_BLOCKS) {
-                    return E_DISK_FULL;
-                }
-                int i;
-                for (i = 0; i < num_blocks - 1; i++) {
-                    block_num_t block_num = allocate_block();
-                    allocated_blocks++;
-                    found.contents.inode.data_blocks[i] = block_num;
-                    memcpy(block, buf + i * BLOCK_SIZE, BLOCK_SIZE);
-                    write_block(block_num, block);
-                }
-                // write last block
-                int remainder = count % BLOCK_SIZE;
-                if (remainder) {
-                    block_num_t block_num = allocate_block();
-                    allocated_blocks++;
-                    found.contents.inode.data_blocks[i] = block_num;
-                    memcpy(block, buf + i * BLOCK_SIZE, remainder);
-                    write_block(block_num, block);
-                }
+// number of runs of consecutive blocks a list of blocks is made of
+static unsigned int count_extents(const block_num_t* blocks, unsigned int count) {
+    unsigned int extents = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        extents += i == 0 || blocks[i] != blocks[i - 1] + 1;
+    }
+    return extents;
+}
+
+static block_num_t lowest_block(const block_num_t* blocks, unsigned int count) {
+    block_num_t lowest = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (!lowest || blocks[i] < lowest) {
+            lowest = blocks[i];
+        }
+    }
+    return lowest;
+}
+
+/* relocate_file
+ *   copies the data blocks of a file to a run of consecutive free blocks and
+ *   points its inode at them.  Without compact, only a fragmented file is
+ *   moved, to the first run after its inode (or anywhere, if there is none
+ *   after it); with compact, a file is moved to the first run that lies
+ *   wholly before its lowest block.  Files with shared blocks stay put.
+ * returns the number of blocks moved
+ */
+static unsigned int relocate_file(struct defrag_file* file, int compact) {
+    struct block inode;
+    if (!lock_file(file, &inode)) {
+        file->first = 0;
+        return 0;
+    }
+    block_num_t old[MAX_DATA_BLOCKS], new[MAX_DATA_BLOCKS];
+    unsigned int count = file_blocks(&inode, old);
+    file->first = lowest_block(old, count);
+    int shared = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        shared |= block_shared(old[i]);
+    }
+    if (!count || shared || (!compact && count_extents(old, count) == 1) || !reserve_blocks(count, 0)) {
+        unlock_file(file);
+        return 0;
+    }
+
+    int found;
+    if (compact) {
+        found = allocate_run_in(new, count, 2, file->first);
+    } else {
+        found = allocate_run_in(new, count, file->inode_num + 1, RESERVED_START)
+            || allocate_run_in(new, count, 2, RESERVED_START);
+    }
+    if (!found) {
+        unreserve_blocks(count);
+        unlock_file(file);
+        return 0;
+    }
+
+    // the data goes to its new home first, with one write, and the inode is
+    // then committed pointing at it; whichever copy of each block ends up
+    // unused is released afterwards
+    char data[MAX_DATA_BLOCKS * BLOCK_SIZE];
+    for (unsigned int i = 0; i < count; i++) {
+        read_block(old[i], data + i * BLOCK_SIZE);
+    }
+    journal_write_data_blocks(new[0], data, count);
+
+    block_num_t unused[MAX_DATA_BLOCKS];
+    unsigned int moved = 0, num_entries = inode_num_entries(&inode);
+    for (unsigned int i = 0, j = 0; i < num_entries; i++) {
+        if (!inode.contents.inode.data_blocks[i]) {
+            continue;
+        }
+        if (move_block(old[j], new[j]) == 0) { // else it was shared since
+            inode.contents.inode.data_blocks[i] = new[j];
+            unused[j] = old[j];
+            moved++;
+        } else {
+            unused[j] = new[j];
+        }
+        j++;
+    }
+    journal_begin();
+    journal_write_block(file->inode_num, &inode);
+    int committed = journal_end() == 0;
+    if (!committed) {
+        // the inode still points at the old blocks: they get their
+        // fingerprints back, and the copies are the ones released
+        for (unsigned int j = 0; j < count; j++) {
+            if (unused[j] == old[j]) {
+                move_block(new[j], old[j]);
             }
+            unused[j] = new[j];
+        }
+        moved = 0;
+    }
+    unlock_file(file);
 
+    int freed = release_blocks(unused, count);
+    if (freed > 0) {
+        unreserve_blocks(freed);
+    }
+    if (committed) {
+        file->first = lowest_block(new, count);
+    }
+    return moved;
+}
 
-            write_block(cur.contents.dirnode.entries[i].block_num, &found);
-            return E_SUCCESS;
-            return E_UNKNOWN;
+static int compare_first_blocks(const void* a, const void* b) {
+    const struct defrag_file* x = a;
+    const struct defrag_file* y = b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+
+/* jfs_frag_stats
+ *   measures how fragmented the files and the free space are (see struct
+ *   jfs_frag_stats)
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_UNKNOWN (out of memory)
+ */
+int jfs_frag_stats(struct jfs_frag_stats* buf) {
+    memset(buf, 0, sizeof(*buf));
+    struct defrag_state* state = malloc(sizeof(struct defrag_state));
+    int ret = state ? defrag_collect(state) : E_UNKNOWN;
+    if (ret != E_SUCCESS) {
+        if (state) {
+            free(state->files);
         }
+        free(state);
+        return E_UNKNOWN;
     }
-    return E_NOT_EXISTS;
+
+    for (unsigned int i = 0; i < state->num_files; i++) {
+        struct block inode;
+        if (!lock_file(&state->files[i], &inode)) {
+            continue;
+        }
+        block_num_t blocks[MAX_DATA_BLOCKS];
+        unsigned int count = file_blocks(&inode, blocks);
+        unlock_file(&state->files[i]);
+        if (count) {
+            unsigned int extents = count_extents(blocks, count);
+            buf->files++;
+            buf->fragmented_files += extents > 1;
+            buf->extents += extents;
+            buf->data_blocks += count;
+        }
+    }
+    free(state->files);
+    free(state);
+
+    // free space, up to the tables and the journal
+    unsigned int run = 0;
+    for (block_num_t block = 2; block < RESERVED_START; block++) {
+        if (block_allocated(block)) {
+            run = 0;
+            buf->tail_free_blocks = 0;
+            continue;
+        }
+        buf->free_blocks++;
+        buf->tail_free_blocks++;
+        buf->free_extents += run++ == 0;
+        if (run > buf->largest_free_extent) {
+            buf->largest_free_extent = run;
+        }
+    }
+    return E_SUCCESS;
 }
 
 
-/* jfs_read
- *   reads the specified file and copies its contents into the buffer, up to a
- *   maximum of *ptr_count bytes copied (but obviously no more than the file
- *   size, either)
- * file_name - name of the file to read
- * buf - buffer where the file data should be written
- * ptr_count - pointer to a count variable (allocated by the caller) that
- *   contains the size of buf when it's passed in, and will be modified to
- *   contain the number of bytes actually written to buf (e.g., if the file is
- *   smaller than the buffer) if this function is successful
+/* jfs_defrag
+ *   defragments the disk while it is in use.  Buffered appends are flushed
+ *   first; then the data blocks of every fragmented file are moved into one
+ *   run of consecutive blocks, after its inode where there is room, and
+ *   finally every file's data is moved down to the first run of free blocks
+ *   before it (going through the files from the lowest data block up), so
+ *   that free space gathers at the end of the disk, before the tables and
+ *   journal.  Directory blocks and inodes stay where they are, since
+ *   sessions hold their numbers; so do files with shared blocks (see
+ *   jfs_clone).  Each file is moved under its own locks, so other calls
+ *   only wait for the file being moved.
+ * blocks_moved - if not NULL, receives the number of data blocks moved
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR
+ *   E_UNKNOWN (out of memory, or buffered appends could not be flushed)
  */
-int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
-    struct block cur;
-    read_block(current_dir, &cur);
-    for (int i = 0; i < cur.contents.dirnode.num_entries; i++) {
-        if (strcmp(cur.contents.dirnode.entries[i].name, file_name) == 0) {
-            if (is_dir(cur.contents.dirnode.entries[i].block_num)) {
-                return E_IS_DIR;
-            }
-            struct block inode;
-            read_block(cur.contents.dirnode.entries[i].block_num, &inode);
-            if (*ptr_count > inode.contents.inode.file_size) {
-                *ptr_count = inode.contents.inode.file_size;
+int jfs_defrag(unsigned int* blocks_moved) {
+    uint64_t start = trace_begin();
+    unsigned int moved = 0;
+    struct defrag_state* state = malloc(sizeof(struct defrag_state));
+    int ret = state && delayed_flush_all() == 0 ? defrag_collect(state) : E_UNKNOWN;
+
+    if (ret == E_SUCCESS) {
+        for (unsigned int i = 0; i < state->num_files; i++) {
+            moved += relocate_file(&state->files[i], 0);
+        }
+        qsort(state->files, state->num_files, sizeof(struct defrag_file), compare_first_blocks);
+        for (unsigned int i = 0; i < state->num_files; i++) {
+            if (state->files[i].first) {
+                moved += relocate_file(&state->files[i], 1);
             }
+        }
+    }
+    if (state) {
+        free(state->files);
+    }
+    free(state);
 
-            int i;
-            int num_blocks = *ptr_count / BLOCK_SIZE;
-            struct block data_block;
-            for (i = 0; i < num_blocks; i++) {
-                read_block(inode.contents.inode.data_blocks[i], &data_block);
-                memcpy(buf + i * BLOCK_SIZE, &data_block, BLOCK_SIZE);
-            }
-            int remainder = *ptr_count - i * BLOCK_SIZE;
-            if (remainder != 0) { // write last block
-                read_block(inode.contents.inode.data_blocks[i], &data_block);
-                memcpy(buf + i * BLOCK_SIZE, &data_block, remainder);
-            }
+    if (blocks_moved) {
+        *blocks_moved = moved;
+    }
+    trace_call(start, TRACE_DEFRAG, 0, ret, "");
+    return ret;
+}
 
-            return E_SUCCESS;
-        }
+
+/* jfs_set_dedup
+ *   turns deduplication of appended data on or off (it starts off).  While
+ *   it is on, every full data block an append writes is looked up by its
+ *   fingerprint, and if a block with the same contents is already on disk
+ *   the file shares that block instead of taking a new one; the blocks it
+ *   does write are fingerprinted so later appends can share them.  Shared
+ *   blocks are copied before they are changed and freed with their last
+ *   reference, as for jfs_clone().
+ * enabled - nonzero to turn deduplication on
+ */
+void jfs_set_dedup(int enabled) {
+    uint64_t start = trace_begin();
+    __atomic_store_n(&dedup_enabled, enabled != 0, __ATOMIC_RELAXED);
+    trace_call(start, TRACE_SET_DEDUP, 0, E_SUCCESS, "u", enabled);
+}
+
+
+/* jfs_sync
+ *   makes every completed operation durable by flushing buffered appends and
+ *   writing the batched journal transactions to the log on disk (they are
+ *   otherwise written once enough of them have accumulated, or at unmount)
+ * returns 0 on success or -1 on error; errors should only occur due to
+ *   errors in the underlying disk syscalls.
+ */
+int jfs_sync() {
+    uint64_t start = trace_begin();
+    int ret = delayed_flush_all();
+    if (journal_flush() < 0) {
+        ret = -1;
     }
-    return E_NOT_EXISTS;
+    trace_call(start, TRACE_SYNC, 0, ret, "");
+    return ret;
+}
+
+
+/* jfs_trace_start
+ *   starts recording every jfs_* call made from here on (except
+ *   jfs_session_init, jfs_cache_stats and the tracing calls themselves) to
+ *   a new trace file, with its arguments, return code and timing; see
+ *   trace.h for the format and the replay tool for a reader.  A trace that
+ *   is already being written is closed first.
+ * filename - file to write the trace to
+ * returns 0 on success or -1 if the file could not be written
+ */
+int jfs_trace_start(const char* filename) {
+    return trace_open(filename);
+}
+
+
+/* jfs_trace_stop
+ *   stops the trace started by jfs_trace_start and writes out the rest of it
+ *   (jfs_unmount does this too)
+ * returns 0 on success or -1 if the file could not be written
+ */
+int jfs_trace_stop() {
+    return trace_close();
 }
 
 
@@ -551,6 +3087,15 @@ int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
  *   errors in the underlying disk syscalls.
  */
 int jfs_unmount() {
-  int ret = bfs_unmount();
+  int ret = delayed_flush_all();
+  if (bfs_unmount() < 0) {
+    ret = -1;
+  }
+  if (trace_close() < 0) {
+    ret = -1;
+  }
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    pthread_rwlock_destroy(&block_locks[i]);
+  }
   return ret;
 }
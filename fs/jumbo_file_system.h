@@ -11,7 +11,10 @@
 #define MAX_DIR_ENTRIES ((BLOCK_SIZE - sizeof(uint16_t) - sizeof(uint32_t)) / (sizeof(block_num_t) + MAX_NAME_LENGTH + 1))
 
 // maximum number of data blocks that can be used to store a file
-#define MAX_DATA_BLOCKS ((BLOCK_SIZE - sizeof(uint32_t) - sizeof(uint32_t)) / sizeof(block_num_t))
+#define MAX_DATA_BLOCKS ((BLOCK_SIZE - sizeof(uint32_t) - sizeof(uint16_t) - sizeof(uint16_t)) / sizeof(block_num_t))
+
+// files up to this many bytes keep their data in the inode block itself
+#define INLINE_DATA_SIZE (MAX_DATA_BLOCKS * sizeof(block_num_t))
 
 // maximum size (in bytes) that a file can be
 #define MAX_FILE_SIZE (MAX_DATA_BLOCKS * BLOCK_SIZE)
@@ -22,8 +25,35 @@ struct stats {
   uint32_t is_dir;                // 0 if it is a directory, 1 if it is a regular file
   char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
   block_num_t block_num;          // of the dir block, or the inode (for regular files)
-  uint16_t num_data_blocks;       // not counting the inode (ignored if is_dir is 0)
+  uint16_t num_data_blocks;       // allocated, not counting the inode or holes; 0 for inline files (ignored if is_dir is 0)
   uint32_t file_size;             // in bytes (ignored if is_dir is 0)
+  uint32_t physical_size;         // bytes of disk the data takes up, num_data_blocks * BLOCK_SIZE; less than
+                                  // file_size for sparse and compressed files (ignored if is_dir is 0)
+};
+
+// Fragmentation measured by jfs_frag_stats()
+struct jfs_frag_stats {
+  unsigned int files;               // regular files with data blocks
+  unsigned int fragmented_files;    // those whose data is not one run of consecutive blocks
+  unsigned int extents;             // runs of consecutive data blocks over all files
+  unsigned int data_blocks;         // data blocks over all files
+  unsigned int free_blocks;         // free blocks before the tables and journal
+  unsigned int free_extents;        // runs of consecutive free blocks
+  unsigned int largest_free_extent; // in blocks
+  unsigned int tail_free_blocks;    // free blocks after the last used one (before the tables)
+};
+
+// Directory listing returned by jfs_listdir(), all in one allocation
+struct jfs_listing {
+  unsigned int num_entries;
+  struct stats entries[]; // one per entry, in the order they are stored
+};
+
+// Block cache and readahead counters (see jfs_cache_stats)
+struct jfs_cache_stats {
+  struct cache_stats cache;
+  unsigned long sequential_reads; // file reads that continued the previous one
+  unsigned long random_reads;     // file reads that did not
 };
 
 
@@ -33,8 +63,12 @@ struct block {
 
   union {
     struct {
-      uint32_t file_size; // in bytes
-      block_num_t data_blocks[MAX_DATA_BLOCKS];
+      uint16_t file_size; // in bytes
+      uint16_t flags;     // INODE_* flags below
+      union {
+        block_num_t data_blocks[MAX_DATA_BLOCKS];
+        char inline_data[INLINE_DATA_SIZE]; // used instead when INODE_INLINE is set
+      };
     } inode;
 
     struct {
@@ -43,24 +77,114 @@ struct block {
         block_num_t block_num; // block where the file's inode or directory's dir block is stored
         char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
       } entries[MAX_DIR_ENTRIES];
+      uint32_t magic;   // JFS_MAGIC in the root directory of a formatted disk (0 elsewhere)
+      uint16_t version; // JFS_VERSION in the root directory (0 elsewhere)
     } dirnode;
   } contents;
 };
 
 
-// Function comments for all of these are in jumbo_file_system.c
-int jfs_mount (const char* filename);
+// One operation of a jfs_batch() call
+struct jfs_op {
+  int op;                // one of the JFS_OP_* codes below
+  const char* name;      // file or directory in the current directory
+  const void* buf;       // data to append (JFS_OP_WRITE only)
+  unsigned short count;  // number of bytes in buf (JFS_OP_WRITE only)
+  int result;            // set by jfs_batch() to the operation's return code
+};
+
+#define JFS_OP_MKDIR  1 // like jfs_mkdir(name)
+#define JFS_OP_CREAT  2 // like jfs_creat(name)
+#define JFS_OP_WRITE  3 // like jfs_write(name, buf, count)
+#define JFS_OP_REMOVE 4 // like jfs_remove(name)
+
+
+// One file or directory visited by jfs_walk()
+struct jfs_walk_entry {
+  const char* path;         // from the directory walked, e.g. "docs/old/a" (valid during the call only)
+  const char* name;         // last component of path
+  unsigned int depth;       // 0 for the entries of the directory walked
+  uint32_t is_dir;          // 0 if it is a directory, 1 if it is a regular file (as in struct stats)
+  block_num_t block_num;    // of the dir block, or the inode (for regular files)
+  uint16_t num_data_blocks; // as in struct stats (ignored if is_dir is 0)
+  uint32_t file_size;       // in bytes (ignored if is_dir is 0)
+};
+
+// called by jfs_walk() for each entry; returning nonzero stops the walk
+typedef int (*jfs_walk_fn)(const struct jfs_walk_entry* entry, void* arg);
 
-int jfs_mkdir (const char* directory_name);
-int jfs_chdir (const char* directory_name);
-int jfs_ls (char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]);
-int jfs_rmdir (const char* directory_name);
+// jfs_walk() flags
+#define JFS_WALK_POSTORDER 0x1 // visit a directory after its contents rather than before
 
-int jfs_creat  (const char* file_name);
-int jfs_remove (const char* file_name);
-int jfs_stat   (const char* name, struct stats* buf);
-int jfs_write  (const char* file_name, const void* buf, unsigned short count);
-int jfs_read   (const char* file_name, void* buf, unsigned short* ptr_count);
+
+// jfs_seek() whence values
+#define JFS_SEEK_DATA 3 // find the next byte that is not in a hole
+#define JFS_SEEK_HOLE 4 // find the next byte that is in a hole
+
+
+// identify a formatted disk; stored in the root directory (block 1)
+#define JFS_MAGIC 0x4a465352 // "JFSR"
+#define JFS_VERSION 3 // changed whenever the format changes, so that older code refuses the disk
+                      // (3: compressed files, see INODE_COMPRESSED)
+
+
+// inode flags
+#define INODE_INLINE 0x1     // file data is stored in inline_data rather than in data blocks
+#define INODE_COMPRESSED 0x2 // file data is stored compressed (see CHUNK_BLOCKS)
+
+// A compressed file's data is split into chunks of CHUNK_SIZE bytes, each
+// compressed on its own.  Chunk c is stored in as few blocks as it takes, in
+// data_blocks[c * CHUNK_BLOCKS] onwards, and the chunk's other entries are 0
+// (all of them for a chunk that is a hole).  A chunk stored in as many blocks
+// as its bytes fill is not compressed; otherwise its first two bytes hold the
+// length of the compressed data that follows them.
+#define CHUNK_BLOCKS 4
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+
+
+// Per-caller state passed to the jfs_* calls (see jfs_session_init)
+struct jfs_session {
+  block_num_t current_dir; // block of the session's current directory
+};
+
+
+// Function comments for all of these are in jumbo_file_system.c
+int jfs_mount (const char* filename);
+void jfs_session_init (struct jfs_session* session);
+int jfs_check_session (struct jfs_session* session);
+
+int jfs_mkdir (struct jfs_session* session, const char* directory_name);
+int jfs_chdir (struct jfs_session* session, const char* directory_name);
+int jfs_ls (struct jfs_session* session, char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]);
+int jfs_rmdir (struct jfs_session* session, const char* directory_name);
+int jfs_walk (struct jfs_session* session, const char* directory_name, int flags, jfs_walk_fn fn, void* arg);
+int jfs_remove_tree (struct jfs_session* session, const char* name);
+
+int jfs_creat  (struct jfs_session* session, const char* file_name);
+int jfs_remove (struct jfs_session* session, const char* file_name);
+int jfs_stat   (struct jfs_session* session, const char* name, struct stats* buf);
+int jfs_listdir (struct jfs_session* session, const char* directory_name, struct jfs_listing** listing);
+void jfs_free_listing (struct jfs_listing* listing);
+int jfs_write  (struct jfs_session* session, const char* file_name, const void* buf, unsigned short count);
+int jfs_pwrite (struct jfs_session* session, const char* file_name, const void* buf, unsigned short count, unsigned int offset);
+int jfs_fallocate (struct jfs_session* session, const char* file_name, unsigned int length);
+int jfs_read   (struct jfs_session* session, const char* file_name, void* buf, unsigned short* ptr_count);
+int jfs_pread  (struct jfs_session* session, const char* file_name, void* buf, unsigned short* ptr_count, unsigned int offset);
+int jfs_seek   (struct jfs_session* session, const char* file_name, unsigned int offset, int whence, unsigned int* result);
+int jfs_clone  (struct jfs_session* session, const char* src_name, const char* dst_name);
+int jfs_set_compression (struct jfs_session* session, const char* file_name, int enabled);
+
+int jfs_batch  (struct jfs_session* session, struct jfs_op* ops, int num_ops);
+
+void jfs_cache_stats(struct jfs_cache_stats* buf);
+int jfs_frag_stats(struct jfs_frag_stats* buf);
+int jfs_defrag(unsigned int* blocks_moved);
+void jfs_set_dedup(int enabled);
+
+int jfs_sync();
+
+int jfs_trace_start(const char* filename);
+int jfs_trace_stop();
 
 int jfs_unmount();
 
@@ -77,5 +201,6 @@ int jfs_unmount();
 #define E_MAX_DIR_ENTRIES -8 // the operation would cause the maximum number of entries in a directory to be exceeded
 #define E_MAX_FILE_SIZE -9   // the operation would cause the maximum file size to be exceeded
 #define E_DISK_FULL -10      // the disk is full (or the operation would require more capacity than remains on the disk)
+#define E_NO_DATA -11        // there is no data at or after the given offset (jfs_seek)
 
 #endif // _JUMBO_FILE_SYSTEM_H_
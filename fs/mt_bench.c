@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "jumbo_file_system.h"
+
+#define DISK_FILENAME "BENCH_DISK"
+#define DEFAULT_ITERATIONS 20000
+#define DEFAULT_MAX_THREADS 8
+#define DATA_SIZE 100 // spills out of the inode, so writes allocate blocks
+
+// threads are spread over group directories so no directory overflows
+#define NUM_GROUPS 4
+#define MAX_THREADS (NUM_GROUPS * MAX_DIR_ENTRIES)
+
+static int iterations = DEFAULT_ITERATIONS;
+static pthread_barrier_t start_barrier;
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* worker
+ *   runs the benchmark loop for one thread in its own directory; every
+ *   iteration does a creat, write, read, stat, ls and remove
+ */
+void* worker(void* arg) {
+  int id = (int)(long) arg;
+  char group[16], dir[16];
+  snprintf(group, sizeof(group), "g%d", id / (int) MAX_DIR_ENTRIES);
+  snprintf(dir, sizeof(dir), "t%d", id % (int) MAX_DIR_ENTRIES);
+
+  struct jfs_session session;
+  jfs_session_init(&session);
+  jfs_chdir(&session, group);
+  jfs_mkdir(&session, dir);
+  jfs_chdir(&session, dir);
+
+  char data[DATA_SIZE], buf[DATA_SIZE];
+  memset(data, 'x', DATA_SIZE);
+  char* directories[MAX_DIR_ENTRIES+1];
+  char* files[MAX_DIR_ENTRIES+1];
+  struct stats stats;
+
+  pthread_barrier_wait(&start_barrier);
+  for (int i = 0; i < iterations; i++) {
+    unsigned short count = DATA_SIZE;
+    if (jfs_creat(&session, "f") != E_SUCCESS
+        || jfs_write(&session, "f", data, DATA_SIZE) != E_SUCCESS
+        || jfs_read(&session, "f", buf, &count) != E_SUCCESS
+        || jfs_stat(&session, "f", &stats) != E_SUCCESS
+        || jfs_ls(&session, directories, files) != E_SUCCESS
+        || jfs_remove(&session, "f") != E_SUCCESS) {
+      fprintf(stderr, "thread %d: operation failed\n", id);
+      exit(1);
+    }
+    for (int j = 0; files[j]; j++) {
+      free(files[j]);
+    }
+  }
+  pthread_barrier_wait(&start_barrier);
+
+  jfs_chdir(&session, NULL);
+  jfs_chdir(&session, group);
+  jfs_rmdir(&session, dir);
+  return NULL;
+}
+
+
+/* run
+ *   runs the benchmark with the given number of threads
+ * returns the number of operations per second
+ */
+double run(int num_threads) {
+  pthread_t threads[MAX_THREADS];
+  pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, worker, (void*)(long) i);
+  }
+
+  pthread_barrier_wait(&start_barrier);
+  double start = now();
+  pthread_barrier_wait(&start_barrier);
+  double elapsed = now() - start;
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_barrier_destroy(&start_barrier);
+  return 6.0 * iterations * num_threads / elapsed;
+}
+
+
+int main(int argc, char** argv) {
+  const char* disk = DISK_FILENAME;
+  int max_threads = DEFAULT_MAX_THREADS;
+  if (argc > 1) disk = argv[1];
+  if (argc > 2) iterations = atoi(argv[2]);
+  if (argc > 3) max_threads = atoi(argv[3]);
+  if (argc > 4 || iterations <= 0 || max_threads <= 0 || max_threads > (int) MAX_THREADS) {
+    fprintf(stderr, "usage: %s [disk_file] [iterations] [max_threads (1-%d)]\n", argv[0], (int) MAX_THREADS);
+    return 1;
+  }
+
+  double start = now();
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    return 1;
+  }
+  printf("mount: %.3f ms\n", (now() - start) * 1e3);
+  struct jfs_session session;
+  jfs_session_init(&session);
+  for (int i = 0; i < NUM_GROUPS; i++) {
+    char group[MAX_NAME_LENGTH + 1];
+    snprintf(group, sizeof(group), "g%d", i);
+    jfs_mkdir(&session, group);
+  }
+
+  printf("threads  ops/sec     speedup\n");
+  double base = 0;
+  for (int n = 1; n <= max_threads; n *= 2) {
+    double ops = run(n);
+    if (n == 1) base = ops;
+    printf("%-8d %-11.0f %.2fx\n", n, ops, ops / base);
+  }
+
+  jfs_unmount();
+  return 0;
+}
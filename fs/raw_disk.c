@@ -4,10 +4,26 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 static const char* disk_filename = NULL;
 static int disk_fd = -1;
 
+// A direct-mapped, write-through cache of single blocks read with
+// read_block() or raw_prefetch(); block n can only be in slot n % CACHE_BLOCKS
+struct cache_slot {
+  int valid;
+  int prefetched; // read ahead and not read by anyone yet
+  block_num_t block_num;
+  char data[BLOCK_SIZE];
+};
+
+static struct cache_slot cache[CACHE_BLOCKS];
+static struct cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 int raw_mount(const char* filename) {
   // open file; creat if it doesn't exist already
@@ -42,39 +58,138 @@ int raw_mount(const char* filename) {
     free(buffer);
   }
 
+  memset(cache, 0, sizeof(cache));
+  memset(&stats, 0, sizeof(stats));
   disk_filename = filename;
   return 0;
 }
 
 
 int read_block(block_num_t block_num, void* buf) {
-  // go to the block
-  if (lseek(disk_fd, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-    return -1;
+  struct cache_slot* slot = &cache[block_num % CACHE_BLOCKS];
+  pthread_mutex_lock(&cache_lock);
+  if (slot->valid && slot->block_num == block_num) {
+    stats.hits++;
+    if (slot->prefetched) {
+      stats.prefetch_hits++;
+      slot->prefetched = 0;
+    }
+    memcpy(buf, slot->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
   }
-  // read the block
-  int ret = read(disk_fd, buf, BLOCK_SIZE);
-  if (ret != BLOCK_SIZE) {
-    return -1;
+
+  // read it under the lock, so that a write of the block cannot slip in
+  // between the read and filling the slot
+  stats.misses++;
+  int ret = read_blocks(block_num, slot->data, 1);
+  slot->valid = ret == 0;
+  slot->prefetched = 0;
+  slot->block_num = block_num;
+  if (ret == 0) {
+    memcpy(buf, slot->data, BLOCK_SIZE);
   }
-  return 0;
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
 }
 
 
 int write_block(block_num_t block_num, void* buf) {
-  // go to the block
-  if (lseek(disk_fd, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+  return write_blocks(block_num, buf, 1);
+}
+
+
+int read_blocks(block_num_t first_block, void* buf, int count) {
+  // read the blocks; pread doesn't move the shared file offset
+  ssize_t len = (ssize_t) count * BLOCK_SIZE;
+  if (pread(disk_fd, buf, len, (off_t) first_block * BLOCK_SIZE) != len) {
     return -1;
   }
-  // write the block
-  int ret = write(disk_fd, buf, BLOCK_SIZE);
-  if (ret != BLOCK_SIZE) {
+  __atomic_fetch_add(&stats.blocks_read, count, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+int write_blocks(block_num_t first_block, void* buf, int count) {
+  // write the blocks; pwrite doesn't move the shared file offset
+  ssize_t len = (ssize_t) count * BLOCK_SIZE;
+  if (pwrite(disk_fd, buf, len, (off_t) first_block * BLOCK_SIZE) != len) {
     return -1;
   }
+
+  // keep cached copies of the blocks up to date
+  pthread_mutex_lock(&cache_lock);
+  stats.blocks_written += count;
+  for (int i = 0; i < count; i++) {
+    block_num_t block_num = first_block + i;
+    struct cache_slot* slot = &cache[block_num % CACHE_BLOCKS];
+    if (slot->valid && slot->block_num == block_num) {
+      memcpy(slot->data, (char*) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
   return 0;
 }
 
 
+int raw_prefetch(block_num_t first_block, int count) {
+  if (count > CACHE_BLOCKS) {
+    count = CACHE_BLOCKS;
+  }
+  pthread_mutex_lock(&cache_lock);
+
+  // nothing to do if every block is cached already
+  int i;
+  for (i = 0; i < count; i++) {
+    struct cache_slot* slot = &cache[(first_block + i) % CACHE_BLOCKS];
+    if (!slot->valid || slot->block_num != first_block + i) {
+      break;
+    }
+  }
+  if (i == count) {
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+  }
+
+  // read the blocks straight into their slots with one vectored read
+  struct iovec iov[CACHE_BLOCKS];
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = cache[(first_block + i) % CACHE_BLOCKS].data;
+    iov[i].iov_len = BLOCK_SIZE;
+  }
+  ssize_t len = (ssize_t) count * BLOCK_SIZE;
+  int ret = preadv(disk_fd, iov, count, (off_t) first_block * BLOCK_SIZE) == len ? 0 : -1;
+  for (i = 0; i < count; i++) {
+    struct cache_slot* slot = &cache[(first_block + i) % CACHE_BLOCKS];
+    int was_cached = slot->valid && slot->block_num == first_block + i;
+    slot->valid = ret == 0;
+    slot->block_num = first_block + i;
+    if (!was_cached) {
+      slot->prefetched = 1;
+      stats.prefetched++;
+    }
+  }
+  stats.prefetch_reads++;
+  if (ret == 0) {
+    __atomic_fetch_add(&stats.blocks_read, count, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+
+void raw_cache_stats(struct cache_stats* buf) {
+  pthread_mutex_lock(&cache_lock);
+  *buf = stats;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+
+int raw_sync() {
+  return fdatasync(disk_fd);
+}
+
+
 int raw_unmount() {
   disk_filename = NULL;
   return close(disk_fd);
@@ -10,11 +10,25 @@
 // and is a 16-bit unsigned integer
 typedef uint16_t block_num_t;
 
+// number of blocks the block cache holds
+#define CACHE_BLOCKS 64
+
+// Counters kept by the block cache since the disk was mounted
+struct cache_stats {
+  unsigned long hits;           // read_block() calls served from the cache
+  unsigned long misses;         // read_block() calls that went to the disk
+  unsigned long prefetched;     // blocks brought in by raw_prefetch()
+  unsigned long prefetch_hits;  // prefetched blocks read before being evicted
+  unsigned long prefetch_reads; // syscalls made by raw_prefetch()
+  unsigned long blocks_read;    // blocks read from the disk, by any call
+  unsigned long blocks_written; // blocks written to the disk
+};
+
 
 int raw_mount(const char* filename);
 
 /* read_block
- *   reads a block from the disk
+ *   reads a block from the disk, or from the block cache if it is there
  * block_num - number of the block to read
  * buf - data read from disk will be copied into this buffer
  * (precondition: buf is BLOCK_SIZE bytes long)
@@ -31,6 +45,41 @@ int read_block(block_num_t block_num, void* buf);
  */
 int write_block(block_num_t block_num, void* buf);
 
+/* read_blocks
+ *   reads count consecutive blocks starting at first_block with a single
+ *   syscall
+ * (precondition: buf is count * BLOCK_SIZE bytes long)
+ * returns 0 on success or -1 on failure
+ */
+int read_blocks(block_num_t first_block, void* buf, int count);
+
+/* write_blocks
+ *   writes count consecutive blocks starting at first_block with a single
+ *   syscall
+ * (precondition: buf is count * BLOCK_SIZE bytes long)
+ * returns 0 on success or -1 on failure
+ */
+int write_blocks(block_num_t first_block, void* buf, int count);
+
+/* raw_prefetch
+ *   reads count consecutive blocks starting at first_block into the block
+ *   cache with a single vectored read, so that later read_block() calls for
+ *   them do not have to go to the disk
+ * returns 0 on success or -1 on failure
+ */
+int raw_prefetch(block_num_t first_block, int count);
+
+/* raw_cache_stats
+ *   copies the block cache's counters into buf
+ */
+void raw_cache_stats(struct cache_stats* buf);
+
+/* raw_sync
+ *   waits until every block written so far has reached stable storage
+ * returns 0 on success or -1 on failure
+ */
+int raw_sync();
+
 int raw_unmount();
 
 #endif // _RAW_DISK_H_
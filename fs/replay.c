@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "jumbo_file_system.h"
+#include "journal.h"
+#include "trace.h"
+
+#define DISK_FILENAME "REPLAY_DISK"
+#define READ_BUFFER_SIZE 65536 // room for any count a read can ask for
+
+// Timings of one kind of call
+struct op_timing {
+  double* latencies; // seconds, one per call replayed
+  unsigned int count, capacity;
+  double total;
+  double recorded;   // seconds the calls took when they were traced
+  unsigned int mismatches; // calls that returned something other than what was recorded
+};
+
+// The directory on the replay disk of each directory block of the traced
+// disk that a session was in, learnt from the jfs_chdir() calls that took it
+// there (0 if there was none in the trace)
+static block_num_t dirs[NUM_BLOCKS];
+
+// Reads the arguments of a record, in order
+struct cursor {
+  const char* next;
+  const char* end;
+};
+
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+static int get(struct cursor* cursor, void* bytes, uint32_t count) {
+  if ((size_t) (cursor->end - cursor->next) < count) {
+    return -1;
+  }
+  memcpy(bytes, cursor->next, count);
+  cursor->next += count;
+  return 0;
+}
+
+
+/* get_name
+ *   decodes an s argument into name, which must have room for 256 bytes
+ * returns name, NULL if the argument is NULL, or NULL with *error set if the
+ *   record is cut short
+ */
+static char* get_name(struct cursor* cursor, char* name, int* error) {
+  uint8_t length;
+  if (get(cursor, &length, 1) < 0) {
+    *error = 1;
+    return NULL;
+  }
+  if (0xff == length) {
+    return NULL;
+  }
+  if (get(cursor, name, length) < 0) {
+    *error = 1;
+    return NULL;
+  }
+  name[length] = '\0';
+  return name;
+}
+
+
+static uint32_t get_u(struct cursor* cursor, int* error) {
+  uint32_t value = 0;
+  if (get(cursor, &value, sizeof(value)) < 0) {
+    *error = 1;
+  }
+  return value;
+}
+
+
+// decodes a d argument, returning a pointer to its bytes in the record
+static const char* get_data(struct cursor* cursor, uint32_t* count, int* error) {
+  *count = get_u(cursor, error);
+  if (*error || (size_t) (cursor->end - cursor->next) < *count) {
+    *error = 1;
+    return NULL;
+  }
+  const char* data = cursor->next;
+  cursor->next += *count;
+  return data;
+}
+
+
+// whether a block is a directory on the replay disk, so that a call can run in it
+static int is_directory(block_num_t block) {
+  struct block contents;
+  return block_allocated(block) && journal_read_block(block, &contents) == 0 && contents.is_dir == 0;
+}
+
+
+static int skip_entry(const struct jfs_walk_entry* entry, void* arg) {
+  (void) entry;
+  (void) arg;
+  return 0;
+}
+
+
+/* replay_call
+ *   decodes the arguments of one record and makes the call it records, in
+ *   the directory of the replay disk that stands for the traced one
+ * elapsed - receives the seconds the call took
+ * refused - set if the call was not made because its directory is not known
+ *   (or is no longer a directory) on the replay disk
+ * returns the call's return code, or sets *error if the record is malformed
+ */
+static int replay_call(const struct trace_record* record, const char* args, double* elapsed, int* error,
+                       int* refused) {
+  static char buf[READ_BUFFER_SIZE];
+  struct cursor cursor = { args, args + record->length };
+  char name[256], other[256];
+  struct jfs_session session;
+
+  if (record->op != TRACE_SET_DEDUP && record->op != TRACE_SYNC && record->op != TRACE_DEFRAG) {
+    if (record->dir == 0 || record->dir >= NUM_BLOCKS) {
+      *error = 1;
+      return E_UNKNOWN;
+    }
+    session.current_dir = dirs[record->dir];
+    if (!session.current_dir || !is_directory(session.current_dir)) {
+      *refused = 1;
+      return E_UNKNOWN;
+    }
+  }
+
+  int ret = E_UNKNOWN;
+  double start;
+  switch (record->op) {
+  case TRACE_CHDIR: {
+    char* n = get_name(&cursor, name, error);
+    uint32_t traced_dir = get_u(&cursor, error);
+    if (*error || traced_dir == 0 || traced_dir >= NUM_BLOCKS) {
+      *error = 1;
+      return E_UNKNOWN;
+    }
+    start = now();
+    ret = jfs_chdir(&session, n);
+    *elapsed = now() - start;
+    if (E_SUCCESS == ret) {
+      dirs[traced_dir] = session.current_dir;
+    }
+    break;
+  }
+
+  case TRACE_MKDIR:
+  case TRACE_RMDIR:
+  case TRACE_REMOVE_TREE:
+  case TRACE_CREAT:
+  case TRACE_REMOVE:
+  case TRACE_STAT: {
+    char* n = get_name(&cursor, name, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    struct stats stats;
+    start = now();
+    switch (record->op) {
+    case TRACE_MKDIR:       ret = jfs_mkdir(&session, n); break;
+    case TRACE_RMDIR:       ret = jfs_rmdir(&session, n); break;
+    case TRACE_REMOVE_TREE: ret = jfs_remove_tree(&session, n); break;
+    case TRACE_CREAT:       ret = jfs_creat(&session, n); break;
+    case TRACE_REMOVE:      ret = jfs_remove(&session, n); break;
+    case TRACE_STAT:        ret = jfs_stat(&session, n, &stats); break;
+    }
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_LS: {
+    char* directories[MAX_DIR_ENTRIES+1];
+    char* files[MAX_DIR_ENTRIES+1];
+    start = now();
+    ret = jfs_ls(&session, directories, files);
+    *elapsed = now() - start;
+    if (E_SUCCESS == ret) {
+      for (int i = 0; directories[i]; i++) {
+        free(directories[i]);
+      }
+      for (int i = 0; files[i]; i++) {
+        free(files[i]);
+      }
+    }
+    break;
+  }
+
+  case TRACE_LISTDIR: {
+    char* n = get_name(&cursor, name, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    struct jfs_listing* listing;
+    start = now();
+    ret = jfs_listdir(&session, n, &listing);
+    *elapsed = now() - start;
+    if (E_SUCCESS == ret) {
+      jfs_free_listing(listing);
+    }
+    break;
+  }
+
+  case TRACE_WALK: {
+    char* n = get_name(&cursor, name, error);
+    uint32_t flags = get_u(&cursor, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    start = now();
+    ret = jfs_walk(&session, n, flags, skip_entry, NULL);
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_WRITE:
+  case TRACE_PWRITE: {
+    char* n = get_name(&cursor, name, error);
+    uint32_t offset = TRACE_PWRITE == record->op ? get_u(&cursor, error) : 0;
+    uint32_t count;
+    const char* data = get_data(&cursor, &count, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    start = now();
+    if (TRACE_WRITE == record->op) {
+      ret = jfs_write(&session, n, data, count);
+    } else {
+      ret = jfs_pwrite(&session, n, data, count, offset);
+    }
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_FALLOCATE:
+  case TRACE_SET_COMPRESSION: {
+    char* n = get_name(&cursor, name, error);
+    uint32_t value = get_u(&cursor, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    start = now();
+    if (TRACE_FALLOCATE == record->op) {
+      ret = jfs_fallocate(&session, n, value);
+    } else {
+      ret = jfs_set_compression(&session, n, value);
+    }
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_READ:
+  case TRACE_PREAD:
+  case TRACE_SEEK: {
+    char* n = get_name(&cursor, name, error);
+    uint32_t first = get_u(&cursor, error);
+    uint32_t second = TRACE_READ != record->op ? get_u(&cursor, error) : 0;
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    unsigned short count = first;
+    unsigned int result;
+    start = now();
+    switch (record->op) {
+    case TRACE_READ:  ret = jfs_read(&session, n, buf, &count); break;
+    case TRACE_PREAD: ret = jfs_pread(&session, n, buf, &count, second); break;
+    case TRACE_SEEK:  ret = jfs_seek(&session, n, first, second, &result); break;
+    }
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_CLONE: {
+    char* src = get_name(&cursor, name, error);
+    char* dst = get_name(&cursor, other, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    start = now();
+    ret = jfs_clone(&session, src, dst);
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_BATCH: {
+    uint32_t num_ops = get_u(&cursor, error);
+    if (*error || num_ops > record->length) {
+      *error = 1;
+      return E_UNKNOWN;
+    }
+    struct jfs_op* ops = calloc(num_ops + 1, sizeof(struct jfs_op));
+    char (*names)[256] = malloc((num_ops + 1) * sizeof(*names));
+    for (uint32_t i = 0; i < num_ops && !*error; i++) {
+      uint8_t op = 0;
+      uint32_t count = 0;
+      if (get(&cursor, &op, 1) < 0) {
+        *error = 1;
+      }
+      ops[i].op = op;
+      ops[i].name = get_name(&cursor, names[i], error);
+      ops[i].buf = get_data(&cursor, &count, error);
+      ops[i].count = count;
+    }
+    if (!*error) {
+      start = now();
+      ret = jfs_batch(&session, ops, num_ops);
+      *elapsed = now() - start;
+    }
+    free(names);
+    free(ops);
+    break;
+  }
+
+  case TRACE_SET_DEDUP: {
+    uint32_t enabled = get_u(&cursor, error);
+    if (*error) {
+      return E_UNKNOWN;
+    }
+    start = now();
+    jfs_set_dedup(enabled);
+    ret = E_SUCCESS;
+    *elapsed = now() - start;
+    break;
+  }
+
+  case TRACE_SYNC:
+    start = now();
+    ret = jfs_sync();
+    *elapsed = now() - start;
+    break;
+
+  case TRACE_DEFRAG:
+    start = now();
+    ret = jfs_defrag(NULL);
+    *elapsed = now() - start;
+    break;
+
+  default:
+    *error = 1;
+  }
+  return ret;
+}
+
+
+static void add_timing(struct op_timing* timing, double elapsed, const struct trace_record* record, int ret) {
+  if (timing->count == timing->capacity) {
+    timing->capacity = timing->capacity ? timing->capacity * 2 : 64;
+    timing->latencies = realloc(timing->latencies, timing->capacity * sizeof(double));
+  }
+  timing->latencies[timing->count++] = elapsed;
+  timing->total += elapsed;
+  timing->recorded += record->duration / 1e9;
+  if (ret != record->result) {
+    timing->mismatches++;
+  }
+}
+
+
+/* main
+ *   Replays a trace written by jfs_trace_start() against a fresh disk, one
+ *   call after another with no pauses between them, and prints the timing of
+ *   each kind of call next to how long it took when it was traced.  A call
+ *   runs in the replay disk's copy of the directory the traced session was
+ *   in: the one the replayed jfs_chdir() calls that took a session there
+ *   reached.  Calls made in a directory no replayed jfs_chdir() reached (e.g.
+ *   because the session was there before the trace started) are refused
+ *   rather than made in whatever the block holds on the replay disk.  Files
+ *   that were on the traced disk before the trace started are not on the
+ *   replay disk, so calls whose results differ from the trace are counted.
+ */
+int main(int argc, char** argv) {
+  const char* disk = DISK_FILENAME;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:")) != -1) {
+    if ('d' == opt) {
+      disk = optarg;
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-d disk_file] trace_file\n", argv[0]);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[optind], "rb");
+  if (!file) {
+    perror(argv[optind]);
+    return 1;
+  }
+  struct trace_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC
+      || header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+    fclose(file);
+    return 1;
+  }
+
+  remove(disk);
+  if (jfs_mount(disk) != 0) {
+    perror("mount failed");
+    fclose(file);
+    return 1;
+  }
+
+  dirs[1] = 1; // every session starts in the root directory
+  struct op_timing timings[TRACE_NUM_OPS];
+  memset(timings, 0, sizeof(timings));
+  struct trace_record record;
+  char* args = NULL;
+  uint32_t capacity = 0;
+  unsigned long num_records = 0, refused = 0;
+  int ret = 0, got;
+  double start = now();
+  while ((got = trace_read(file, &record, &args, &capacity)) > 0) {
+    int error = 0, refuse = 0;
+    double elapsed = 0;
+    int result = record.op < TRACE_NUM_OPS ? replay_call(&record, args, &elapsed, &error, &refuse) : E_UNKNOWN;
+    if (record.op >= TRACE_NUM_OPS || error) {
+      fprintf(stderr, "record %lu: bad record\n", num_records);
+      ret = 1;
+      break;
+    }
+    if (refuse) {
+      if (!refused) {
+        fprintf(stderr, "record %lu: %s in directory block %u, which the replay has not reached\n",
+                num_records, trace_op_names[record.op], (unsigned int) record.dir);
+      }
+      refused++;
+      num_records++;
+      continue;
+    }
+    add_timing(&timings[record.op], elapsed, &record, result);
+    num_records++;
+  }
+  if (got < 0) {
+    fprintf(stderr, "record %lu: trace is cut short\n", num_records);
+    ret = 1;
+  }
+  double total = now() - start;
+  jfs_unmount();
+  fclose(file);
+  free(args);
+
+  unsigned long mismatches = 0;
+  printf("%-16s %8s %10s %10s %10s %10s %12s %10s\n", "op", "count", "total_ms", "mean_us", "p50_us",
+         "p99_us", "traced_us", "mismatch");
+  for (int op = 1; op < TRACE_NUM_OPS; op++) {
+    struct op_timing* timing = &timings[op];
+    if (!timing->count) {
+      continue;
+    }
+    qsort(timing->latencies, timing->count, sizeof(double), compare_doubles);
+    printf("%-16s %8u %10.3f %10.3f %10.3f %10.3f %12.3f %10u\n", trace_op_names[op], timing->count,
+           timing->total * 1e3, timing->total / timing->count * 1e6,
+           timing->latencies[timing->count / 2] * 1e6, timing->latencies[timing->count * 99 / 100] * 1e6,
+           timing->recorded / timing->count * 1e6, timing->mismatches);
+    mismatches += timing->mismatches;
+    free(timing->latencies);
+  }
+  printf("%lu calls replayed in %.3f ms, %lu with results other than those traced\n", num_records - refused,
+         total * 1e3, mismatches);
+  if (refused) {
+    printf("%lu calls refused: made in directories the replay could not find\n", refused);
+  }
+  return ret || mismatches || refused;
+}
@@ -0,0 +1,164 @@
+#include "trace.h"
+#include "jumbo_file_system.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_BUFFER_SIZE (64 * 1024) // stdio buffer of the trace file
+#define NULL_NAME 0xff                // length byte of a NULL name
+
+const char* trace_op_names[TRACE_NUM_OPS] = {
+  "", "mkdir", "chdir", "ls", "rmdir", "walk", "remove_tree", "creat", "remove", "stat", "write",
+  "pwrite", "fallocate", "read", "pread", "seek", "clone", "set_compression", "batch", "set_dedup",
+  "sync", "listdir", "defrag"
+};
+
+static FILE* trace_file;  // NULL when not tracing
+static int tracing;       // read without the lock by trace_begin()
+static uint64_t trace_epoch;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int trace_open(const char* filename) {
+  FILE* file = fopen(filename, "wb");
+  if (!file) {
+    return -1;
+  }
+  setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+  struct trace_header header = { TRACE_MAGIC, TRACE_VERSION };
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    fclose(file);
+    return -1;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  FILE* old = trace_file;
+  trace_file = file;
+  trace_epoch = now_ns();
+  __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+  return old && fclose(old) != 0 ? -1 : 0;
+}
+
+
+int trace_close() {
+  pthread_mutex_lock(&trace_lock);
+  FILE* file = trace_file;
+  trace_file = NULL;
+  __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+  return file && fclose(file) != 0 ? -1 : 0;
+}
+
+
+uint64_t trace_begin() {
+  return __atomic_load_n(&tracing, __ATOMIC_ACQUIRE) ? now_ns() : 0;
+}
+
+
+// appends length bytes to a growing argument buffer
+static void put(char** args, uint32_t* length, uint32_t* capacity, const void* bytes, uint32_t count) {
+  if (!count) {
+    return;
+  }
+  if (*length + count > *capacity) {
+    *capacity = (*length + count) * 2 + 64;
+    *args = realloc(*args, *capacity);
+  }
+  memcpy(*args + *length, bytes, count);
+  *length += count;
+}
+
+static void put_name(char** args, uint32_t* length, uint32_t* capacity, const char* name) {
+  uint8_t name_length = name ? strnlen(name, NULL_NAME - 1) : NULL_NAME;
+  put(args, length, capacity, &name_length, 1);
+  if (name) {
+    put(args, length, capacity, name, name_length);
+  }
+}
+
+static void put_data(char** args, uint32_t* length, uint32_t* capacity, const void* data, uint32_t count) {
+  put(args, length, capacity, &count, sizeof(count));
+  put(args, length, capacity, data, count);
+}
+
+
+void trace_call(uint64_t start, int op, block_num_t dir, int result, const char* format, ...) {
+  if (!start) {
+    return;
+  }
+  uint64_t end = now_ns();
+
+  // encode the arguments before taking the lock
+  char* args = NULL;
+  uint32_t length = 0, capacity = 0;
+  va_list ap;
+  va_start(ap, format);
+  for (const char* f = format; *f; f++) {
+    if ('s' == *f) {
+      put_name(&args, &length, &capacity, va_arg(ap, const char*));
+    } else if ('u' == *f) {
+      uint32_t value = va_arg(ap, unsigned int);
+      put(&args, &length, &capacity, &value, sizeof(value));
+    } else if ('d' == *f) {
+      const void* data = va_arg(ap, const void*);
+      put_data(&args, &length, &capacity, data, va_arg(ap, unsigned int));
+    } else if ('b' == *f) {
+      const struct jfs_op* ops = va_arg(ap, const struct jfs_op*);
+      uint32_t num_ops = va_arg(ap, int);
+      put(&args, &length, &capacity, &num_ops, sizeof(num_ops));
+      for (uint32_t i = 0; i < num_ops; i++) {
+        uint8_t batch_op = ops[i].op;
+        put(&args, &length, &capacity, &batch_op, 1);
+        put_name(&args, &length, &capacity, ops[i].name);
+        int is_write = JFS_OP_WRITE == ops[i].op;
+        put_data(&args, &length, &capacity, ops[i].buf, is_write ? ops[i].count : 0);
+      }
+    }
+  }
+  va_end(ap);
+
+  struct trace_record record;
+  memset(&record, 0, sizeof(record));
+  record.duration = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+  record.result = result;
+  record.length = length;
+  record.dir = dir;
+  record.op = op;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_file) {
+    record.time = start > trace_epoch ? start - trace_epoch : 0;
+    fwrite(&record, sizeof(record), 1, trace_file);
+    if (length) {
+      fwrite(args, 1, length, trace_file);
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+  free(args);
+}
+
+
+int trace_read(FILE* file, struct trace_record* record, char** args, uint32_t* capacity) {
+  size_t got = fread(record, 1, sizeof(*record), file);
+  if (got == 0) {
+    return 0;
+  }
+  if (got != sizeof(*record)) {
+    return -1;
+  }
+  if (record->length > *capacity) {
+    *capacity = record->length;
+    *args = realloc(*args, *capacity);
+  }
+  return fread(*args, 1, record->length, file) == record->length ? 1 : -1;
+}
@@ -0,0 +1,100 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "raw_disk.h"
+
+// A trace file is a struct trace_header followed by one record per call.
+// Each record is a struct trace_record followed by length bytes of
+// arguments.  Records are written when calls return, so a call made from a
+// jfs_walk() callback comes before the walk itself.
+#define TRACE_MAGIC 0x4a465452 // "JFTR"
+#define TRACE_VERSION 2
+
+struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct trace_record {
+  uint64_t time;     // ns from the start of the trace to the call
+  uint32_t duration; // ns the call took
+  int32_t result;    // its return code
+  uint32_t length;   // bytes of arguments following the record
+  block_num_t dir;   // the session's current directory (0 if the call has no session)
+  uint8_t op;        // one of the TRACE_* codes below
+  uint8_t reserved;  // 0
+};
+
+// The calls traced, with the arguments recorded for each, in order.
+// Arguments are encoded as:
+//   s - a name: a length byte and that many bytes (length 0xff for NULL)
+//   u - a 32-bit unsigned integer
+//   d - data: its length as a u, then the bytes
+//   b - jfs_batch() operations: their number as a u, then for each the
+//       op as a byte, its name (s) and its data (d; empty unless a write)
+#define TRACE_MKDIR            1  // s directory_name
+#define TRACE_CHDIR            2  // s directory_name, u the current directory after the call
+#define TRACE_LS               3  //
+#define TRACE_RMDIR            4  // s directory_name
+#define TRACE_WALK             5  // s directory_name, u flags
+#define TRACE_REMOVE_TREE      6  // s name
+#define TRACE_CREAT            7  // s file_name
+#define TRACE_REMOVE           8  // s file_name
+#define TRACE_STAT             9  // s name
+#define TRACE_WRITE            10 // s file_name, d buf
+#define TRACE_PWRITE           11 // s file_name, u offset, d buf
+#define TRACE_FALLOCATE        12 // s file_name, u length
+#define TRACE_READ             13 // s file_name, u count
+#define TRACE_PREAD            14 // s file_name, u count, u offset
+#define TRACE_SEEK             15 // s file_name, u offset, u whence
+#define TRACE_CLONE            16 // s src_name, s dst_name
+#define TRACE_SET_COMPRESSION  17 // s file_name, u enabled
+#define TRACE_BATCH            18 // b ops
+#define TRACE_SET_DEDUP        19 // u enabled
+#define TRACE_SYNC             20 //
+#define TRACE_LISTDIR          21 // s directory_name
+#define TRACE_DEFRAG           22 //
+#define TRACE_NUM_OPS          23
+
+// name of each TRACE_* code, for reports
+extern const char* trace_op_names[TRACE_NUM_OPS];
+
+/* trace_open
+ *   starts writing a trace of every traced call to a new file
+ * returns 0 on success or -1 on failure
+ */
+int trace_open(const char* filename);
+
+/* trace_close
+ *   stops tracing and writes out what has not been written yet
+ * returns 0 on success or -1 on failure
+ */
+int trace_close();
+
+/* trace_begin
+ *   called when a traced call starts
+ * returns the time it started, or 0 if no trace is being written
+ */
+uint64_t trace_begin();
+
+/* trace_call
+ *   appends the record of a call to the trace, if start (from trace_begin())
+ *   is not 0
+ * format - one character per argument that follows, as for the TRACE_*
+ *   codes: a const char* for s, an unsigned int for u, a const void* and an
+ *   unsigned int length for d, and a const struct jfs_op* and int count for b
+ */
+void trace_call(uint64_t start, int op, block_num_t dir, int result, const char* format, ...);
+
+/* trace_read
+ *   reads the next record of a trace and its arguments
+ * args - receives the arguments; grown with realloc() as needed
+ * capacity - size of *args
+ * returns 1 if a record was read, 0 at the end of the trace or -1 if it is
+ *   cut short
+ */
+int trace_read(FILE* file, struct trace_record* record, char** args, uint32_t* capacity);
+
+#endif // _TRACE_H_
@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <spawn.h>
 #include <string.h>
 #include <errno.h>
 
@@ -11,13 +15,819 @@
 #define WRITE_END 1
 #define READ_END 0
 #define EXEC_FAIL 127
+#define HASH_BUCKETS 64
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"
+#define HEREDOC_TEMPLATE "/tmp/jsh-heredoc-XXXXXX"
+#define DUP_STDOUT -2 // standard error redirected to wherever standard output goes (2>&1)
+#define NO_REDIRECT -1
+#define MAX_JOBS 64
+
+extern char** environ;
+
+// COMMAND PATH CACHE
+// where each command was found in $PATH, so that $PATH is only searched the
+// first time a command runs (until hash -r empties the cache)
+struct hash_entry {
+    char* name;
+    char* path;
+    int hits; // times the command has run from the cache
+    struct hash_entry* next;
+};
+static struct hash_entry* hash_table[HASH_BUCKETS];
+
+static unsigned int hash_name(const char* name)
+{
+    unsigned int hash = 5381;
+    for (; *name; name++) {
+        hash = hash * 33 + (unsigned char) *name;
+    }
+    return hash % HASH_BUCKETS;
+}
+
+// forgets where one command is (or every command if name is NULL)
+static void hash_forget(const char* name)
+{
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        struct hash_entry** link = &hash_table[i];
+        while (*link) {
+            struct hash_entry* entry = *link;
+            if (name && strcmp(entry->name, name) != 0) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+// prints the cached commands the way bash's hash does
+static void hash_print()
+{
+    int empty = 1;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        for (struct hash_entry* entry = hash_table[i]; entry; entry = entry->next) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = 0;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (empty) {
+        printf("jsh: hash table empty\n");
+    }
+}
+
+/* find_command
+ *   finds the program to run for a command name: a name containing a '/' is
+ *   used as it is, any other is looked up in the cache and, the first time,
+ *   searched for in $PATH
+ * returns the path, or NULL if there is no such program
+ */
+static const char* find_command(const char* name)
+{
+    if (strchr(name, '/')) {
+        return name;
+    }
+    unsigned int bucket = hash_name(name);
+    for (struct hash_entry* entry = hash_table[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    const char* dirs = getenv("PATH");
+    if (!dirs) {
+        dirs = DEFAULT_PATH;
+    }
+    char candidate[PATH_MAX];
+    while (1) {
+        size_t length = strcspn(dirs, ":");
+        // an empty entry in $PATH means the current directory
+        int n = length ? snprintf(candidate, sizeof(candidate), "%.*s/%s", (int) length, dirs, name)
+                       : snprintf(candidate, sizeof(candidate), "./%s", name);
+        struct stat st;
+        if (n < (int) sizeof(candidate) && stat(candidate, &st) == 0 && S_ISREG(st.st_mode)
+            && access(candidate, X_OK) == 0) {
+            struct hash_entry* entry = malloc(sizeof(struct hash_entry));
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            entry->hits = 1;
+            entry->next = hash_table[bucket];
+            hash_table[bucket] = entry;
+            return entry->path;
+        }
+        if (dirs[length] == '\0') {
+            return NULL;
+        }
+        dirs += length + 1;
+    }
+}
+
+// REDIRECTIONS
+// the operators a word of a stage may start with, longest first; the file
+// follows in the same word or the next one
+static const struct {
+    const char* op;
+    int fd;    // the stream it replaces
+    int flags; // to open the file with, or -1 for a heredoc
+} redirect_ops[] = {
+    {"2>>", STDERR_FILENO, O_WRONLY | O_CREAT | O_APPEND},
+    {"2>", STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC},
+    {"<<", STDIN_FILENO, -1},
+    {">>", STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND},
+    {"<", STDIN_FILENO, O_RDONLY},
+    {">", STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC},
+};
+#define NUM_REDIRECT_OPS (int) (sizeof(redirect_ops) / sizeof(redirect_ops[0]))
+
+// closes the files a stage's redirections opened
+static void close_redirects(int fds[3])
+{
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+        fds[i] = NO_REDIRECT;
+    }
+}
+
+// the redirect_ops entry a word starts with, or NUM_REDIRECT_OPS
+static int find_redirect(const char* word)
+{
+    int op = 0;
+    while (op < NUM_REDIRECT_OPS && strncmp(word, redirect_ops[op].op, strlen(redirect_ops[op].op)) != 0) {
+        op++;
+    }
+    return op;
+}
+
+/* read_heredoc
+ *   reads lines of input, up to one that is just word, into a temporary file
+ *   that is already unlinked; the lines are read (and dropped) even if the
+ *   file cannot be made, so they are never taken for commands
+ * returns a descriptor reading the file from the start, or -1
+ */
+static int read_heredoc(const char* word)
+{
+    char template[] = HEREDOC_TEMPLATE;
+    int fd = mkstemp(template);
+    if (fd != -1) {
+        unlink(template);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    char line[INPUT_SIZE];
+    while (1) {
+        printf("> ");
+        fflush(stdout);
+        if (!fgets(line, INPUT_SIZE, stdin)) { // end of input ends it too
+            break;
+        }
+        size_t length = strcspn(line, "\n");
+        if (length == strlen(word) && strncmp(line, word, length) == 0) {
+            break;
+        }
+        if (fd != -1 && write(fd, line, strlen(line)) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd != -1) {
+        lseek(fd, 0, SEEK_SET);
+    }
+    return fd;
+}
+
+/* read_heredocs
+ *   reads the body of every heredoc (<<WORD) of a stage, in order.  This is
+ *   done for every stage of a line before anything else can fail, so that
+ *   no body is left in the input to be run as commands.
+ * heredoc - receives a descriptor for the body of the stage's last heredoc,
+ *   or NO_REDIRECT if it has none; the others are dropped
+ * returns 0, or -1 (with the error printed) if a body could not be kept
+ */
+static int read_heredocs(char** args, int* heredoc)
+{
+    int ret = 0;
+    *heredoc = NO_REDIRECT;
+    for (int i = 0; args[i]; i++) {
+        int op = strcmp(args[i], "2>&1") == 0 ? NUM_REDIRECT_OPS : find_redirect(args[i]);
+        if (op == NUM_REDIRECT_OPS) {
+            continue;
+        }
+        const char* word = args[i] + strlen(redirect_ops[op].op);
+        if (!*word && !(word = args[++i])) { // take_redirects() reports it
+            break;
+        }
+        if (redirect_ops[op].flags != -1) {
+            continue;
+        }
+        if (*heredoc >= 0) {
+            close(*heredoc);
+        }
+        *heredoc = read_heredoc(word);
+        if (*heredoc == -1) {
+            printf("jsh error: heredoc: %s\n", strerror(errno));
+            *heredoc = NO_REDIRECT;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* take_redirects
+ *   removes the redirections from a stage's args, opening the files they name
+ *   into fds (by the stream each replaces, NO_REDIRECT for none); the files
+ *   are closed on exec, so only the stage they are dup2()ed into gets them
+ * heredoc - the body of the stage's last heredoc, from read_heredocs(); set
+ *   to NO_REDIRECT once it is in fds
+ * returns 0, or -1 (with the error printed and nothing left open but
+ * *heredoc) if a redirection is missing its file or the file cannot be opened
+ */
+static int take_redirects(char** args, int fds[3], int* heredoc)
+{
+    fds[STDIN_FILENO] = fds[STDOUT_FILENO] = fds[STDERR_FILENO] = NO_REDIRECT;
+    int kept = 0;
+    for (int i = 0; args[i]; i++) {
+        if (strcmp(args[i], "2>&1") == 0) {
+            if (fds[STDERR_FILENO] >= 0) {
+                close(fds[STDERR_FILENO]);
+            }
+            fds[STDERR_FILENO] = DUP_STDOUT;
+            continue;
+        }
+        int op = find_redirect(args[i]);
+        if (op == NUM_REDIRECT_OPS) { // an ordinary argument
+            args[kept++] = args[i];
+            continue;
+        }
+
+        const char* file = args[i] + strlen(redirect_ops[op].op);
+        if (!*file && !(file = args[++i])) {
+            printf("jsh error: missing file after %s\n", redirect_ops[op].op);
+            close_redirects(fds);
+            return -1;
+        }
+        int fd;
+        if (redirect_ops[op].flags == -1) { // its body has been read already
+            if (*heredoc == NO_REDIRECT) { // not the last heredoc, or given away already
+                continue;
+            }
+            fd = *heredoc;
+            *heredoc = NO_REDIRECT;
+        }
+        else if ((fd = open(file, redirect_ops[op].flags | O_CLOEXEC, 0666)) == -1) {
+            printf("jsh error: %s: %s\n", file, strerror(errno));
+            close_redirects(fds);
+            return -1;
+        }
+        int stream = redirect_ops[op].fd;
+        if (fds[stream] >= 0) { // the last redirection of a stream wins
+            close(fds[stream]);
+        }
+        fds[stream] = fd;
+    }
+    args[kept] = NULL;
+    return 0;
+}
+
+/* spawn_stage
+ *   starts one stage of a pipeline with posix_spawn() (which does not copy
+ *   the shell's memory the way fork() does), with its standard input, output
+ *   and error dup2()ed from io (DUP_STDOUT for error means wherever output
+ *   goes) and every pipe of the pipeline closed in the child
+ * returns the child's pid, or -1 if it could not be started
+ */
+static pid_t spawn_stage(char** args, int io[3], int pipes[][2], int num_pipes)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (io[STDIN_FILENO] != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, io[STDIN_FILENO], STDIN_FILENO);
+    }
+    if (io[STDOUT_FILENO] != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, io[STDOUT_FILENO], STDOUT_FILENO);
+    }
+    if (io[STDERR_FILENO] == DUP_STDOUT) {
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+    else if (io[STDERR_FILENO] != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, io[STDERR_FILENO], STDERR_FILENO);
+    }
+    for (int i = 0; i < num_pipes; i++) {
+        posix_spawn_file_actions_addclose(&actions, pipes[i][READ_END]);
+        posix_spawn_file_actions_addclose(&actions, pipes[i][WRITE_END]);
+    }
+
+    pid_t pid = -1;
+    const char* path = find_command(args[0]);
+    int err = path ? posix_spawn(&pid, path, &actions, NULL, args, environ) : ENOENT;
+    if (err == ENOENT && path && path != args[0]) {
+        // the program moved since it was cached; look for it again
+        hash_forget(args[0]);
+        path = find_command(args[0]);
+        err = path ? posix_spawn(&pid, path, &actions, NULL, args, environ) : ENOENT;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err == ENOENT) {
+        printf("jsh error: Command not found: %s\n", args[0]);
+        return -1;
+    }
+    if (err) {
+        printf("jsh error: %s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// JOBS
+// pipelines started and not yet waited for: jobs[0] is the one running in
+// the foreground, and the others were started with & and are known by their
+// index.  Children are only ever reaped by reap_children(), so a foreground
+// wait also collects any background job that finishes meanwhile.
+struct job {
+    int used;
+    int num_stages;
+    pid_t pids[MAX_ARGS]; // of each stage, or 0 once reaped (or if it never started)
+    int running;          // stages not reaped yet
+    int status;           // exit status of the last stage
+    char command[INPUT_SIZE];
+};
+static struct job jobs[MAX_JOBS + 1];
+static int current_job;     // the background job started last, for fg
+static int sigchld_pipe[2]; // a byte is written to it whenever a child exits
+
+static void on_sigchld(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    char byte = 0;
+    // the write end is nonblocking: if the pipe is full, a wakeup is pending anyway
+    ssize_t ignored = write(sigchld_pipe[WRITE_END], &byte, 1);
+    (void) ignored;
+    errno = saved_errno;
+}
+
+// collects every child that has exited, without blocking
+static void reap_children()
+{
+    int wstatus;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        for (int j = 0; j <= MAX_JOBS; j++) {
+            for (int i = 0; jobs[j].used && i < jobs[j].num_stages; i++) {
+                if (jobs[j].pids[i] == pid) {
+                    jobs[j].pids[i] = 0;
+                    jobs[j].running--;
+                    if (i == jobs[j].num_stages - 1) {
+                        jobs[j].status = WEXITSTATUS(wstatus);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* wait_job
+ *   sleeps until every stage of a job has exited (waking up whenever any
+ *   child does) and removes it from the table
+ * returns the exit status of its last stage
+ */
+static int wait_job(int id)
+{
+    while (1) {
+        reap_children();
+        if (!jobs[id].running) {
+            break;
+        }
+        char bytes[64];
+        if (read(sigchld_pipe[READ_END], bytes, sizeof(bytes)) == -1 && errno != EINTR) {
+            fprintf(stderr, "wait failure\n");
+            exit(1);
+        }
+    }
+    jobs[id].used = 0;
+    return jobs[id].status;
+}
+
+// the lowest free background job number, or -1 if there is none
+static int free_job()
+{
+    for (int id = 1; id <= MAX_JOBS; id++) {
+        if (!jobs[id].used) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// the background job named by a %n or n argument, or -1 if there is none
+static int find_job(const char* arg)
+{
+    char* end;
+    long id = strtol(arg + (arg[0] == '%'), &end, 10);
+    if (*end || id < 1 || id > MAX_JOBS || !jobs[id].used) {
+        return -1;
+    }
+    return id;
+}
+
+// prints a background job, removing it from the table if it is done
+static void print_job(int id)
+{
+    if (jobs[id].running) {
+        printf("[%d] running  %s\n", id, jobs[id].command);
+    }
+    else {
+        printf("[%d] done (status %d)  %s\n", id, jobs[id].status, jobs[id].command);
+        jobs[id].used = 0;
+    }
+}
+
+// tells of the background jobs that have finished, before a prompt
+static void report_jobs()
+{
+    reap_children();
+    for (int id = 1; id <= MAX_JOBS; id++) {
+        if (jobs[id].used && !jobs[id].running) {
+            print_job(id);
+        }
+    }
+}
+
+// BUILTINS
+// each takes its args and returns its exit status
+
+static int builtin_hash(char** args)
+{
+    if (args[1] && strcmp(args[1], "-r") == 0 && !args[2]) {
+        hash_forget(NULL);
+    }
+    else if (!args[1]) {
+        hash_print();
+    }
+    else {
+        printf("jsh error: usage: hash [-r]\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_jobs(char** args)
+{
+    (void) args;
+    reap_children();
+    for (int id = 1; id <= MAX_JOBS; id++) {
+        if (jobs[id].used) {
+            print_job(id);
+        }
+    }
+    return 0;
+}
+
+// wait with no arguments waits for every background job
+static int builtin_wait(char** args)
+{
+    int status = 0;
+    if (!args[1]) {
+        for (int id = 1; id <= MAX_JOBS; id++) {
+            if (jobs[id].used) {
+                wait_job(id);
+            }
+        }
+    }
+    for (int i = 1; args[i]; i++) {
+        int id = find_job(args[i]);
+        if (id < 0) {
+            printf("jsh error: wait: no such job: %s\n", args[i]);
+            status = EXEC_FAIL;
+        }
+        else {
+            status = wait_job(id);
+        }
+    }
+    return status;
+}
+
+// fg with no argument takes the job started last (or, once that is gone, the highest numbered)
+static int builtin_fg(char** args)
+{
+    int id = -1;
+    if (args[1]) {
+        id = find_job(args[1]);
+    }
+    else if (jobs[current_job].used && current_job) {
+        id = current_job;
+    }
+    else {
+        for (int j = MAX_JOBS; j > 0 && id < 0; j--) {
+            id = jobs[j].used ? j : -1;
+        }
+    }
+    if (id < 0) {
+        printf("jsh error: fg: no such job%s%s\n", args[1] ? ": " : "", args[1] ? args[1] : "");
+        return 1;
+    }
+    printf("%s\n", jobs[id].command);
+    fflush(stdout);
+    return wait_job(id);
+}
+
+static int builtin_cd(char** args)
+{
+    const char* dir = args[1] ? args[1] : getenv("HOME");
+    if (args[1] && args[2]) {
+        printf("jsh error: cd: too many arguments\n");
+        return 1;
+    }
+    if (!dir) {
+        printf("jsh error: cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(dir) == -1) {
+        printf("jsh error: cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd))) {
+        setenv("PWD", cwd, 1);
+    }
+    return 0;
+}
+
+static int builtin_pwd(char** args)
+{
+    (void) args;
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        printf("jsh error: pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+// echo [-n] prints its arguments as they are (-n: without the newline)
+static int builtin_echo(char** args)
+{
+    int newline = !(args[1] && strcmp(args[1], "-n") == 0);
+    for (int i = newline ? 1 : 2; args[i]; i++) {
+        printf(args[i + 1] ? "%s " : "%s", args[i]);
+    }
+    if (newline) {
+        printf("\n");
+    }
+    return 0;
+}
+
+// export NAME=VALUE sets an environment variable (every jsh variable is
+// exported, so export NAME alone has nothing to do)
+static int builtin_export(char** args)
+{
+    if (!args[1]) {
+        for (char** variable = environ; *variable; variable++) {
+            printf("export %s\n", *variable);
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        size_t length = strcspn(args[i], "=");
+        size_t valid = strspn(args[i], "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+        if (!length || valid != length || (args[i][0] >= '0' && args[i][0] <= '9')) {
+            printf("jsh error: export: not a valid name: %s\n", args[i]);
+            status = 1;
+            continue;
+        }
+        if (!args[i][length]) {
+            continue;
+        }
+        args[i][length] = '\0'; // args[i] is now the name
+        setenv(args[i], args[i] + length + 1, 1);
+        if (strcmp(args[i], "PATH") == 0) { // the cached paths may not be the first in $PATH any more
+            hash_forget(NULL);
+        }
+        args[i][length] = '=';
+    }
+    return status;
+}
+
+static int builtin_true(char** args)
+{
+    (void) args;
+    return 0;
+}
+
+static int builtin_false(char** args)
+{
+    (void) args;
+    return 1;
+}
+
+static int builtin_exit(char** args)
+{
+    fflush(stdout);
+    exit(args[1] ? atoi(args[1]) : 0);
+}
+
+/* builtin_printf
+ *   printf FORMAT [ARG...] prints the arguments as the format says, with the
+ *   escapes \n \t \r \a \b \f \v \\ and the conversions %s %c %d %i %u %o
+ *   %x %X (with flags, width and precision) and %%; like the printf command,
+ *   it uses the format again while arguments are left, and uses "" (or 0) for
+ *   missing ones
+ */
+static int builtin_printf(char** args)
+{
+    if (!args[1]) {
+        printf("jsh error: usage: printf format [arg ...]\n");
+        return 1;
+    }
+    static const char escapes[] = "n\nt\tr\ra\ab\bf\fv\v\\\\";
+    char** next = args + 2; // the argument for the next conversion
+    int status = 0;
+    int used_args;
+    do {
+        used_args = 0;
+        for (const char* f = args[1]; *f; f++) {
+            if (*f == '\\' && f[1]) {
+                const char* escape = strchr(escapes, f[1]);
+                if (escape && (escape - escapes) % 2 == 0) {
+                    putchar(escape[1]);
+                    f++;
+                }
+                else {
+                    putchar(*f);
+                }
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            // hands printf() the conversion, e.g. %-8.3s, with a long long length
+            size_t length = 1 + strspn(f + 1, "-+ #0123456789.");
+            char conversion = f[length];
+            char spec[32];
+            if (!conversion || !strchr("scdiuoxX", conversion) || length > sizeof(spec) - 4) {
+                printf("\njsh error: printf: bad conversion: %s\n", f);
+                return 1;
+            }
+            const char* arg = "";
+            if (*next) {
+                arg = *next++;
+                used_args = 1;
+            }
+            char* end = NULL;
+            if (conversion == 's' || conversion == 'c') {
+                char first[2] = {arg[0], '\0'};
+                snprintf(spec, sizeof(spec), "%.*ss", (int) length, f);
+                printf(spec, conversion == 's' ? arg : first);
+            }
+            else if (conversion == 'd' || conversion == 'i') {
+                snprintf(spec, sizeof(spec), "%.*slld", (int) length, f);
+                printf(spec, strtoll(arg, &end, 0));
+            }
+            else {
+                snprintf(spec, sizeof(spec), "%.*sll%c", (int) length, f, conversion);
+                printf(spec, strtoull(arg, &end, 0));
+            }
+            if (end && *end) {
+                fprintf(stderr, "jsh error: printf: not a number: %s\n", arg);
+                status = 1;
+            }
+            f += length;
+        }
+    } while (used_args && *next);
+    return status;
+}
+
+// the builtins, by name
+static const struct builtin {
+    const char* name;
+    int (*run)(char** args); // returns the exit status
+} builtins[] = {
+    {"cd", builtin_cd},
+    {"echo", builtin_echo},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"false", builtin_false},
+    {"fg", builtin_fg},
+    {"hash", builtin_hash},
+    {"jobs", builtin_jobs},
+    {"printf", builtin_printf},
+    {"pwd", builtin_pwd},
+    {"true", builtin_true},
+    {"wait", builtin_wait},
+};
+#define NUM_BUILTINS (int) (sizeof(builtins) / sizeof(builtins[0]))
+
+// the builtin called name, or NULL if it is not one
+static const struct builtin* find_builtin(const char* name)
+{
+    for (int i = 0; i < NUM_BUILTINS; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/* run_builtin
+ *   runs a builtin in the shell itself, with the stage's redirections dup2()ed
+ *   over the shell's own streams for just as long as it runs
+ * returns the builtin's exit status
+ */
+static int run_builtin(const struct builtin* builtin, char** args, int redirects[3])
+{
+    int saved[3] = {-1, -1, -1};
+    fflush(stdout);
+    for (int fd = 0; fd < 3; fd++) {
+        if (redirects[fd] != NO_REDIRECT) {
+            saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+            dup2(redirects[fd] == DUP_STDOUT ? STDOUT_FILENO : redirects[fd], fd);
+        }
+    }
+    int status = builtin->run(args);
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved[fd] >= 0) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+    return status;
+}
+
+/* fork_builtin
+ *   starts one stage of a pipeline that is a builtin, in a child that runs it
+ *   and exits without exec()ing anything, with io and the pipes as for
+ *   spawn_stage(); what it changes (e.g. with cd) only changes the child
+ * returns the child's pid, or -1 if it could not be started
+ */
+static pid_t fork_builtin(const struct builtin* builtin, char** args, int io[3],
+                          int pipes[][2], int num_pipes)
+{
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("jsh error: %s: %s\n", args[0], strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        for (int fd = 0; fd < 3; fd++) {
+            if (io[fd] != fd) {
+                dup2(io[fd] == DUP_STDOUT ? STDOUT_FILENO : io[fd], fd);
+            }
+        }
+        for (int i = 0; i < num_pipes; i++) {
+            close(pipes[i][READ_END]);
+            close(pipes[i][WRITE_END]);
+        }
+        memset(jobs, 0, sizeof(jobs)); // the shell's jobs are not this child's to wait for
+        int status = builtin->run(args);
+        fflush(stdout);
+        _exit(status);
+    }
+    return pid;
+}
 
 int main()
 {
+    // SETS UP REAPING
+    if (pipe(sigchld_pipe) == -1) {
+        fprintf(stderr, "pipe failure\n");
+        exit(1);
+    }
+    fcntl(sigchld_pipe[READ_END], F_SETFD, FD_CLOEXEC);
+    fcntl(sigchld_pipe[WRITE_END], F_SETFD, FD_CLOEXEC);
+    fcntl(sigchld_pipe[WRITE_END], F_SETFL, O_NONBLOCK);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigchld;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP; // reading input is not interrupted
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
     // GETTING FIRST INPUT
     char str[INPUT_SIZE]; // input string
     printf("jsh$ ");
-    fgets(str, INPUT_SIZE, stdin); // gets input
+    fflush(stdout);
+    if (!fgets(str, INPUT_SIZE, stdin)) { // end of input is like exit
+        strcpy(str, "exit");
+    }
     if (ferror(stdin)) { // assert no error reading in
         fprintf(stderr, "Input Error\n");
         exit(1);
@@ -27,6 +837,23 @@ int main()
 
     // LOOP CHECKING FOR EXIT
     while(strcmp(rest, "exit") != 0) { // while rest != exit
+        // CHECKS FOR &
+        int background = 0;
+        size_t end = strlen(rest);
+        while (end > 0 && rest[end - 1] == ' ') {
+            end--;
+        }
+        if (end > 0 && rest[end - 1] == '&') { // runs in the background
+            background = 1;
+            end--;
+            while (end > 0 && rest[end - 1] == ' ') {
+                end--;
+            }
+        }
+        rest[end] = '\0';
+        char line[INPUT_SIZE]; // the command as typed, for the job table
+        strcpy(line, rest);
+
         // SEPARATES EACH COMMAND
         char* commands[MAX_ARGS]; // holds list of commands
         int c = 0;
@@ -50,100 +877,137 @@ int main()
             args[i][c] = NULL; // sets last in each row to null
         }
 
-        // MAKE PIPES
-        int pipes[MAX_ARGS][2];
+        // READS HEREDOC BODIES
+        // all of them, before anything can fail, so none is run as commands
+        int heredocs[MAX_ARGS];
+        int failed = 0;
         for (int i = 0; i < last; i++) {
-            if(pipe(pipes[i]) == -1) {
-                fprintf(stderr, "pipe failure\n");
-                exit(1);
-            }
-        }
-
-
-        // EXECUTES EACH COMMAND USING ARGS
-        int ids[MAX_ARGS];
-        for (int i = last - 1; i >= 0; i--) { // loop thru each row of args
-            int rc = fork(); // fork for each command
-            if (rc < 0) { // fork failed
-                fprintf(stderr, "fork failed\n");
-                exit(1);
-            }
-            else if (rc == 0) { // child process
-                // DUP PIPES
-                if (last != 1) { // if multiple processes
-                    int dr, dr2; // dup return used for err check
-                    if (i == 0) { // first one only writes
-                        dr = dup2(pipes[i][WRITE_END], STDOUT_FILENO);
-                        if (dr < 0) {
-                            fprintf(stderr, "dup failed\n");
-                            exit(1);
-                        }
-                    }
-                    else if (i == last - 1) { // last only reads
-                        dr = dup2(pipes[i - 1][READ_END], STDIN_FILENO);
-                        if (dr < 0) {
-                            fprintf(stderr, "dup failed\n");
-                            exit(1);
-                        }
-                    }
-                    else { // everywhere else reads and writes
-                        dr = dup2(pipes[i][WRITE_END], STDOUT_FILENO);
-                        dr2 = dup2(pipes[i - 1][READ_END], STDIN_FILENO);
-                        if (dr < 0 || dr2 < 0) {
-                            fprintf(stderr, "dup failed\n");
-                            exit(1);
-                        }
-                    }
+            failed |= read_heredocs(args[i], &heredocs[i]) == -1;
+        }
+
+        // OPENS REDIRECTED FILES
+        int redirects[MAX_ARGS][3];
+        int empty = last == 0;
+        for (int i = 0; i < last; i++) {
+            if (failed || take_redirects(args[i], redirects[i], &heredocs[i]) == -1) {
+                redirects[i][STDIN_FILENO] = redirects[i][STDOUT_FILENO] = NO_REDIRECT;
+                redirects[i][STDERR_FILENO] = NO_REDIRECT;
+                failed = 1;
+            }
+            if (heredocs[i] >= 0) { // not used after all
+                close(heredocs[i]);
+            }
+            empty |= !args[i][0];
+        }
+
+        int status = 0;
+        int id = background ? free_job() : 0; // where the pipeline goes in the job table
+        if (failed) {
+            status = 1;
+            printf("jsh status: %d\n", status);
+        }
+        else if (empty) { // blank line or empty stage: nothing to run
+            if (last > 1) {
+                printf("jsh error: empty command in pipeline\n");
+            }
+            else if (last == 1) { // just redirections, which made their files
+                printf("jsh status: %d\n", status);
+            }
+        }
+        else if (last == 1 && !background && find_builtin(args[0][0])) { // BUILTIN
+            status = run_builtin(find_builtin(args[0][0]), args[0], redirects[0]);
+            printf("jsh status: %d\n", status);
+        }
+        else if (id < 0) {
+            printf("jsh error: too many jobs\n");
+            status = 1;
+            printf("jsh status: %d\n", status);
+        }
+        else {
+            struct job* job = &jobs[id];
+            job->used = 1;
+            job->num_stages = last;
+            job->running = 0;
+            job->status = 0;
+            strcpy(job->command, line);
+            if (background && redirects[0][STDIN_FILENO] == NO_REDIRECT) {
+                // a background job must not read the shell's input
+                redirects[0][STDIN_FILENO] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+
+            // MAKE PIPES
+            // pipe i connects stage i to stage i + 1
+            int pipes[MAX_ARGS][2];
+            for (int i = 0; i < last - 1; i++) {
+                if(pipe(pipes[i]) == -1) {
+                    fprintf(stderr, "pipe failure\n");
+                    exit(1);
                 }
+            }
 
-                // CLOSE PIPES
-                for (int i = 0; i < last; i++) {
-                    if(close(pipes[i][0]) == -1) {
-                        if (errno != EBADF) { // avoid double close error
-                            fprintf(stderr, "close failure\n");
-                            exit(1);
-                        }
+            // SPAWNS EACH COMMAND USING ARGS
+            fflush(stdout); // so buffered output is not repeated by the children
+            for (int i = 0; i < last; i++) { // loop thru each row of args
+                // redirections take the place of the pipes
+                int io[3] = {i == 0 ? STDIN_FILENO : pipes[i - 1][READ_END],
+                             i == last - 1 ? STDOUT_FILENO : pipes[i][WRITE_END],
+                             STDERR_FILENO};
+                for (int fd = 0; fd < 3; fd++) {
+                    if (redirects[i][fd] != NO_REDIRECT) {
+                        io[fd] = redirects[i][fd];
                     }
-                    if(close(pipes[i][1]) == -1) {
-                        if (errno != EBADF) { // avoid double close error
-                            fprintf(stderr, "close failure\n");
-                            exit(1);
-                        }
+                }
+                const struct builtin* builtin = find_builtin(args[i][0]);
+                job->pids[i] = builtin ? fork_builtin(builtin, args[i], io, pipes, last - 1)
+                                       : spawn_stage(args[i], io, pipes, last - 1);
+                if (job->pids[i] < 0) { // never started
+                    job->pids[i] = 0;
+                    if (i == last - 1) {
+                        job->status = EXEC_FAIL;
                     }
                 }
-
-                // EXEC
-                execvp(args[i][0], args[i]); // exec row of args
-                printf("jsh error: Command not found: %s\n", args[i][0]);
-                exit(EXEC_FAIL); // exit with correct status
+                else {
+                    job->running++;
+                }
             }
-            else { // parent
-                // CLOSE PIPES
-                if(close(pipes[i][0]) == -1) {
+
+            // CLOSE PIPES
+            for (int i = 0; i < last - 1; i++) {
+                if(close(pipes[i][READ_END]) == -1 || close(pipes[i][WRITE_END]) == -1) {
                     fprintf(stderr, "close failure\n");
                     exit(1);
                 }
-                if(close(pipes[i][1]) == -1) {
-                    fprintf(stderr, "close failure\n");
-                    exit(1);
+            }
+
+            // WAITS FOR THE PIPELINE, UNLESS IT RUNS IN THE BACKGROUND
+            if (background) {
+                current_job = id;
+                printf("[%d]", id);
+                for (int i = 0; i < last; i++) {
+                    if (job->pids[i]) {
+                        printf(" %d", (int) job->pids[i]);
+                    }
                 }
-                ids[i] = rc; // sets ids at row to pid
+                printf("\n");
             }
+            else {
+                status = wait_job(id);
+            }
+            printf("jsh status: %d\n", status); // status of last pid (0 if in the background)
         }
 
-        // WAITS FOR EACH CHILD PROCESS
-        int status;
-        for (int i = 0; i < last; i++) { // go thru each pid
-            if(waitpid(ids[i], &status, 0) == -1) { // wait on pid
-                fprintf(stderr, "wait failure\n");
-                exit(1);
-            }
+        // CLOSE REDIRECTED FILES
+        for (int i = 0; i < last; i++) {
+            close_redirects(redirects[i]);
         }
-        printf("jsh status: %d\n", WEXITSTATUS(status)); // status of last pid
 
         // GETS NEXT INPUT
+        report_jobs();
         printf("jsh$ ");
-        fgets(str, INPUT_SIZE, stdin); // gets input
+        fflush(stdout);
+        if (!fgets(str, INPUT_SIZE, stdin)) { // end of input is like exit
+            strcpy(str, "exit");
+        }
         if (ferror(stdin)) { // assert no error reading in
             fprintf(stderr, "Input Error\n");
             exit(1);
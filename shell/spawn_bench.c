@@ -0,0 +1,153 @@
+// Measures how long it takes to start and finish pipelines of short
+// commands, the way jsh used to launch them (fork() and execvp() per stage)
+// and the way it does now (posix_spawn() of a path found once).
+//
+//   gcc -O2 -o spawn_bench spawn_bench.c
+//   ./spawn_bench [command] [runs]
+//
+// For pipelines of 1, 4, 16 and 64 stages of command (default true), prints
+// the mean time per pipeline and per stage for each way.
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <limits.h>
+#include <spawn.h>
+#include <string.h>
+#include <time.h>
+
+#define WRITE_END 1
+#define READ_END 0
+#define MAX_STAGES 64
+#define DEFAULT_RUNS 200
+
+extern char** environ;
+
+// the first executable called name in $PATH, searched for once like jsh does
+static int find_in_path(const char* name, char* path)
+{
+    const char* dirs = getenv("PATH");
+    while (dirs && *dirs) {
+        size_t length = strcspn(dirs, ":");
+        snprintf(path, PATH_MAX, "%.*s/%s", (int) length, dirs, name);
+        if (access(path, X_OK) == 0) {
+            return 1;
+        }
+        dirs += length + (dirs[length] == ':');
+    }
+    return 0;
+}
+
+// starts one stage with fork() and execvp(), as jsh did
+static pid_t fork_stage(char** args, int in_fd, int out_fd, int pipes[][2], int num_pipes)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        for (int i = 0; i < num_pipes; i++) {
+            close(pipes[i][READ_END]);
+            close(pipes[i][WRITE_END]);
+        }
+        execvp(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+// starts one stage with posix_spawn() of a known path, as jsh does
+static pid_t spawn_stage(const char* path, char** args, int in_fd, int out_fd,
+                         int pipes[][2], int num_pipes)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < num_pipes; i++) {
+        posix_spawn_file_actions_addclose(&actions, pipes[i][READ_END]);
+        posix_spawn_file_actions_addclose(&actions, pipes[i][WRITE_END]);
+    }
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return err ? -1 : pid;
+}
+
+// runs one pipeline of stages copies of args and waits for all of it
+static void run_pipeline(const char* path, char** args, int stages, int use_spawn)
+{
+    int pipes[MAX_STAGES][2];
+    pid_t ids[MAX_STAGES];
+    for (int i = 0; i < stages - 1; i++) {
+        if (pipe(pipes[i]) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < stages; i++) {
+        int in_fd = i == 0 ? STDIN_FILENO : pipes[i - 1][READ_END];
+        int out_fd = i == stages - 1 ? STDOUT_FILENO : pipes[i][WRITE_END];
+        ids[i] = use_spawn ? spawn_stage(path, args, in_fd, out_fd, pipes, stages - 1)
+                           : fork_stage(args, in_fd, out_fd, pipes, stages - 1);
+        if (ids[i] < 0) {
+            fprintf(stderr, "could not start %s\n", args[0]);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < stages - 1; i++) {
+        close(pipes[i][READ_END]);
+        close(pipes[i][WRITE_END]);
+    }
+    for (int i = 0; i < stages; i++) {
+        waitpid(ids[i], NULL, 0);
+    }
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    char* command = argc > 1 ? argv[1] : "true";
+    int runs = argc > 2 ? atoi(argv[2]) : DEFAULT_RUNS;
+    char path[PATH_MAX];
+    if (runs <= 0 || !find_in_path(command, path)) {
+        fprintf(stderr, "usage: %s [command] [runs]  (command must be in $PATH)\n", argv[0]);
+        return 1;
+    }
+    char* args[] = {command, NULL};
+
+    // a shell has a heap of its own, which fork() has to copy and exec() undo
+    size_t heap = 64 << 20;
+    char* ballast = malloc(heap);
+    memset(ballast, 1, heap);
+
+    printf("%-7s %-12s %14s %14s\n", "stages", "launch", "us/pipeline", "us/stage");
+    int lengths[] = {1, 4, 16, MAX_STAGES};
+    for (int l = 0; l < (int) (sizeof(lengths) / sizeof(lengths[0])); l++) {
+        for (int use_spawn = 0; use_spawn < 2; use_spawn++) {
+            run_pipeline(path, args, lengths[l], use_spawn); // warm up
+            double start = now();
+            for (int r = 0; r < runs; r++) {
+                run_pipeline(path, args, lengths[l], use_spawn);
+            }
+            double us = (now() - start) * 1e6 / runs;
+            printf("%-7d %-12s %14.1f %14.1f\n", lengths[l],
+                   use_spawn ? "posix_spawn" : "fork+execvp", us, us / lengths[l]);
+        }
+    }
+    free(ballast);
+    return 0;
+}